@@ -0,0 +1,785 @@
+/**
+ *       @file  bench.c
+ *      @brief  microbenchmarks for the Commotion Service Manager
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#include <ctype.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <avahi-common/malloc.h>
+#include <avahi-common/simple-watch.h>
+#include <avahi-common/timeval.h>
+
+#include "commotion-service-manager.h"
+#include "epoll-watch.h"
+#include "expire.h"
+#include "file-writer.h"
+#include "intern.h"
+#include "registry-reader.h"
+#include "txt-blob.h"
+#include "util.h"
+
+extern struct arguments arguments;
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static ServiceInfo *linear_find(ServiceInfo *list, const char *name) {
+  ServiceInfo *i;
+  for (i = list; i; i = i->info_next)
+    if (strcasecmp(i->name, name) == 0)
+      return i;
+  return NULL;
+}
+
+/**
+ * Lookup cost of find_service() against a plain list walk, at
+ * different registry sizes
+ */
+static void bench_find_service(int n) {
+  ServiceInfo **all = NULL, *list = NULL;
+  int j, lookups = 200000;
+  double start, indexed, linear;
+  volatile ServiceInfo *sink = NULL;
+
+  all = calloc(n, sizeof(ServiceInfo*));
+  for (j = 0; j < n; j++) {
+    all[j] = service_new();
+    snprintf(all[j]->name, sizeof(all[j]->name), "%063X", j * 2654435761u);
+    service_index_add(all[j]);
+    AVAHI_LLIST_PREPEND(ServiceInfo, info, list, all[j]);
+  }
+
+  start = now_ns();
+  for (j = 0; j < lookups; j++)
+    sink = find_service(all[j % n]->name);
+  indexed = (now_ns() - start) / lookups;
+
+  /* keep the linear walk from taking forever on big registries */
+  if (n > 1000)
+    lookups = 2000;
+  start = now_ns();
+  for (j = 0; j < lookups; j++)
+    sink = linear_find(list, all[(j * 7919) % n]->name);
+  linear = (now_ns() - start) / lookups;
+  (void)sink;
+
+  printf("find_service  %7d services: %10.1f ns/lookup (linear scan %12.1f ns/lookup)\n", n, indexed, linear);
+
+  for (j = 0; j < n; j++) {
+    service_index_remove(all[j]);
+    service_free(all[j]);
+  }
+  free(all);
+}
+
+/**
+ * The per-character realloc escape() and strcat-based txt_list_to_string()
+ * that the string builder replaced, kept here as a baseline
+ */
+static char *legacy_escape(const char *to_escape, int *escaped_len) {
+  char *escaped = NULL;
+  int i, to_escape_len = strlen(to_escape);
+  *escaped_len = 0;
+  for (i = 0; i < to_escape_len; i++) {
+    const char *rep = NULL;
+    int rep_len = 1;
+    switch (to_escape[i]) {
+      case '\"': rep = ESCAPE_QUOTE; rep_len = ESCAPE_QUOTE_LEN; break;
+      case '\n': rep = ESCAPE_LF; rep_len = ESCAPE_LF_LEN; break;
+      case '\r': rep = ESCAPE_CR; rep_len = ESCAPE_CR_LEN; break;
+    }
+    escaped = realloc(escaped, *escaped_len + rep_len + 1);
+    memcpy(escaped + *escaped_len, rep ? rep : &to_escape[i], rep_len);
+    *escaped_len += rep_len;
+    escaped[*escaped_len] = '\0';
+  }
+  return escaped;
+}
+
+static char *legacy_txt_list_to_string(AvahiStringList *txt) {
+  char *list = NULL;
+  int list_len = 0;
+  for (; txt; txt = txt->next) {
+    int escaped_len = 0;
+    char *escaped = legacy_escape((char*)txt->text, &escaped_len);
+    list = realloc(list, list_len + OPEN_DELIMITER_LEN + CLOSE_DELIMITER_LEN + escaped_len + 1);
+    list[list_len] = '\0';
+    strcat(list, OPEN_DELIMITER);
+    strcat(list, escaped ? escaped : "");
+    strcat(list, CLOSE_DELIMITER);
+    list_len += escaped_len + OPEN_DELIMITER_LEN + CLOSE_DELIMITER_LEN;
+    if (txt->next) {
+      list = realloc(list, list_len + FIELD_DELIMITER_LEN + 1);
+      strcat(list, FIELD_DELIMITER);
+      list_len += FIELD_DELIMITER_LEN;
+    }
+    free(escaped);
+  }
+  return list;
+}
+
+static AvahiStringList *make_txt(const char *desc_pattern, size_t desc_len) {
+  char *desc = malloc(desc_len + sizeof("description="));
+  size_t j;
+  AvahiStringList *txt;
+  
+  strcpy(desc, "description=");
+  for (j = 0; j < desc_len; j++)
+    desc[sizeof("description=") - 1 + j] = desc_pattern[j % strlen(desc_pattern)];
+  desc[sizeof("description=") - 1 + desc_len] = '\0';
+  txt = avahi_string_list_new(
+    "name=Community Wiki",
+    "uri=http://wiki.mesh.local:8080/",
+    "icon=http://wiki.mesh.local:8080/icon.png",
+    "type=Community",
+    "type=Collaboration",
+    "ttl=5",
+    "lifetime=86400",
+    "fingerprint=0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF",
+    "signature=0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF",
+    desc,
+    NULL);
+  free(desc);
+  return txt;
+}
+
+/**
+ * Throughput of txt_list_to_string() on a realistic announcement
+ * and on one whose description needs escaping at every byte
+ */
+static void bench_txt_list_to_string(const char *label, const char *desc_pattern, size_t desc_len) {
+  AvahiStringList *txt = make_txt(desc_pattern, desc_len);
+  int j, iterations = 20000;
+  size_t out_len = 0;
+  double start, builder, legacy;
+  char *out;
+  
+  start = now_ns();
+  for (j = 0; j < iterations; j++) {
+    out = txt_list_to_string(txt);
+    out_len = strlen(out);
+    free(out);
+  }
+  builder = (now_ns() - start) / iterations;
+  
+  start = now_ns();
+  for (j = 0; j < iterations; j++)
+    free(legacy_txt_list_to_string(txt));
+  legacy = (now_ns() - start) / iterations;
+  
+  printf("txt_list_to_string %-12s %5zu B out: %8.1f ns (%6.1f MB/s), legacy %9.1f ns (%6.1f MB/s)\n",
+         label, out_len, builder, out_len / builder * 1e3, legacy, out_len / legacy * 1e3);
+  avahi_string_list_free(txt);
+}
+
+static int legacy_isHex(const char *str, size_t len) {
+  size_t i;
+  for (i = 0; i < len; ++i)
+    if (!isxdigit(str[i]))
+      return 0;
+  return 1;
+}
+
+/**
+ * Cost of validating a signature txt field against the isxdigit() loop
+ */
+static void bench_isHex(void) {
+  const char *sig = "0123456789abcdef0123456789ABCDEF0123456789abcdef0123456789ABCDEF0123456789abcdef0123456789ABCDEF0123456789abcdef0123456789ABCDEF";
+  int j, iterations = 2000000;
+  volatile int sink = 0;
+  double start, vector, legacy;
+  
+  start = now_ns();
+  for (j = 0; j < iterations; j++)
+    sink += isHex(sig, SIG_LENGTH);
+  vector = (now_ns() - start) / iterations;
+  
+  start = now_ns();
+  for (j = 0; j < iterations; j++)
+    sink += legacy_isHex(sig, SIG_LENGTH);
+  legacy = (now_ns() - start) / iterations;
+  (void)sink;
+  
+  printf("isHex %d chars: %6.1f ns (isxdigit loop %6.1f ns)\n", SIG_LENGTH, vector, legacy);
+}
+
+static AvahiTimeout *bench_timeout_new(const AvahiPoll *api, const struct timeval *tv, AvahiTimeoutCallback callback, void *userdata) {
+  return (AvahiTimeout*)api;
+}
+static void bench_timeout_update(AvahiTimeout *t, const struct timeval *tv) {}
+static void bench_timeout_free(AvahiTimeout *t) {}
+static void bench_expired(AvahiTimeout *t, void *userdata) {}
+
+/**
+ * Cost of scheduling and cancelling service expirations, at different
+ * registry sizes. Expirations never touch the poll loop's timeout list.
+ */
+static void bench_expire(int n) {
+  AvahiPoll api = {0};
+  ExpireEntry *entries = calloc(n, sizeof(ExpireEntry));
+  double start, schedule, cancel;
+  int j;
+  
+  api.timeout_new = bench_timeout_new;
+  api.timeout_update = bench_timeout_update;
+  api.timeout_free = bench_timeout_free;
+  expire_start(&api, bench_expired);
+  
+  start = now_ns();
+  for (j = 0; j < n; j++)
+    expire_schedule(&entries[j], NULL, 60 + (j * 2654435761u) % 86400);
+  schedule = (now_ns() - start) / n;
+  
+  start = now_ns();
+  for (j = 0; j < n; j++)
+    expire_cancel(&entries[j]);
+  cancel = (now_ns() - start) / n;
+  
+  printf("expire        %7d services: %6.1f ns/schedule, %6.1f ns/cancel\n", n, schedule, cancel);
+  expire_stop();
+  free(entries);
+}
+
+/** Build a registry of n resolved services, named service-0 to service-<n-1> */
+static ServiceInfo *make_services(ServiceInfo **all, int n) {
+  ServiceInfo *list = NULL;
+  AvahiStringList *txt = NULL;
+  int j;
+  
+  for (j = 0; j < n; j++) {
+    all[j] = service_new();
+    snprintf(all[j]->name, sizeof(all[j]->name), "service-%d", j);
+    all[j]->type = intern("_commotion._tcp");
+    all[j]->domain = intern("mesh.local");
+    all[j]->host_name = intern("node.mesh.local");
+    all[j]->interface = 1;
+    all[j]->port = 80;
+    txt = make_txt("A community wiki for the mesh. ", 200);
+    service_set_txt(all[j], txt);
+    avahi_string_list_free(txt);
+    all[j]->resolved = 1;
+    AVAHI_LLIST_PREPEND(ServiceInfo, info, list, all[j]);
+  }
+  return list;
+}
+
+static void free_services(ServiceInfo **all, int n) {
+  int j;
+  
+  for (j = 0; j < n; j++)
+    service_free(all[j]);
+  free(all);
+}
+
+/**
+ * Cost of a USR1 dump: rebuilding every row, with one changed row, and
+ * with an unchanged registry
+ */
+static void bench_print_services(int n) {
+  ServiceInfo **all = calloc(n, sizeof(ServiceInfo*)), *saved = services;
+  int j, k, iterations = 50;
+  double start, full, one, unchanged;
+
+  services = make_services(all, n);
+  arguments.output_file = "/tmp/csm-bench-services.out";
+  arguments.binary_file = NULL;
+  arguments.stats_file = NULL;
+  /* as in the daemon, only serializing the dump is on the main loop */
+  file_writer_start();
+
+  start = now_ns();
+  for (k = 0; k < iterations; k++) {
+    for (j = 0; j < n; j++)
+      registry_touch(all[j]);
+    print_services();
+  }
+  full = (now_ns() - start) / iterations;
+
+  start = now_ns();
+  for (k = 0; k < iterations; k++) {
+    registry_touch(all[k % n]);
+    print_services();
+  }
+  one = (now_ns() - start) / iterations;
+
+  start = now_ns();
+  for (k = 0; k < iterations; k++)
+    print_services();
+  unchanged = (now_ns() - start) / iterations;
+
+  printf("print_services %6d services: %10.1f us full rebuild, %8.1f us one changed, %6.2f us unchanged\n",
+         n, full / 1e3, one / 1e3, unchanged / 1e3);
+  file_writer_stop();
+
+  free_services(all, n);
+  services = saved;
+  unlink("/tmp/csm-bench-services.out");
+}
+
+static void bench_idle_watch(AvahiWatch *w, int fd, AvahiWatchEvent event, void *userdata) {}
+static void bench_idle_timeout(AvahiTimeout *t, void *userdata) {}
+static void bench_ready(AvahiWatch *w, int fd, AvahiWatchEvent event, void *userdata) {
+  char c;
+  if (read(fd, &c, 1) == 1)
+    ++*(int*)userdata;
+}
+
+static int iterate_simple(void *loop) {
+  return avahi_simple_poll_iterate(loop, -1);
+}
+static int iterate_epoll(void *loop) {
+  return epoll_poll_iterate(loop, -1);
+}
+
+/**
+ * Cost of one main loop wakeup, from a byte written to a pipe to its
+ * watch callback, with n idle watches and n pending timeouts registered
+ */
+static double bench_loop(const AvahiPoll *api, int (*iterate)(void*), void *loop, int n) {
+  AvahiWatch **watches = calloc(n + 1, sizeof(AvahiWatch*));
+  AvahiTimeout **timeouts = calloc(n, sizeof(AvahiTimeout*));
+  int (*fds)[2] = calloc(n + 1, sizeof(*fds));
+  int j, fired = 0, iterations = 20000;
+  struct timeval tv;
+  double start, elapsed;
+
+  for (j = 0; j <= n; j++) {
+    if (pipe(fds[j]) < 0) {
+      perror("pipe");
+      exit(1);
+    }
+    watches[j] = api->watch_new(api, fds[j][0], AVAHI_WATCH_IN, j < n ? bench_idle_watch : bench_ready, &fired);
+  }
+  for (j = 0; j < n; j++) {
+    avahi_elapse_time(&tv, 3600 * 1000 + j, 0);
+    timeouts[j] = api->timeout_new(api, &tv, bench_idle_timeout, NULL);
+  }
+
+  start = now_ns();
+  for (j = 0; j < iterations; j++) {
+    if (write(fds[n][1], "x", 1) != 1)
+      break;
+    iterate(loop);
+  }
+  elapsed = (now_ns() - start) / iterations;
+  if (fired != iterations)
+    printf("  (only %d of %d wakeups dispatched)\n", fired, iterations);
+
+  for (j = 0; j < n; j++)
+    api->timeout_free(timeouts[j]);
+  for (j = 0; j <= n; j++) {
+    api->watch_free(watches[j]);
+    close(fds[j][0]);
+    close(fds[j][1]);
+  }
+  free(watches);
+  free(timeouts);
+  free(fds);
+  return elapsed;
+}
+
+static void bench_main_loop(int n) {
+  AvahiSimplePoll *simple = avahi_simple_poll_new();
+  EpollPoll *ep = epoll_poll_new();
+  double e, s = 0;
+
+  e = bench_loop(epoll_poll_get(ep), iterate_epoll, ep, n);
+  if (simple)
+    s = bench_loop(avahi_simple_poll_get(simple), iterate_simple, simple, n);
+  if (simple)
+    printf("main loop     %7d fds:      %8.1f ns/wakeup (AvahiSimplePoll %10.1f ns/wakeup)\n", n, e, s);
+  else
+    printf("main loop     %7d fds:      %8.1f ns/wakeup (AvahiSimplePoll unavailable)\n", n, e);
+  epoll_poll_free(ep);
+  if (simple)
+    avahi_simple_poll_free(simple);
+}
+
+/**
+ * Look up a TXT field in a row of the text dump, the way a reader has
+ * to: skip to the TXT field, then unescape entries until the key turns up
+ * @param scratch buffer for the unescaped entry, at least as long as the row
+ * @return the value, in scratch; NULL if not found
+ */
+static const char *text_row_txt(const char *line, const char *eol, const char *key, char *scratch) {
+  const char *field = line, *p;
+  size_t key_len = strlen(key);
+  char *out;
+  int k;
+  
+  /* interface;protocol;name;type;domain;host;address;port;txt */
+  for (k = 0; k < 8 && (field = memchr(field, ';', eol - field)); k++)
+    field++;
+  if (!field)
+    return NULL;
+  /* "entry","entry",... with &quot; &#10; &#13; escapes */
+  for (p = field; p < eol && *p == '"'; p++) {
+    for (out = scratch, p++; p < eol && *p != '"'; ) {
+      if (*p != '&') {
+        *out++ = *p++;
+      } else if (!strncmp(p, ESCAPE_QUOTE, ESCAPE_QUOTE_LEN)) {
+        *out++ = '"';
+        p += ESCAPE_QUOTE_LEN;
+      } else if (!strncmp(p, ESCAPE_LF, ESCAPE_LF_LEN)) {
+        *out++ = '\n';
+        p += ESCAPE_LF_LEN;
+      } else if (!strncmp(p, ESCAPE_CR, ESCAPE_CR_LEN)) {
+        *out++ = '\r';
+        p += ESCAPE_CR_LEN;
+      } else {
+        *out++ = *p++;
+      }
+    }
+    *out = '\0';
+    if ((size_t)(out - scratch) > key_len && scratch[key_len] == '=' && !strncmp(scratch, key, key_len))
+      return scratch + key_len + 1;
+    p++; /* closing quote, then the comma */
+  }
+  return NULL;
+}
+
+/** @return end of the row starting at line */
+static const char *text_row_end(const char *line, const char *end) {
+  const char *eol = memchr(line, '\n', end - line);
+  return eol ? eol : end;
+}
+
+/** Find a service's row in the text dump and look up a TXT field in it */
+static const char *text_dump_txt(const char *buf, size_t len, const char *name, const char *key, char *scratch) {
+  const char *line, *eol, *field, *end = buf + len;
+  size_t name_len = strlen(name);
+  int k;
+  
+  for (line = buf; line < end; line = eol + 1) {
+    eol = text_row_end(line, end);
+    for (field = line, k = 0; k < 2 && (field = memchr(field, ';', eol - field)); k++)
+      field++;
+    if (field && (size_t)(eol - field) > name_len && field[name_len] == ';'
+        && strncasecmp(field, name, name_len) == 0)
+      return text_row_txt(line, eol, key, scratch);
+  }
+  return NULL;
+}
+
+static char *read_file(const char *path, size_t *len) {
+  FILE *f = fopen(path, "r");
+  char *buf = NULL;
+  long size;
+  
+  if (!f)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  buf = malloc(size + 1);
+  *len = fread(buf, 1, size, f);
+  buf[*len] = '\0';
+  fclose(f);
+  return buf;
+}
+
+/**
+ * Reader side of the exports: look up one service's fingerprint in a
+ * freshly opened text dump and binary export, and in a binary export
+ * that stays mapped; then read the fingerprint of every service
+ */
+static void bench_registry_export(int n) {
+  ServiceInfo **all = calloc(n, sizeof(ServiceInfo*)), *saved = services;
+  const char *text_path = "/tmp/csm-bench-services.out", *bin_path = "/tmp/csm-bench-services.bin";
+  const CsmRegistryRecord *rec;
+  CsmRegistry reg;
+  char *buf, *scratch, name[32];
+  const char *line, *eol;
+  size_t len = 0;
+  int j, k, found = 0, iterations = 200;
+  double start, text_one, bin_one, bin_mapped, text_all, bin_all;
+  
+  services = make_services(all, n);
+  arguments.output_file = (char*)text_path;
+  arguments.binary_file = (char*)bin_path;
+  arguments.stats_file = NULL;
+  print_services();
+  
+  start = now_ns();
+  for (k = 0; k < iterations; k++) {
+    buf = read_file(text_path, &len);
+    scratch = malloc(len + 1);
+    snprintf(name, sizeof(name), "service-%d", k % n);
+    found += !!text_dump_txt(buf, len, name, "fingerprint", scratch);
+    free(scratch);
+    free(buf);
+  }
+  text_one = (now_ns() - start) / iterations;
+  
+  start = now_ns();
+  for (k = 0; k < iterations; k++) {
+    csm_registry_open(&reg, bin_path);
+    snprintf(name, sizeof(name), "service-%d", k % n);
+    found += (rec = csm_registry_find(&reg, name)) && csm_registry_txt(&reg, rec, "fingerprint", NULL);
+    csm_registry_close(&reg);
+  }
+  bin_one = (now_ns() - start) / iterations;
+  
+  /* readers normally keep the export mapped until it is replaced */
+  csm_registry_open(&reg, bin_path);
+  start = now_ns();
+  for (k = 0; k < iterations; k++) {
+    if (csm_registry_changed(&reg, bin_path)) {
+      csm_registry_close(&reg);
+      csm_registry_open(&reg, bin_path);
+    }
+    snprintf(name, sizeof(name), "service-%d", k % n);
+    found += (rec = csm_registry_find(&reg, name)) && csm_registry_txt(&reg, rec, "fingerprint", NULL);
+  }
+  bin_mapped = (now_ns() - start) / iterations;
+  csm_registry_close(&reg);
+  
+  iterations = 20;
+  start = now_ns();
+  for (k = 0; k < iterations; k++) {
+    buf = read_file(text_path, &len);
+    scratch = malloc(len + 1);
+    for (line = buf; line < buf + len; line = eol + 1) {
+      eol = text_row_end(line, buf + len);
+      found += !!text_row_txt(line, eol, "fingerprint", scratch);
+    }
+    free(scratch);
+    free(buf);
+  }
+  text_all = (now_ns() - start) / iterations;
+  
+  start = now_ns();
+  for (k = 0; k < iterations; k++) {
+    csm_registry_open(&reg, bin_path);
+    for (j = 0; j < (int)csm_registry_count(&reg); j++)
+      found += !!csm_registry_txt(&reg, csm_registry_record(&reg, j), "fingerprint", NULL);
+    csm_registry_close(&reg);
+  }
+  bin_all = (now_ns() - start) / iterations;
+  
+  printf("registry export %5d services: one lookup %7.1f us text, %6.2f us binary, %5.2f us kept mapped; all %8.1f us text, %7.1f us binary (%d found)\n",
+         n, text_one / 1e3, bin_one / 1e3, bin_mapped / 1e3, text_all / 1e3, bin_all / 1e3, found);
+  
+  free_services(all, n);
+  services = saved;
+  arguments.binary_file = NULL;
+  unlink(text_path);
+  unlink(bin_path);
+}
+
+#ifdef __GLIBC__
+/**
+ * Heap used by the type, domain and host name of n services, as
+ * separate copies and interned: a handful of service types and ten
+ * services per node, as on a typical mesh
+ */
+static void bench_intern(int n) {
+  static const char *types[] = { "_commotion._tcp", "_http._tcp", "_https._tcp", "_ssh._tcp", "_ipp._tcp" };
+  char **strs = calloc(3 * n, sizeof(char*)), host[32];
+  size_t before, copied, interned;
+  int j;
+  
+  before = mallinfo2().uordblks;
+  for (j = 0; j < n; j++) {
+    snprintf(host, sizeof(host), "node-%d.mesh.local", j / 10);
+    strs[3 * j] = avahi_strdup(types[j % 5]);
+    strs[3 * j + 1] = avahi_strdup("mesh.local");
+    strs[3 * j + 2] = avahi_strdup(host);
+  }
+  copied = mallinfo2().uordblks - before;
+  for (j = 0; j < 3 * n; j++)
+    avahi_free(strs[j]);
+  
+  before = mallinfo2().uordblks;
+  for (j = 0; j < n; j++) {
+    snprintf(host, sizeof(host), "node-%d.mesh.local", j / 10);
+    strs[3 * j] = intern(types[j % 5]);
+    strs[3 * j + 1] = intern("mesh.local");
+    strs[3 * j + 2] = intern(host);
+  }
+  interned = mallinfo2().uordblks - before;
+  printf("intern        %7d services: %8zu B copied, %7zu B interned, %6.1f KB saved per 1k services\n",
+         n, copied, interned, (copied - (double)interned) / n * 1000 / 1024);
+  for (j = 0; j < 3 * n; j++)
+    intern_release(strs[j]);
+  free(strs);
+}
+
+/**
+ * Heap used by the TXT records of n services, as a string list copy plus
+ * the formatted string, and as a blob; and the cost of finding a field
+ * in each
+ */
+static void bench_txt_storage(int n) {
+  void **copies = calloc(2 * n, sizeof(void*));
+  AvahiStringList *txt = make_txt("A community wiki for the mesh. ", 200);
+  TxtBlob *blob = NULL;
+  size_t before, listed, blobbed;
+  int j, lookups = 1000000;
+  double start, list_find, blob_find;
+  volatile const void *sink = NULL;
+
+  before = mallinfo2().uordblks;
+  for (j = 0; j < n; j++) {
+    copies[2 * j] = avahi_string_list_copy(txt);
+    copies[2 * j + 1] = txt_list_to_string(txt);
+  }
+  listed = mallinfo2().uordblks - before;
+  for (j = 0; j < n; j++) {
+    avahi_string_list_free(copies[2 * j]);
+    free(copies[2 * j + 1]);
+  }
+
+  before = mallinfo2().uordblks;
+  for (j = 0; j < n; j++)
+    copies[j] = txt_blob_new(NULL, txt, 0, 0);
+  blobbed = mallinfo2().uordblks - before;
+  blob = copies[0];
+
+  start = now_ns();
+  for (j = 0; j < lookups; j++)
+    sink = avahi_string_list_find(txt, "fingerprint");
+  list_find = (now_ns() - start) / lookups;
+  start = now_ns();
+  for (j = 0; j < lookups; j++)
+    sink = txt_blob_find(blob, "fingerprint", NULL);
+  blob_find = (now_ns() - start) / lookups;
+  (void)sink;
+
+  printf("txt storage   %7d services: %6zu B/service as list + string, %6zu B/service as blob; find %5.1f ns list, %5.1f ns blob\n",
+         n, listed / n, blobbed / n, list_find, blob_find);
+  for (j = 0; j < n; j++)
+    avahi_free(copies[j]);
+  avahi_string_list_free(txt);
+  free(copies);
+}
+
+/** A service as allocated before the slab and arenas: struct, name, TXT copy and txt apart */
+typedef struct {
+  ServiceInfo info;
+  char *name;
+  AvahiStringList *txt_lst;
+  char *txt;
+} LegacyService;
+
+static void *legacy_service_new(const char *name, AvahiStringList *txt) {
+  LegacyService *s = avahi_new0(LegacyService, 1);
+  s->name = avahi_strdup(name);
+  s->txt_lst = avahi_string_list_copy(txt);
+  s->txt = txt_list_to_string(s->txt_lst);
+  return s;
+}
+
+static void legacy_service_free(void *p) {
+  LegacyService *s = p;
+  avahi_free(s->name);
+  avahi_string_list_free(s->txt_lst);
+  free(s->txt);
+  avahi_free(s);
+}
+
+static void *pooled_service_new(const char *name, AvahiStringList *txt) {
+  ServiceInfo *i = service_new();
+  snprintf(i->name, sizeof(i->name), "%s", name);
+  service_set_txt(i, txt);
+  return i;
+}
+
+static void pooled_service_free(void *p) {
+  service_free(p);
+}
+
+/**
+ * Heap growth under refresh churn: n services, of which a random third
+ * is replaced by ones with a different description every round
+ */
+static void bench_service_churn(const char *label, int n,
+                                void *(*new_service)(const char *name, AvahiStringList *txt),
+                                void (*free_service)(void *p)) {
+  void **live = calloc(n, sizeof(void*));
+  AvahiStringList *txt = NULL;
+  char name[32];
+  size_t settled = 0, heap;
+  double start, elapsed = 0;
+  int j, k, replaced = 0, rounds = 200;
+
+  srand(1);
+  for (k = 0; k < rounds; k++) {
+    for (j = 0; j < n; j++) {
+      if (live[j] && rand() % 3)
+        continue;
+      txt = make_txt("A community wiki for the mesh. ", 32 + rand() % 400);
+      snprintf(name, sizeof(name), "service-%d-%d", j, k);
+      start = now_ns();
+      if (live[j])
+        free_service(live[j]);
+      live[j] = new_service(name, txt);
+      elapsed += now_ns() - start;
+      replaced++;
+      avahi_string_list_free(txt);
+    }
+    if (k == 10)
+      settled = mallinfo2().arena;
+  }
+  heap = mallinfo2().arena;
+  printf("service churn %-7s %5d services: %8.1f ns/replace, heap %6zu KB after 10 rounds, %6zu KB after %d\n",
+         label, n, elapsed / replaced, settled / 1024, heap / 1024, rounds);
+  for (j = 0; j < n; j++)
+    free_service(live[j]);
+  free(live);
+}
+#endif
+
+int main(int argc, char *argv[]) {
+  bench_find_service(10);
+  bench_find_service(1000);
+  bench_find_service(100000);
+  bench_txt_list_to_string("realistic", "A community wiki for the mesh. ", 1024);
+  bench_txt_list_to_string("adversarial", "\"\n\r", 1024);
+  bench_isHex();
+  bench_expire(1000);
+  bench_expire(100000);
+  bench_main_loop(10);
+  bench_main_loop(1000);
+  bench_print_services(100);
+  bench_print_services(5000);
+  bench_registry_export(100);
+  bench_registry_export(5000);
+#ifdef __GLIBC__
+  bench_intern(1000);
+  bench_intern(10000);
+  bench_txt_storage(1000);
+  bench_service_churn("legacy", 5000, legacy_service_new, legacy_service_free);
+  bench_service_churn("pooled", 5000, pooled_service_new, pooled_service_free);
+#endif
+  return 0;
+}
@@ -33,6 +33,7 @@
 #include <time.h>
 #include <net/if.h>
 #include <string.h>
+#include <unistd.h>
 #include <ctype.h>
 #ifdef USESYSLOG
 #include <syslog.h>
@@ -46,6 +47,15 @@
 
 #include "commotion-service-manager.h"
 #include "util.h"
+#include "verify.h"
+#include "refresh.h"
+#include "query.h"
+#include "journal.h"
+#include "file-writer.h"
+#include "snapshot.h"
+#include "registry-export.h"
+#include "intern.h"
+#include "pool.h"
 #include "debug.h"
 
 #ifdef USE_UCI
@@ -53,34 +63,205 @@
 #include "uci-utils.h"
 #endif
 
-// from libcommotion_serval-sas
-#define SAS_SIZE 32
-extern int keyring_send_sas_request_client(const char *sid_str, 
-				    const size_t sid_len,
-				    char *sas_buf,
-				    const size_t sas_buf_len);
-
 /** Linked list of all the local services */
 ServiceInfo *services = NULL;
 
 AvahiSimplePoll *simple_poll = NULL;
+EpollPoll *epoll_poll = NULL;
 AvahiServer *server = NULL;
 
+typedef struct BrowserInfo BrowserInfo;
+/** A service browser for one of the service types found on the mesh */
+struct BrowserInfo {
+    AvahiSServiceBrowser *browser;
+    char *type; /**< interned */
+    char *domain; /**< interned */
+    AVAHI_LLIST_FIELDS(BrowserInfo, browser_info);
+};
+
+/** Service browsers created by browse_type_callback() */
+static BrowserInfo *browsers = NULL;
+
+/** Bumped on every change to what the output file shows */
+static uint64_t registry_gen = 1;
+/** Generation last written to the output file, 0 if never. Set by the
+ * file writer once a write succeeds; read with file_writer_written_gen() */
+static uint64_t services_file_gen = 0;
+/** Generation last written to the binary export, 0 if never; as above */
+static uint64_t binary_file_gen = 0;
+static unsigned long rows_formatted = 0, dumps = 0, dumps_skipped = 0;
+static unsigned long exports = 0, exports_skipped = 0;
+static unsigned long provisional_confirmed = 0, provisional_dropped = 0;
+
 #define CO_APPEND_STR(R,S) CHECK(co_request_append_str(co_req,S,strlen(S)+1),"Failed to append to request")
 
 struct arguments arguments;
 
+/** 
+ * Open-addressed (linear probing) index over the services list, keyed
+ * on a case-folded hash of the service name. Kept in sync by
+ * add_service() and remove_service() so that find_service() doesn't
+ * have to walk the whole list on every browser event.
+ */
+static ServiceInfo **service_index = NULL;
+static size_t service_index_size = 0; /**< number of slots, always a power of 2 */
+static size_t service_index_count = 0;
+
+#define SERVICE_INDEX_MIN_SIZE 64
+
+/**
+ * Case-insensitive (ASCII) FNV-1a hash of a service name, consistent with strcasecmp
+ */
+uint32_t service_name_hash(const char *name) {
+  uint32_t hash = 2166136261u;
+  for (; *name; name++) {
+    hash ^= (unsigned char)tolower((unsigned char)*name);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int service_index_resize(size_t new_size) {
+  ServiceInfo **old_index = service_index;
+  size_t old_size = service_index_size, j, k;
+  
+  CHECK_MEM((service_index = avahi_new0(ServiceInfo*, new_size)));
+  service_index_size = new_size;
+  for (j = 0; j < old_size; j++) {
+    if (!old_index[j])
+      continue;
+    for (k = old_index[j]->name_hash & (new_size - 1); service_index[k]; k = (k + 1) & (new_size - 1));
+    service_index[k] = old_index[j];
+  }
+  avahi_free(old_index);
+  return 0;
+error:
+  service_index = old_index;
+  return -1;
+}
+
+/**
+ * Add a service to the name index
+ * @param i the service to index. i->name must be set.
+ * @return 0=success, -1=fail
+ */
+int service_index_add(ServiceInfo *i) {
+  size_t k;
+  
+  assert(i && i->name[0]);
+  
+  /* keep the load factor at or below 1/2 */
+  if (2 * (service_index_count + 1) > service_index_size
+      && service_index_resize(service_index_size ? 2 * service_index_size : SERVICE_INDEX_MIN_SIZE) < 0)
+    return -1;
+  
+  i->name_hash = service_name_hash(i->name);
+  for (k = i->name_hash & (service_index_size - 1); service_index[k]; k = (k + 1) & (service_index_size - 1));
+  service_index[k] = i;
+  service_index_count++;
+  return 0;
+}
+
+/**
+ * Remove a service from the name index, using backward-shift deletion
+ * so no tombstones are left behind
+ * @param i the service to remove
+ */
+void service_index_remove(ServiceInfo *i) {
+  size_t mask = service_index_size - 1, hole, k, home;
+  
+  if (!service_index_count)
+    return;
+  
+  for (hole = i->name_hash & mask; service_index[hole] != i; hole = (hole + 1) & mask)
+    if (!service_index[hole])
+      return; /* not indexed */
+  
+  /* shift back any entries whose probe sequence passes through the hole */
+  for (k = (hole + 1) & mask; service_index[k]; k = (k + 1) & mask) {
+    home = service_index[k]->name_hash & mask;
+    if (((k - home) & mask) >= ((k - hole) & mask)) {
+      service_index[hole] = service_index[k];
+      hole = k;
+    }
+  }
+  service_index[hole] = NULL;
+  
+  if (--service_index_count == 0) {
+    avahi_free(service_index);
+    service_index = NULL;
+    service_index_size = 0;
+  }
+}
+
 /**
  * Check if a service name is in the current list of local services
  */
 ServiceInfo *find_service(const char *name) {
-  ServiceInfo *i;
+  uint32_t hash;
+  size_t k, mask;
   
-  for (i = services; i; i = i->info_next)
-    if (strcasecmp(i->name, name) == 0)
-      return i;
-    
+  if (!service_index_count)
     return NULL;
+  
+  hash = service_name_hash(name);
+  mask = service_index_size - 1;
+  for (k = hash & mask; service_index[k]; k = (k + 1) & mask) {
+    if (service_index[k]->name_hash == hash && strcasecmp(service_index[k]->name, name) == 0)
+      return service_index[k];
+  }
+  
+  return NULL;
+}
+
+/** ServiceInfo structs, see service_new() */
+static Slab service_slab = SLAB_INIT(ServiceInfo);
+
+ServiceInfo *service_new(void) {
+    return slab_alloc(&service_slab);
+}
+
+void service_free(ServiceInfo *i) {
+    if (!i)
+        return;
+    intern_release(i->type);
+    intern_release(i->domain);
+    intern_release(i->host_name);
+    arena_free(&i->arena);
+    if (i->row)
+      free(i->row);
+    slab_free(&service_slab, i);
+}
+
+/** Room for the "expiration=<ctime>" field verify_callback() adds */
+#define EXPIRATION_FIELD_MAX 64
+
+int service_set_txt(ServiceInfo *i, AvahiStringList *txt) {
+    Arena arena = {0};
+    TxtBlob *blob = NULL;
+    char *uuid = NULL;
+    size_t size = 0;
+    
+    /* leave room for the field verify_callback() adds, so the arena is
+     * usually one block */
+    CHECK((size = txt_blob_size(txt, 1, EXPIRATION_FIELD_MAX)), "TXT records too large");
+    size = ARENA_ALIGN(size);
+    if (i->uuid)
+      size += ARENA_ALIGN(i->uuid_len + 1);
+    CHECK_MEM(arena_reserve(&arena, size) == 0);
+    
+    CHECK_MEM((blob = txt_blob_new(&arena, txt, 1, EXPIRATION_FIELD_MAX)));
+    if (i->uuid)
+      CHECK_MEM((uuid = arena_strndup(&arena, i->uuid, i->uuid_len)));
+    
+    arena_free(&i->arena);
+    i->arena = arena;
+    i->txt = blob;
+    i->uuid = uuid;
+    return 0;
+error:
+    arena_free(&arena);
+    return -1;
 }
 
 /**
@@ -95,23 +276,40 @@ ServiceInfo *find_service(const char *name) {
 ServiceInfo *add_service(AvahiIfIndex interface, AvahiProtocol protocol, const char *name, const char *type, const char *domain) {
     ServiceInfo *i;
 
-    i = avahi_new0(ServiceInfo, 1);
-
-    if (!(i->resolver = avahi_s_service_resolver_new(server, interface, protocol, name, type, domain, AVAHI_PROTO_UNSPEC, 0, resolve_callback, i))) {
-        avahi_free(i);
-        INFO("Failed to create resolver for service '%s' of type '%s' in domain '%s': %s", name, type, domain, avahi_strerror(avahi_server_errno(server)));
+    if (strlen(name) >= sizeof(i->name)) {
+        WARN("Service name too long: %s", name);
         return NULL;
     }
+    if (!(i = service_new())) {
+        ERROR("Failed to allocate service '%s'", name);
+        return NULL;
+    }
+
     i->interface = interface;
     i->protocol = protocol;
-    i->name = avahi_strdup(name);
-    i->type = avahi_strdup(type);
-    i->domain = avahi_strdup(domain);
+    strcpy(i->name, name);
+    CHECK_MEM((i->type = intern(type)));
+    CHECK_MEM((i->domain = intern(domain)));
     i->resolved = 0;
+    
+    if (!(i->resolver = avahi_s_service_resolver_new(server, interface, protocol, name, type, domain, AVAHI_PROTO_UNSPEC, 0, resolve_callback, i))) {
+        INFO("Failed to create resolver for service '%s' of type '%s' in domain '%s': %s", name, type, domain, avahi_strerror(avahi_server_errno(server)));
+        goto error;
+    }
+    
+    if (service_index_add(i) < 0) {
+        ERROR("Failed to index service '%s'", name);
+        avahi_s_service_resolver_free(i->resolver);
+        goto error;
+    }
 
     AVAHI_LLIST_PREPEND(ServiceInfo, info, services, i);
+    journal_append(JOURNAL_ADD, i);
 
     return i;
+error:
+    service_free(i);
+    return NULL;
 }
 
 /**
@@ -129,8 +327,10 @@ void remove_service(AvahiTimeout *t, void *userdata) {
     INFO("Removing service announcement: %s",i->name);
     
     /* Cancel expiration event */
-    if (!t && i->timeout)
-      avahi_simple_poll_get(simple_poll)->timeout_update(i->timeout,NULL);
+    expire_cancel(&i->expire);
+    
+    /* Drop any verification still in flight */
+    verify_cancel(i);
     
 #ifdef OPENWRT
     if (t && is_local(i)) {
@@ -161,69 +361,288 @@ void remove_service(AvahiTimeout *t, void *userdata) {
     }
 #endif
     
+    if (i->resolved) {
+      registry_touch(NULL);
+      refresh_note_churn();
+    }
+    journal_append(t ? JOURNAL_EXPIRE : JOURNAL_REMOVE, i);
+    service_index_remove(i);
     AVAHI_LLIST_REMOVE(ServiceInfo, info, services, i);
 
     if (i->resolver)
         avahi_s_service_resolver_free(i->resolver);
 
-    avahi_free(i->name);
-    avahi_free(i->type);
-    avahi_free(i->domain);
-    if (i->host_name)
-      avahi_free(i->host_name);
-    if (i->txt)
-      avahi_free(i->txt);
-    if (i->txt_lst)
-      avahi_string_list_free(i->txt_lst);
-    avahi_free(i);
+    service_free(i);
 }
 
 /**
- * Output service fields to a file
+ * Expiration scheduler callback. Services restored from the snapshot that
+ * were never confirmed by a resolve have just dropped off the mesh, so
+ * they are removed as if their browser reported them gone.
+ * @param t the scheduler's timeout
+ * @param userdata the ServiceInfo object of the expired service
+ */
+void service_expired(AvahiTimeout *t, void *userdata) {
+    ServiceInfo *i = (ServiceInfo*)userdata;
+    
+    if (i->provisional) {
+        INFO("Service restored from snapshot was not seen again: %s", i->name);
+        provisional_dropped++;
+        remove_service(NULL, i);
+    } else {
+        remove_service(t, i);
+    }
+}
+
+/**
+ * Output the fields identifying a service to a file: interface,
+ * protocol, name, type and domain
  * @param f File to output to
  * @param service the service to print
  */
-static void _print_service(FILE *f, ServiceInfo *service) {
+void print_service_id(FILE *f, ServiceInfo *service) {
     char interface_string[IF_NAMESIZE];
     const char *protocol_string;
 
-    if (!if_indextoname(service->interface, interface_string))
+    if (!if_indextoname(service->interface, interface_string)) {
         WARN("Could not resolve the interface name!");
+        interface_string[0] = '\0';
+    }
 
-    if (!(protocol_string = avahi_proto_to_string(service->protocol)))
+    if (!(protocol_string = avahi_proto_to_string(service->protocol))) {
         WARN("Could not resolve the protocol name!");
+        protocol_string = "";
+    }
 
-    fprintf(f, "%s;%s;%s;%s;%s;%s;%s;%u;%s\n", interface_string,
+    fprintf(f, "%s;%s;%s;%s;%s", interface_string,
                                protocol_string,
                                service->name,
                                service->type,
-                               service->domain,
-                               service->host_name,
+                               service->domain);
+}
+
+static void format_service(FILE *f, ServiceInfo *service) {
+    char *txt = NULL;
+    
+    /* the txt string is only needed here, and the row is cached */
+    if (service->txt && (txt = malloc(txt_blob_format(service->txt, NULL) + 1)))
+        txt_blob_format(service->txt, txt);
+    print_service_id(f, service);
+    fprintf(f, ";%s;%s;%u;%s\n", service->host_name,
                                service->address,
                                service->port,
-                               service->txt ? service->txt : "");
+                               txt ? txt : "");
+    free(txt);
+}
+
+const char *service_row(ServiceInfo *i, size_t *len) {
+    FILE *f = NULL;
+    
+    if (!i->row) {
+        if (!(f = open_memstream(&i->row, &i->row_len)))
+            return NULL;
+        format_service(f, i);
+        if (fclose(f) != 0) {
+            free(i->row);
+            i->row = NULL;
+            return NULL;
+        }
+        rows_formatted++;
+    }
+    if (len)
+        *len = i->row_len;
+    return i->row;
 }
 
 /**
- * Upon resceiving the USR1 signal, print local services
+ * Output service fields to a file
+ * @param f File to output to
+ * @param service the service to print
  */
-void print_services(int signal) {
-    ServiceInfo *i;
-    FILE *f = NULL;
+void print_service(FILE *f, ServiceInfo *service) {
+    const char *row = NULL;
+    size_t row_len = 0;
+    
+    if ((row = service_row(service, &row_len)))
+        fwrite(row, 1, row_len, f);
+    else
+        format_service(f, service);
+}
 
-    if (!(f = fopen(arguments.output_file, "w+"))) {
-        WARN("Could not open %s. Using stdout instead.", arguments.output_file);
-        f = stdout;
+void registry_touch(ServiceInfo *i) {
+    registry_gen++;
+    if (i && i->row) {
+        free(i->row);
+        i->row = NULL;
     }
+}
 
+uint64_t registry_generation(void) {
+    return registry_gen;
+}
+
+/**
+ * Output runtime counters, used to measure the daemon's behaviour on a live mesh
+ * @param f File to output to
+ */
+void write_stats(FILE *f) {
+    fprintf(f, "services=%lu\n", (unsigned long)service_index_count);
+    fprintf(f, "service_rows_formatted=%lu\n", rows_formatted);
+    fprintf(f, "services_dumps=%lu\n", dumps);
+    fprintf(f, "services_dumps_skipped=%lu\n", dumps_skipped);
+    fprintf(f, "binary_exports=%lu\n", exports);
+    fprintf(f, "binary_exports_skipped=%lu\n", exports_skipped);
+    fprintf(f, "provisional_confirmed=%lu\n", provisional_confirmed);
+    fprintf(f, "provisional_dropped=%lu\n", provisional_dropped);
+    slab_print_stats(f, "service", &service_slab);
+    arena_print_stats(f);
+    verify_print_stats(f);
+    refresh_print_stats(f);
+    expire_print_stats(f);
+    query_print_stats(f);
+    journal_print_stats(f);
+    file_writer_print_stats(f);
+    snapshot_print_stats(f);
+    intern_print_stats(f);
+#ifdef USE_UCI
+    if (arguments.uci)
+      uci_print_stats(f);
+#endif
+}
+
+/**
+ * Serialize something into a buffer and hand it to the file writer
+ * @param path file to write
+ * @param print function that writes the contents
+ */
+static void write_output_file(const char *path, void (*print)(FILE *f)) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f = NULL;
+    
+    if (!(f = open_memstream(&buf, &len))) {
+        WARN("Could not allocate buffer for %s.", path);
+        return;
+    }
+    print(f);
+    if (fclose(f) != 0) {
+        WARN("Could not serialize %s.", path);
+        free(buf);
+        return;
+    }
+    if (file_writer_submit(path, buf, len) < 0)
+        WARN("Could not write %s.", path);
+}
+
+/**
+ * Write the resolved services to a file, from their cached rows.
+ * services_file_gen is updated once the file writer has written it.
+ * @return 0=success, -1=fail
+ */
+static int write_services(const char *path) {
+    ServiceInfo *i;
+    const char *row = NULL;
+    char *buf = NULL;
+    size_t len = 0, row_len = 0;
+    
+    /* Size the dump first, formatting any rows that changed */
     for (i = services; i; i = i->info_next) {
-        if (i->resolved)
-            _print_service(f, i);
+        if (!i->resolved)
+            continue;
+        CHECK(service_row(i, &row_len), "Could not format service %s", i->name);
+        len += row_len;
     }
+    CHECK_MEM((buf = malloc(len ? len : 1)));
+    for (i = services, len = 0; i; i = i->info_next) {
+        if (!i->resolved)
+            continue;
+        row = service_row(i, &row_len);
+        memcpy(buf + len, row, row_len);
+        len += row_len;
+    }
+    return file_writer_submit_gen(path, buf, len, registry_gen, &services_file_gen);
+error:
+    return -1;
+}
 
-    if (f != stdout) {
-        fclose(f);
+/**
+ * Upon receiving the USR1 signal, print local services and runtime
+ * counters. Runs on the main loop, which takes a consistent snapshot;
+ * the files themselves are written by the file writer. The services
+ * file and binary export are only rewritten if the registry changed
+ * since they were last written.
+ */
+void print_services(void) {
+    if (arguments.output_file) {
+        if (file_writer_written_gen(&services_file_gen) == registry_gen
+            && access(arguments.output_file, F_OK) == 0) {
+            dumps_skipped++;
+        } else if (write_services(arguments.output_file) == 0) {
+            dumps++;
+        } else {
+            WARN("Could not write %s.", arguments.output_file);
+        }
+    }
+    if (arguments.binary_file) {
+        if (file_writer_written_gen(&binary_file_gen) == registry_gen
+            && access(arguments.binary_file, F_OK) == 0) {
+            exports_skipped++;
+        } else if (registry_export(arguments.binary_file, &binary_file_gen) == 0) {
+            exports++;
+        } else {
+            WARN("Could not write %s.", arguments.binary_file);
+        }
     }
+    if (arguments.stats_file)
+        write_output_file(arguments.stats_file, write_stats);
+}
+
+/**
+ * Build the template an announcement's signature is checked against
+ * @param i the service
+ * @param[out] fields txt fields of the service
+ * @param[out] len length of the template
+ * @return the template, to be freed by caller; NULL on failure
+ */
+static char *signing_template(ServiceInfo *i, TxtFields *fields, int *len) {
+  const char *types_list[TXT_MAX_TYPES];
+  int j;
+  
+  assert(i->txt);
+  
+  /* Collect the txt fields to be added to the template for verification */
+  CHECK(parse_txt_fields(i->txt,fields) == 0 && txt_fields_complete(fields),
+	"Missing or invalid TXT field(s)");
+  for (j = 0; j < fields->types_len; j++)
+    types_list[j] = fields->types[j].str;
+  
+  return createSigningTemplate(
+    i->type,
+    i->domain,
+    i->port,
+    fields->name.str,
+    atoi(fields->ttl.str),
+    fields->uri.str,
+    types_list,
+    fields->types_len,
+    fields->icon.str,
+    fields->description.str,
+    atol(fields->lifetime.str),
+    len);
+error:
+  return NULL;
+}
+
+int verdict_cache_prime(ServiceInfo *i) {
+  TxtFields fields;
+  char *tmpl = NULL;
+  int tmpl_len = 0;
+  
+  if (!(tmpl = signing_template(i, &fields, &tmpl_len)))
+    return -1;
+  verdict_cache_insert(fields.fingerprint.str, fields.signature.str, tmpl, tmpl_len, 0);
+  free(tmpl);
+  return 0;
 }
 
 /**
@@ -232,119 +651,84 @@ void print_services(int signal) {
  * @returns 0 if the signature is valid, 1 if it is invalid
  */
 int verify_announcement(ServiceInfo *i) {
-  AvahiStringList *txt;
+  TxtFields fields;
   co_obj_t *co_conn = NULL, *co_req = NULL, *co_resp = NULL;
   char *to_verify = NULL;
-  char **types_list = NULL;
-  int types_list_len = 0;
-  char *key, *val, *app, *uri, *icon, *desc, *sid, *sig;
-  unsigned int ttl = 0;
-  unsigned long lifetime = 0;
-  int j, verdict = 1, to_verify_len = 0, found = 0;
-  size_t val_len;
+  const char *sid, *sig;
+  int j, verdict = 1, to_verify_len = 0, cached;
   
-  assert(i->txt_lst);
-  
-  txt = i->txt_lst;
-  /* Loop through txt fields, to be added to the template for verification */
-  do {
-    if (avahi_string_list_get_pair(txt,&key,&val,&val_len)) {
-      if (key)
-	avahi_free(key);
-      if (val)
-	avahi_free(val);
-      continue;
-    }
-    if (!strcmp(key,"type")) {
-      /* Add 'type' fields to a list to be sorted alphabetically later */
-      CHECK_MEM((types_list = (char**)realloc(types_list,(types_list_len + 1)*sizeof(char*))));
-      types_list[types_list_len] = avahi_strdup(val);
-      types_list_len++;
-    } else if (!strcmp(key,"name"))
-      app = avahi_strdup(val);
-    else if (!strcmp(key,"ttl")) {
-      ttl = atoi(val);
-    } else if (!strcmp(key,"uri"))
-      uri = avahi_strdup(val);
-    else if (!strcmp(key,"icon"))
-      icon = avahi_strdup(val);
-    else if (!strcmp(key,"description"))
-      desc = avahi_strdup(val);
-    else if (!strcmp(key,"lifetime")) {
-      lifetime = atol(val);
-    } else if (!strcmp(key,"fingerprint"))
-      sid = avahi_strdup(val);
-    else if (!strcmp(key,"signature"))
-      sig = avahi_strdup(val);
-    avahi_free(val);
-    avahi_free(key);
-    val = key = NULL;
-  } while ((txt = avahi_string_list_get_next(txt)));
-  
-  to_verify = createSigningTemplate(
-    i->type,
-    i->domain,
-    i->port,
-    app,
-    ttl,
-    uri,
-    (const char**)types_list,
-    types_list_len,
-    icon,
-    desc,
-    lifetime,
-    &to_verify_len);
+  CHECK((to_verify = signing_template(i, &fields, &to_verify_len)), "Failed to build signing template");
+  sid = fields.fingerprint.str;
+  sig = fields.signature.str;
   
   /* Is the signature valid? 0=yes, 1=no */
   if (to_verify) {
     char sas_buf[2*SAS_SIZE+1] = {0};
     
-    for (j = 0; j < SAS_FETCH_MAX_ATTEMPTS; j++) {
-      found = keyring_send_sas_request_client(sid,strlen(sid),sas_buf,2*SAS_SIZE+1);
-      if (found)
-	break;
+    /* Unchanged re-announcements were already verified */
+    if ((cached = verdict_cache_lookup(sid,sig,to_verify,to_verify_len)) >= 0) {
+      verdict = cached;
+      goto error;
     }
-    CHECK(found,"Failed to fetch signing key");
+    
+    CHECK(sas_fetch(sid,sas_buf,2*SAS_SIZE+1),"Failed to fetch signing key");
     
     bool output;
-    CHECK((co_conn = co_connect(arguments.co_sock,strlen(arguments.co_sock)+1)),"Failed to connect to Commotion socket");
     CHECK_MEM((co_req = co_request_create()));
     CO_APPEND_STR(co_req,"verify");
     CO_APPEND_STR(co_req,sas_buf);
     CO_APPEND_STR(co_req,sig);
     CO_APPEND_STR(co_req,to_verify);
-    CHECK(co_call(co_conn,&co_resp,"serval-crypto",sizeof("serval-crypto"),co_req) && 
+    /* A pooled connection may have gone stale (e.g. commotiond restarted),
+     * so drop it and retry once on a fresh connection */
+    for (j = 0; j < 2 && !co_resp; j++) {
+      CHECK((co_conn = co_pool_get()),"Failed to connect to Commotion socket");
+      if (!co_call(co_conn,&co_resp,"serval-crypto",sizeof("serval-crypto"),co_req)) {
+	co_pool_put(co_conn, 1);
+	co_conn = NULL;
+	if (co_resp) {
+	  co_free(co_resp);
+	  co_resp = NULL;
+	}
+      }
+    }
+    CHECK(co_resp &&
       co_response_get_bool(co_resp,&output,"result",sizeof("result")),"Failed to verify signature");
     if (output == true)
       verdict = 0;
+    verdict_cache_insert(sid,sig,to_verify,to_verify_len,verdict);
   }
   
 error:
   if (co_req) co_free(co_req);
   if (co_resp) co_free(co_resp);
-  if (co_conn) co_disconnect(co_conn);
-  if (types_list) {
-    for (j = 0; j <types_list_len; ++j)
-      avahi_free(types_list[j]);
-    free(types_list);
-  }
+  if (co_conn) co_pool_put(co_conn, 0);
   if (to_verify)
     free(to_verify);
-  if (app)
-    avahi_free(app);
-  if (uri)
-    avahi_free(uri);
-  if (icon)
-    avahi_free(icon);
-  if (desc)
-    avahi_free(desc);
-  if (sid)
-    avahi_free(sid);
-  if (sig)
-    avahi_free(sig);
   return verdict;
 }
 
+/**
+ * Identify an announcement for refresh_note_failure(), so the same
+ * rejected announcement isn't counted as a new failure every cycle
+ * @return FNV-1a hash of the service's name and txt fields
+ */
+static uint64_t announcement_key(ServiceInfo *i) {
+    uint64_t hash = 14695981039346656037ULL;
+    const char *p;
+    size_t len = 0;
+    unsigned k;
+    
+    for (p = i->name; *p; p++)
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    for (k = 0; i->txt && k < i->txt->count; k++) {
+        hash = (hash ^ 0xff) * 1099511628211ULL;
+        for (p = txt_blob_record(i->txt, k, &len); len--; p++)
+            hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    return hash;
+}
+
 /**
  * Handler called whenever a service is (potentially) resolved
  * @param userdata the ServiceFile object of the service in question
@@ -352,6 +736,8 @@ error:
  *       it successfully resolves
  * @note if txt fields fail verification, the service is removed from
  *       the local list
+ * @note if the verification threads are running, the service is left
+ *       pending verification and finished off in verify_callback()
  */
 void resolve_callback(
     AvahiSServiceResolver *r,
@@ -369,14 +755,7 @@ void resolve_callback(
     void* userdata) {
     
     ServiceInfo *i = (ServiceInfo*)userdata;
-    char *lifetime_str = NULL;
-    char *val = NULL;
-    size_t val_size = 0;
-    struct timeval tv;
-    time_t current_time;
-    char* c_time_string;
-    struct tm *timestr;
-    long lifetime = 0, expiration;
+    TxtFields fields;
     
     assert(r);
 
@@ -389,111 +768,157 @@ void resolve_callback(
             avahi_address_snprint(i->address, 
                 sizeof(i->address),
                 address);
-	    i->host_name = strdup(host_name);
+	    intern_release(i->host_name);
+	    if (!(i->host_name = intern(host_name))) {
+	      ERROR("(Resolver) Out of memory: %s", name);
+	      break;
+	    }
 	    if (port < 0 || port > 65535) {
 	      WARN("(Resolver) Invalid port: %s",name);
 	      break;
 	    }
 	    i->port = port;
-	    i->txt_lst = avahi_string_list_copy(txt);
+	    if (service_set_txt(i, txt) < 0) {
+	      ERROR("(Resolver) Could not copy txt fields: %s", name);
+	      break;
+	    }
 	    
 	    /* Make sure all the required fields are there */
-	    if (!avahi_string_list_find(txt,"name") ||
-	      !avahi_string_list_find(txt,"uri") ||
-	      !avahi_string_list_find(txt,"icon") ||
-	      !avahi_string_list_find(txt,"description") ||
-	      !avahi_string_list_find(txt,"ttl") ||
-	      !avahi_string_list_find(txt,"lifetime") ||
-	      !avahi_string_list_find(txt,"signature") ||
-	      !avahi_string_list_find(txt,"fingerprint")) {
+	    if (parse_txt_fields(i->txt,&fields) < 0) {
+	      WARN("(Resolver) Too many type TXT fields: %s", name);
+	      break;
+	    }
+	    if (!txt_fields_complete(&fields)) {
 	      WARN("(Resolver) Missing TXT field(s): %s", name);
 	      break;
 	    }
 	    
 	    /* Validate TTL field */
-	    avahi_string_list_get_pair(avahi_string_list_find(txt,"ttl"),NULL,&val,NULL);
-	    if (!isValidTtl(val)) {
-	      WARN("(Resolver) Invalid TTL value: %s -> %s",name,val);
-	      avahi_free(val);
+	    if (!isValidTtl(fields.ttl.str)) {
+	      WARN("(Resolver) Invalid TTL value: %s -> %s",name,fields.ttl.str);
 	      break;
 	    }
-	    avahi_free(val);
 	    
 	    /* Validate lifetime field */
-	    avahi_string_list_get_pair(avahi_string_list_find(txt,"lifetime"),NULL,&lifetime_str,NULL);
-	    lifetime = atol(lifetime_str);
-	    if (!isValidLifetime(lifetime_str)) {
-	      WARN("(Resolver) Invalid lifetime value: %s -> %s",name,lifetime_str);
-	      avahi_free(lifetime_str);
+	    if (!isValidLifetime(fields.lifetime.str)) {
+	      WARN("(Resolver) Invalid lifetime value: %s -> %s",name,fields.lifetime.str);
 	      break;
 	    }
-	    avahi_free(lifetime_str);
+	    i->lifetime = atol(fields.lifetime.str);
 	    
 	    /* Validate fingerprint field */
-	    avahi_string_list_get_pair(avahi_string_list_find(txt,"fingerprint"),NULL,&val,&val_size);
-	    if (!isValidFingerprint(val,val_size)) {
-	      WARN("(Resolver) Invalid fingerprint: %s -> %s",name,val);
-	      avahi_free(val);
+	    if (!isValidFingerprint(fields.fingerprint.str,fields.fingerprint.len)) {
+	      WARN("(Resolver) Invalid fingerprint: %s -> %s",name,fields.fingerprint.str);
 	      break;
 	    }
-	    avahi_free(val);
 	    
 	    /* Validate (but not verify) signature field */
-	    avahi_string_list_get_pair(avahi_string_list_find(txt,"signature"),NULL,&val,&val_size);
-	    if (!isValidSignature(val,val_size)) {
-	      WARN("(Resolver) Invalid signature: %s -> %s",name,val);
-	      avahi_free(val);
+	    if (!isValidSignature(fields.signature.str,fields.signature.len)) {
+	      WARN("(Resolver) Invalid signature: %s -> %s",name,fields.signature.str);
 	      break;
 	    }
-	    avahi_free(val);
 	    
 	    // TODO: check connectivity, using commotiond socket library
 	    
 	    /* Verify signature */
-	    if (verify_announcement(i)) {
-	      INFO("Announcement signature verification failed");
-	      break;
-	    } else
-	      INFO("Announcement signature verification succeeded");
-	    
-	    /* Set expiration timer on the service */
-	    expiration = default_lifetime();
-	    if (lifetime > 0 && (expiration > lifetime || expiration == 0)) expiration = lifetime;
-	    if (expiration > 0) {
-	      avahi_elapse_time(&tv, 1000*expiration, 0);
-	      current_time = time(NULL);
-	      i->timeout = avahi_simple_poll_get(simple_poll)->timeout_new(avahi_simple_poll_get(simple_poll), &tv, remove_service, i); // create expiration event for service
-	    
-	      /* Convert expiration period into timestamp */
-	      if (current_time != ((time_t)-1)) {
-	        timestr = localtime(&current_time);
-		timestr->tm_sec += expiration;
-	        current_time = mktime(timestr);
-	        if ((c_time_string = ctime(&current_time))) {
-		  c_time_string[strlen(c_time_string)-1] = '\0'; /* ctime adds \n to end of time string; remove it */
-	          i->txt_lst = avahi_string_list_add_printf(i->txt_lst,"expiration=%s",c_time_string);
-	        }
+	    if (verify_pool_running()) {
+	      /* Hand off to the verification threads; the service stays
+	       * pending until verify_callback() is run for it */
+	      if (verify_submit(i) == 0) {
+	        avahi_s_service_resolver_free(i->resolver);
+	        i->resolver = NULL;
+	        return;
 	      }
+	      WARN("(Resolver) Failed to queue verification, verifying inline: %s", name);
 	    }
-	    
-	    if (!(i->txt = txt_list_to_string(i->txt_lst))) {
-	      ERROR("(Resolver) Could not convert txt fields to string");
-	      break;
-	    }
-	    
-#ifdef USE_UCI
-	    if (arguments.uci && uci_write(i) < 0)
-	      ERROR("(Resolver) Could not write to UCI");
-#endif
-            
-            i->resolved = 1;
+	    verify_callback(i, verify_announcement(i));
+	    return;
         }
     }
     avahi_s_service_resolver_free(i->resolver);
     i->resolver = NULL;
-    if (!i->resolved) {
-      remove_service(NULL, i);
+    refresh_note_failure(announcement_key(i));
+    remove_service(NULL, i);
+}
+
+/**
+ * Finish resolving a service once its signature has been verified. Sets
+ * the expiration timer, and adds the service to UCI if compiled with UCI
+ * support.
+ * @param i the service that was verified
+ * @param verdict result of verify_announcement(): 0 if valid, 1 if invalid
+ * @note if verification failed, the service is removed from the local list
+ */
+void verify_callback(ServiceInfo *i, int verdict) {
+    time_t current_time;
+    char* c_time_string;
+    char expiration_field[EXPIRATION_FIELD_MAX];
+    struct tm *timestr;
+    long expiration;
+    
+    if (i->resolver) {
+      avahi_s_service_resolver_free(i->resolver);
+      i->resolver = NULL;
+    }
+    
+    if (verdict) {
+      INFO("Announcement signature verification failed");
+      refresh_note_failure(announcement_key(i));
+      goto error;
+    } else
+      INFO("Announcement signature verification succeeded");
+    
+    /* Set expiration timer on the service */
+#ifdef USE_UCI
+    expiration = default_lifetime();
+#else
+    expiration = 0;
+#endif
+    if (i->lifetime > 0 && (expiration > i->lifetime || expiration == 0)) expiration = i->lifetime;
+    if (expiration > 0) {
+      current_time = time(NULL);
+      if (!expire_running() && expire_start(main_loop_get(), service_expired) < 0) {
+        ERROR("(Resolver) Could not start expiration scheduler");
+        goto error;
+      }
+      expire_schedule(&i->expire, i, expiration); // create expiration event for service
+    
+      /* Convert expiration period into timestamp */
+      if (current_time != ((time_t)-1)) {
+        timestr = localtime(&current_time);
+        timestr->tm_sec += expiration;
+        current_time = mktime(timestr);
+        if ((c_time_string = ctime(&current_time))) {
+          c_time_string[strlen(c_time_string)-1] = '\0'; /* ctime adds \n to end of time string; remove it */
+          snprintf(expiration_field, sizeof(expiration_field), "expiration=%s", c_time_string);
+          if (txt_blob_prepend(i->txt, expiration_field, strlen(expiration_field)) < 0)
+            WARN("(Resolver) No room for expiration field: %s", i->name);
+        }
+      }
+    } else {
+      /* permanent; drop any timer left over, such as the confirm timer
+       * of a service restored from the snapshot */
+      expire_cancel(&i->expire);
     }
+    
+#ifdef USE_UCI
+    if (arguments.uci && uci_write(i) < 0)
+      ERROR("(Resolver) Could not write to UCI");
+#endif
+    
+    if (i->provisional) {
+      i->provisional = 0;
+      provisional_confirmed++;
+    }
+    registry_touch(i);
+    journal_append(i->resolved ? JOURNAL_UPDATE : JOURNAL_RESOLVE, i);
+    if (!i->resolved)
+      refresh_note_churn();
+    i->resolved = 1;
+    return;
+    
+error:
+    remove_service(NULL, i);
 }
 
 /**
@@ -518,7 +943,7 @@ void browse_service_callback(
         case AVAHI_BROWSER_FAILURE:
 
             ERROR("(Browser) %s", avahi_strerror(avahi_server_errno(server)));
-            avahi_simple_poll_quit(simple_poll);
+            main_loop_quit();
             return;
 
         case AVAHI_BROWSER_NEW:
@@ -532,6 +957,15 @@ void browse_service_callback(
                 /* add the service.*/
                 add_service(interface, protocol, name, type, domain);
             }
+            if (event == AVAHI_BROWSER_NEW && found_service && found_service->provisional
+                && !found_service->resolver && !found_service->verify_job) {
+                /* confirm a service restored from the snapshot; its
+                 * verdict is cached, so this is just a resolve. A NEW
+                 * arrives per interface and protocol, so skip it while
+                 * an earlier resolve is still being verified */
+                if (!(found_service->resolver = avahi_s_service_resolver_new(server, interface, protocol, name, type, domain, AVAHI_PROTO_UNSPEC, 0, resolve_callback, found_service)))
+                    INFO("Failed to create resolver for service '%s' of type '%s' in domain '%s': %s", name, type, domain, avahi_strerror(avahi_server_errno(server)));
+            }
             if (event == AVAHI_BROWSER_REMOVE && found_service) {
                 /* remove the service.*/
                 remove_service(NULL, found_service);
@@ -565,31 +999,146 @@ void browse_type_callback(
         case AVAHI_BROWSER_FAILURE:
             ERROR("(Browser) %s", 
                 avahi_strerror(avahi_server_errno(s)));
-            avahi_simple_poll_quit(simple_poll);
+            main_loop_quit();
             return;
-        case AVAHI_BROWSER_NEW:
-            if (!avahi_s_service_browser_new(s, 
+        case AVAHI_BROWSER_NEW: {
+            BrowserInfo *bi;
+            char *interned_type = intern_find(type), *interned_domain = intern_find(domain);
+            for (bi = browsers; bi; bi = bi->browser_info_next)
+                if (bi->type == interned_type && bi->domain == interned_domain)
+                    break;
+            if (bi) {
+                DEBUG("Service Browser: Already browsing type (%s) in domain (%s)", type, domain);
+                break;
+            }
+            bi = avahi_new0(BrowserInfo, 1);
+            if (!bi
+                || !(bi->type = intern(type))
+                || !(bi->domain = intern(domain))
+                || !(bi->browser = avahi_s_service_browser_new(s, 
                                            AVAHI_IF_UNSPEC, 
                                            AVAHI_PROTO_UNSPEC, 
                                            type, 
                                            domain, 
                                            0, 
                                            browse_service_callback, 
-                                           s)) {
+                                           s))) {
                 ERROR("Service Browser: Failed to create a service " 
                                 "browser for type (%s) in domain (%s)", 
                                                                 type, 
                                                                 domain);
-                avahi_simple_poll_quit(simple_poll);
+                if (bi) {
+                    intern_release(bi->type);
+                    intern_release(bi->domain);
+                    avahi_free(bi);
+                }
+                main_loop_quit();
             } else {
+                AVAHI_LLIST_PREPEND(BrowserInfo, browser_info, browsers, bi);
                 DEBUG("Service Browser: Successfully created a service " 
                                 "browser for type (%s) in domain (%s)", 
                                                                 type, 
                                                                 domain);
             }
             break;
+        }
         case AVAHI_BROWSER_CACHE_EXHAUSTED:
             INFO("Cache exhausted");
             break;
     }
-}
\ No newline at end of file
+}
+/**
+ * Re-query the mesh for every known service type, by recreating just the
+ * service browsers. The server, its record cache and the list of services
+ * all carry over, so only services that changed produce any work.
+ * @param s the running server
+ */
+void refresh_service_browsers(AvahiServer *s) {
+    BrowserInfo *bi;
+    
+    for (bi = browsers; bi; bi = bi->browser_info_next) {
+        if (bi->browser)
+            avahi_s_service_browser_free(bi->browser);
+        if (!(bi->browser = avahi_s_service_browser_new(s,
+                                                      AVAHI_IF_UNSPEC,
+                                                      AVAHI_PROTO_UNSPEC,
+                                                      bi->type,
+                                                      bi->domain,
+                                                      0,
+                                                      browse_service_callback,
+                                                      s)))
+            ERROR("Service Browser: Failed to recreate service browser for type (%s) in domain (%s): %s",
+                  bi->type, bi->domain, avahi_strerror(avahi_server_errno(s)));
+    }
+}
+
+/**
+ * @return number of service types being browsed
+ */
+unsigned int service_browser_count(void) {
+    BrowserInfo *bi;
+    unsigned int n = 0;
+    
+    for (bi = browsers; bi; bi = bi->browser_info_next)
+        n++;
+    return n;
+}
+
+/**
+ * Free all service browsers. Must be called before the server they
+ * belong to is freed.
+ */
+void free_service_browsers(void) {
+    BrowserInfo *bi;
+    
+    while ((bi = browsers)) {
+        AVAHI_LLIST_REMOVE(BrowserInfo, browser_info, browsers, bi);
+        if (bi->browser)
+            avahi_s_service_browser_free(bi->browser);
+        intern_release(bi->type);
+        intern_release(bi->domain);
+        avahi_free(bi);
+    }
+}
+
+/**
+ * Drop services that are still being resolved, since their resolvers
+ * are freed along with the server. Must be called before the server is
+ * freed. Services restored from the snapshot were verified already, so
+ * they just lose their confirm resolver; their confirm timer decides.
+ */
+void remove_unresolved_services(void) {
+    ServiceInfo *i, *next;
+    
+    for (i = services; i; i = next) {
+        next = i->info_next;
+        if (!i->resolver)
+            continue;
+        if (i->resolved) {
+            avahi_s_service_resolver_free(i->resolver);
+            i->resolver = NULL;
+        } else {
+            remove_service(NULL, i);
+        }
+    }
+}
+
+/**
+ * @return the poll API of the main loop, epoll or AvahiSimplePoll,
+ *         whichever is in use
+ */
+const AvahiPoll *main_loop_get(void) {
+    if (epoll_poll)
+        return epoll_poll_get(epoll_poll);
+    return avahi_simple_poll_get(simple_poll);
+}
+
+/**
+ * Make the main loop return
+ */
+void main_loop_quit(void) {
+    if (epoll_poll)
+        epoll_poll_quit(epoll_poll);
+    else if (simple_poll)
+        avahi_simple_poll_quit(simple_poll);
+}
@@ -26,10 +26,18 @@
 #define COMMOTION_SERVICE_MANAGER_H
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <avahi-core/lookup.h>
 #include <avahi-common/simple-watch.h>
 #include <avahi-common/llist.h>
+#include <avahi-common/domain.h>
+
+#include "expire.h"
+#include "epoll-watch.h"
+#include "pool.h"
+#include "txt-blob.h"
 
 /** Length (in hex chars) of Serval IDs */
 #define FINGERPRINT_LEN 64
@@ -38,6 +46,8 @@
 
 /** Name of file to output list of services when daemon receives USR1 signal */
 #define DEFAULT_FILENAME "/tmp/local-services.out"
+/** Name of file to output runtime counters when daemon receives USR1 signal */
+#define DEFAULT_STATS_FILENAME "/tmp/local-services.stats"
 #define PIDFILE "/var/run/commotion/commotion-service-manager.pid"
 /** Directory where Avahi service files are stored */
 #define avahiDir "/etc/avahi/services/"
@@ -51,31 +61,59 @@
 
 struct arguments {
   char *co_sock;
+  int verify_threads;
+  int sas_cache_size;
+  int sas_cache_ttl;
+  int verdict_cache_size;
   #ifdef USE_UCI
   int uci;
   #endif
   int nodaemon;
+  int full_refresh;
+  int epoll;
+  int refresh_min;
+  int refresh_max;
   char *output_file;
+  char *binary_file;
+  char *stats_file;
+  char *query_sock;
+  int journal_size;
+  char *snapshot_file;
+  int snapshot_interval;
   char *pid_file;
 };
 
 typedef struct ServiceInfo ServiceInfo;
-/** Struct used to hold info about a service */
+/**
+ * Struct used to hold info about a service. Allocated with service_new()
+ * and freed with service_free(); what the service owns beyond the struct
+ * lives in its arena.
+ */
 struct ServiceInfo {
     AvahiIfIndex interface;
     AvahiProtocol protocol;
-    char *name, 
-         *type, 
-         *domain, 
-	 *host_name, 
-	 *txt; /**< string representing all the txt fields */
+    char name[AVAHI_LABEL_MAX];
+    char *type, /**< interned, see intern.h */
+         *domain, /**< interned */
+	 *host_name; /**< interned */
     char address[AVAHI_ADDRESS_STR_MAX];
     uint16_t port;
-    AvahiStringList *txt_lst; /**< Collection of all the user-defined txt fields */
-    AvahiTimeout *timeout; /** Timer set for the service's expiration date */
+    TxtBlob *txt; /**< All the user-defined txt fields, in the arena */
+    Arena arena; /**< holds txt and uuid; rebuilt by service_set_txt() */
+    ExpireEntry expire; /**< Service's expiration date, on the expiration scheduler */
+
+    long lifetime; /**< Lifetime announced in the lifetime txt field */
 
     AvahiSServiceResolver *resolver;
     int resolved; /**< Flag indicating whether all the fields have been resolved */
+    int provisional; /**< Restored from the snapshot, not yet confirmed by a resolve */
+    time_t restored_expiry; /**< Wall-clock expiry read from the snapshot, 0 if none */
+    struct VerifyJob *verify_job; /**< Outstanding signature verification, if pending verification */
+    uint32_t name_hash; /**< Case-folded hash of name, used by the service index */
+    char *uuid; /**< UCI-encoded name, cached in the arena by service_uuid() */
+    size_t uuid_len;
+    char *row; /**< service formatted as in the output file, cached by service_row() */
+    size_t row_len;
 
     AVAHI_LLIST_FIELDS(ServiceInfo, info);
 };
@@ -83,6 +121,7 @@ struct ServiceInfo {
 /** Linked list of all the local services */
 extern ServiceInfo *services;
 extern AvahiSimplePoll *simple_poll;
+extern EpollPoll *epoll_poll;
 extern AvahiServer *server;
 
 // TODO document these
@@ -105,10 +144,38 @@ void browse_service_callback(
     const char *domain,
     AVAHI_GCC_UNUSED AvahiLookupResultFlags flags,
     void* userdata);
+uint32_t service_name_hash(const char *name);
+int service_index_add(ServiceInfo *i);
+void service_index_remove(ServiceInfo *i);
 ServiceInfo *find_service(const char *name);
+/**
+ * @return a zeroed service, NULL if out of memory
+ */
+ServiceInfo *service_new(void);
+/**
+ * Free a service, with everything it owns. It must already be off the
+ * service list and index.
+ */
+void service_free(ServiceInfo *i);
+/**
+ * Replace a service's txt fields with a copy of txt. The copy goes in a
+ * fresh arena, so the old fields don't pile up in it; the uuid is
+ * carried over until it is next updated.
+ * @return 0=success, -1=out of memory or txt too large (the old fields
+ *         are kept)
+ */
+int service_set_txt(ServiceInfo *i, AvahiStringList *txt);
 ServiceInfo *add_service(AvahiIfIndex interface, AvahiProtocol protocol, const char *name, const char *type, const char *domain);
 void remove_service(AvahiTimeout *t, void *userdata);
+void service_expired(AvahiTimeout *t, void *userdata);
 int verify_announcement(ServiceInfo *i);
+/**
+ * Record a service's signature as valid in the verdict cache, so
+ * verifying it again doesn't need commotiond
+ * @return 0=success, -1=fail
+ */
+int verdict_cache_prime(ServiceInfo *i);
+void verify_callback(ServiceInfo *i, int verdict);
 void resolve_callback(
   AvahiSServiceResolver *r,
   AVAHI_GCC_UNUSED AvahiIfIndex interface,
@@ -123,7 +190,31 @@ void resolve_callback(
   AvahiStringList *txt,
   AvahiLookupResultFlags flags,
   void* userdata);
-void print_services(int signal);
+void refresh_service_browsers(AvahiServer *s);
+void free_service_browsers(void);
+unsigned int service_browser_count(void);
+void remove_unresolved_services(void);
+/**
+ * @return the service formatted as a line of the output file, cached
+ *         until registry_touch() is called on it; NULL on failure
+ */
+const char *service_row(ServiceInfo *i, size_t *len);
+/**
+ * Record a change to what the output file shows
+ * @param i service whose printed fields changed, dropping its cached
+ *        row; NULL if services were only added or removed
+ */
+void registry_touch(ServiceInfo *i);
+/**
+ * @return generation of the registry, bumped by registry_touch()
+ */
+uint64_t registry_generation(void);
+void print_service_id(FILE *f, ServiceInfo *service);
+void print_service(FILE *f, ServiceInfo *service);
+void write_stats(FILE *f);
+void print_services(void);
 void sig_handler(int signal);
+const AvahiPoll *main_loop_get(void);
+void main_loop_quit(void);
 
 #endif
\ No newline at end of file
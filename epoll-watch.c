@@ -0,0 +1,388 @@
+/**
+ *       @file  epoll-watch.c
+ *      @brief  epoll based AvahiPoll main loop for the Commotion Service Manager
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <avahi-common/llist.h>
+#include <avahi-common/malloc.h>
+#include <avahi-common/timeval.h>
+
+#include "epoll-watch.h"
+#include "debug.h"
+
+struct AvahiWatch {
+  EpollPoll *poll;
+  int fd;      /**< fd as given by the caller */
+  int epoll_fd; /**< fd registered with epoll; a dup() if another watch has fd */
+  AvahiWatchEvent events;
+  AvahiWatchEvent revents; /**< events being dispatched, for watch_get_events() */
+  AvahiWatchCallback callback;
+  void *userdata;
+  int dead;
+  AVAHI_LLIST_FIELDS(AvahiWatch, watches);
+};
+
+struct AvahiTimeout {
+  EpollPoll *poll;
+  struct timeval expiry;
+  size_t heap_index; /**< position in the heap, if enabled */
+  int enabled;
+  AvahiTimeoutCallback callback;
+  void *userdata;
+  AVAHI_LLIST_FIELDS(AvahiTimeout, timeouts);
+};
+
+struct EpollPoll {
+  AvahiPoll api;
+  int epfd;
+  int wakeup_fd; /**< eventfd that epoll_poll_quit() writes to */
+  volatile sig_atomic_t quit;
+  AvahiWatch *watches;
+  AvahiWatch *dead_watches; /**< freed watches, kept until dispatch is over */
+  AvahiTimeout *timeouts; /**< all timeouts, enabled or not */
+  AvahiTimeout **heap; /**< min-heap of enabled timeouts by expiry */
+  size_t heap_len, heap_size;
+};
+
+static uint32_t to_epoll_events(AvahiWatchEvent event) {
+  return (event & AVAHI_WATCH_IN ? EPOLLIN : 0) |
+	 (event & AVAHI_WATCH_OUT ? EPOLLOUT : 0) |
+	 (event & AVAHI_WATCH_ERR ? EPOLLERR : 0) |
+	 (event & AVAHI_WATCH_HUP ? EPOLLHUP : 0);
+}
+
+static AvahiWatchEvent from_epoll_events(uint32_t events) {
+  return (events & EPOLLIN ? AVAHI_WATCH_IN : 0) |
+	 (events & EPOLLOUT ? AVAHI_WATCH_OUT : 0) |
+	 (events & EPOLLERR ? AVAHI_WATCH_ERR : 0) |
+	 (events & EPOLLHUP ? AVAHI_WATCH_HUP : 0);
+}
+
+/*
+ * Watches
+ */
+
+static AvahiWatch *watch_new(const AvahiPoll *api, int fd, AvahiWatchEvent event, AvahiWatchCallback callback, void *userdata) {
+  EpollPoll *p = api->userdata;
+  AvahiWatch *w = NULL;
+  struct epoll_event ev = {0};
+
+  assert(fd >= 0 && callback);
+  CHECK_MEM((w = avahi_new0(AvahiWatch, 1)));
+  w->poll = p;
+  w->fd = w->epoll_fd = fd;
+  w->events = event;
+  w->callback = callback;
+  w->userdata = userdata;
+
+  ev.events = to_epoll_events(event);
+  ev.data.ptr = w;
+  if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    /* epoll only takes each fd once; poll() doesn't mind */
+    CHECK(errno == EEXIST && (w->epoll_fd = dup(fd)) >= 0, "Failed to add watch on fd %d", fd);
+    CHECK(epoll_ctl(p->epfd, EPOLL_CTL_ADD, w->epoll_fd, &ev) == 0, "Failed to add watch on fd %d", fd);
+  }
+  AVAHI_LLIST_PREPEND(AvahiWatch, watches, p->watches, w);
+  return w;
+
+error:
+  if (w && w->epoll_fd != fd)
+    close(w->epoll_fd);
+  avahi_free(w);
+  return NULL;
+}
+
+static void watch_update(AvahiWatch *w, AvahiWatchEvent event) {
+  struct epoll_event ev = {0};
+
+  assert(!w->dead);
+  if (event == w->events)
+    return;
+  w->events = event;
+  ev.events = to_epoll_events(event);
+  ev.data.ptr = w;
+  if (epoll_ctl(w->poll->epfd, EPOLL_CTL_MOD, w->epoll_fd, &ev) < 0)
+    ERROR("Failed to update watch on fd %d", w->fd);
+}
+
+static AvahiWatchEvent watch_get_events(AvahiWatch *w) {
+  return w->revents;
+}
+
+static void watch_free(AvahiWatch *w) {
+  EpollPoll *p = w->poll;
+
+  assert(!w->dead);
+  /* the fd may already be closed, which removes it from epoll anyway */
+  epoll_ctl(p->epfd, EPOLL_CTL_DEL, w->epoll_fd, NULL);
+  if (w->epoll_fd != w->fd)
+    close(w->epoll_fd);
+  w->dead = 1;
+  AVAHI_LLIST_REMOVE(AvahiWatch, watches, p->watches, w);
+  AVAHI_LLIST_PREPEND(AvahiWatch, watches, p->dead_watches, w);
+}
+
+/*
+ * Timeouts
+ */
+
+static void heap_swap(EpollPoll *p, size_t a, size_t b) {
+  AvahiTimeout *t = p->heap[a];
+
+  p->heap[a] = p->heap[b];
+  p->heap[b] = t;
+  p->heap[a]->heap_index = a;
+  p->heap[b]->heap_index = b;
+}
+
+static void heap_up(EpollPoll *p, size_t k) {
+  while (k > 0 && avahi_timeval_compare(&p->heap[k]->expiry, &p->heap[(k - 1) / 2]->expiry) < 0) {
+    heap_swap(p, k, (k - 1) / 2);
+    k = (k - 1) / 2;
+  }
+}
+
+static void heap_down(EpollPoll *p, size_t k) {
+  size_t child;
+
+  while ((child = 2 * k + 1) < p->heap_len) {
+    if (child + 1 < p->heap_len &&
+	avahi_timeval_compare(&p->heap[child + 1]->expiry, &p->heap[child]->expiry) < 0)
+      child++;
+    if (avahi_timeval_compare(&p->heap[child]->expiry, &p->heap[k]->expiry) >= 0)
+      break;
+    heap_swap(p, k, child);
+    k = child;
+  }
+}
+
+static int heap_push(EpollPoll *p, AvahiTimeout *t) {
+  AvahiTimeout **heap;
+
+  if (p->heap_len == p->heap_size) {
+    CHECK_MEM((heap = avahi_realloc(p->heap, 2 * p->heap_size * sizeof(AvahiTimeout*))));
+    p->heap = heap;
+    p->heap_size *= 2;
+  }
+  t->heap_index = p->heap_len++;
+  p->heap[t->heap_index] = t;
+  heap_up(p, t->heap_index);
+  return 0;
+error:
+  return -1;
+}
+
+static void heap_remove(EpollPoll *p, AvahiTimeout *t) {
+  size_t k = t->heap_index;
+
+  if (k != --p->heap_len) {
+    heap_swap(p, k, p->heap_len);
+    heap_down(p, k);
+    heap_up(p, k);
+  }
+}
+
+static void timeout_update(AvahiTimeout *t, const struct timeval *tv) {
+  EpollPoll *p = t->poll;
+
+  if (t->enabled) {
+    heap_remove(p, t);
+    t->enabled = 0;
+  }
+  if (!tv)
+    return;
+  t->expiry = *tv;
+  if (heap_push(p, t) == 0)
+    t->enabled = 1;
+}
+
+static AvahiTimeout *timeout_new(const AvahiPoll *api, const struct timeval *tv, AvahiTimeoutCallback callback, void *userdata) {
+  AvahiTimeout *t = NULL;
+
+  assert(callback);
+  CHECK_MEM((t = avahi_new0(AvahiTimeout, 1)));
+  t->poll = api->userdata;
+  t->callback = callback;
+  t->userdata = userdata;
+  timeout_update(t, tv);
+  if (tv && !t->enabled) {
+    avahi_free(t);
+    return NULL;
+  }
+  AVAHI_LLIST_PREPEND(AvahiTimeout, timeouts, t->poll->timeouts, t);
+error:
+  return t;
+}
+
+static void timeout_free(AvahiTimeout *t) {
+  timeout_update(t, NULL);
+  AVAHI_LLIST_REMOVE(AvahiTimeout, timeouts, t->poll->timeouts, t);
+  avahi_free(t);
+}
+
+/*
+ * Main loop
+ */
+
+EpollPoll *epoll_poll_new(void) {
+  EpollPoll *p = NULL;
+  struct epoll_event ev = {0};
+
+  CHECK_MEM((p = avahi_new0(EpollPoll, 1)));
+  p->epfd = p->wakeup_fd = -1;
+  CHECK_MEM((p->heap = avahi_new(AvahiTimeout*, EPOLL_HEAP_MIN_SIZE)));
+  p->heap_size = EPOLL_HEAP_MIN_SIZE;
+  CHECK((p->epfd = epoll_create1(EPOLL_CLOEXEC)) >= 0, "Failed to create epoll instance");
+  CHECK((p->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0, "Failed to create wakeup eventfd");
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  CHECK(epoll_ctl(p->epfd, EPOLL_CTL_ADD, p->wakeup_fd, &ev) == 0, "Failed to add wakeup eventfd");
+
+  p->api.userdata = p;
+  p->api.watch_new = watch_new;
+  p->api.watch_update = watch_update;
+  p->api.watch_get_events = watch_get_events;
+  p->api.watch_free = watch_free;
+  p->api.timeout_new = timeout_new;
+  p->api.timeout_update = timeout_update;
+  p->api.timeout_free = timeout_free;
+  return p;
+
+error:
+  epoll_poll_free(p);
+  return NULL;
+}
+
+static void free_dead_watches(EpollPoll *p) {
+  AvahiWatch *w;
+
+  while ((w = p->dead_watches)) {
+    AVAHI_LLIST_REMOVE(AvahiWatch, watches, p->dead_watches, w);
+    avahi_free(w);
+  }
+}
+
+void epoll_poll_free(EpollPoll *p) {
+  if (!p)
+    return;
+  while (p->watches)
+    watch_free(p->watches);
+  free_dead_watches(p);
+  while (p->timeouts)
+    timeout_free(p->timeouts);
+  avahi_free(p->heap);
+  if (p->wakeup_fd >= 0)
+    close(p->wakeup_fd);
+  if (p->epfd >= 0)
+    close(p->epfd);
+  avahi_free(p);
+}
+
+const AvahiPoll *epoll_poll_get(EpollPoll *p) {
+  return &p->api;
+}
+
+/** @return ms until the first timeout is due (rounded up), capped at sleep_time */
+static int next_sleep_time(EpollPoll *p, int sleep_time) {
+  AvahiUsec usec;
+  int ms;
+
+  if (!p->heap_len)
+    return sleep_time;
+  if ((usec = avahi_age(&p->heap[0]->expiry)) >= 0)
+    return 0;
+  ms = (int)((-usec + 999) / 1000);
+  return (sleep_time < 0 || ms < sleep_time) ? ms : sleep_time;
+}
+
+int epoll_poll_iterate(EpollPoll *p, int sleep_time) {
+  struct epoll_event events[EPOLL_MAX_EVENTS];
+  struct timeval now;
+  AvahiTimeout *t = NULL;
+  AvahiWatch *w = NULL;
+  uint64_t count;
+  size_t due;
+  int n, j;
+
+  if (p->quit)
+    return 1;
+
+  if ((n = epoll_wait(p->epfd, events, EPOLL_MAX_EVENTS, next_sleep_time(p, sleep_time))) < 0) {
+    if (errno == EINTR)
+      return p->quit ? 1 : 0;
+    ERROR("epoll_wait() failed");
+    return -1;
+  }
+
+  /* Timeouts that are due; each is disabled before its callback runs.
+   * Bounded, so a callback that keeps re-arming itself for "now" can't
+   * starve the watches. */
+  gettimeofday(&now, NULL);
+  for (due = p->heap_len; due && p->heap_len && avahi_timeval_compare(&p->heap[0]->expiry, &now) <= 0; due--) {
+    t = p->heap[0];
+    timeout_update(t, NULL);
+    t->callback(t, t->userdata);
+  }
+
+  for (j = 0; j < n; j++) {
+    if (!(w = events[j].data.ptr)) {
+      /* drain the wakeup eventfd */
+      if (read(p->wakeup_fd, &count, sizeof(count)) < 0) {}
+      continue;
+    }
+    /* a callback earlier in this batch may have freed it */
+    if (w->dead)
+      continue;
+    w->revents = from_epoll_events(events[j].events);
+    w->callback(w, w->fd, w->revents, w->userdata);
+    if (!w->dead)
+      w->revents = 0;
+  }
+  free_dead_watches(p);
+
+  return p->quit ? 1 : 0;
+}
+
+int epoll_poll_loop(EpollPoll *p) {
+  int r;
+
+  while ((r = epoll_poll_iterate(p, -1)) == 0);
+  return r < 0 ? -1 : 0;
+}
+
+void epoll_poll_quit(EpollPoll *p) {
+  uint64_t one = 1;
+
+  p->quit = 1;
+  if (write(p->wakeup_fd, &one, sizeof(one)) < 0) {
+    /* already woken up */
+  }
+}
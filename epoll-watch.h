@@ -0,0 +1,76 @@
+/**
+ *       @file  epoll-watch.h
+ *      @brief  epoll based AvahiPoll main loop for the Commotion Service Manager
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#ifndef EPOLL_WATCH_H
+#define EPOLL_WATCH_H
+
+#include <avahi-common/watch.h>
+
+/** Max number of fd events handled per epoll_wait() */
+#define EPOLL_MAX_EVENTS 64
+/** Initial size of the timeout heap */
+#define EPOLL_HEAP_MIN_SIZE 16
+
+/**
+ * Drop-in replacement for AvahiSimplePoll. Watches are registered with
+ * epoll once, instead of a pollfd array being scanned on every wakeup,
+ * and timeouts are kept in a binary min-heap.
+ */
+typedef struct EpollPoll EpollPoll;
+
+/**
+ * Create a new main loop object
+ * @return main loop, or NULL on failure
+ */
+EpollPoll *epoll_poll_new(void);
+
+/**
+ * Free a main loop object, and any watches and timeouts still on it
+ */
+void epoll_poll_free(EpollPoll *p);
+
+/**
+ * @return the AvahiPoll vtable for the main loop
+ */
+const AvahiPoll *epoll_poll_get(EpollPoll *p);
+
+/**
+ * Run one iteration of the main loop: wait for an fd event or the
+ * next timeout, then dispatch everything that is ready
+ * @param p main loop
+ * @param sleep_time max ms to wait, -1 to wait indefinitely
+ * @return 0=success, 1=quit requested, -1=fail
+ */
+int epoll_poll_iterate(EpollPoll *p, int sleep_time);
+
+/**
+ * Run the main loop until epoll_poll_quit() is called
+ * @return 0 on quit, -1 on failure
+ */
+int epoll_poll_loop(EpollPoll *p);
+
+/**
+ * Make the main loop return. Safe to call from a signal handler.
+ */
+void epoll_poll_quit(EpollPoll *p);
+
+#endif
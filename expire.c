@@ -0,0 +1,264 @@
+/**
+ *       @file  expire.c
+ *      @brief  expiration scheduler for the Commotion Service Manager
+ *
+ * Service expirations are kept on a hierarchical timing wheel with
+ * one-second ticks, driven by a single Avahi timeout, instead of one
+ * AvahiTimeout per service: AvahiSimplePoll scans its whole timeout
+ * list on every iteration.
+ *
+ * Level L of the wheel holds entries due within 64^(L+1) ticks, in the
+ * slot given by bits 6L..6L+5 of their deadline. When the current tick
+ * enters a new level-L slot, that slot's entries are cascaded down to
+ * the levels below. Per-level occupancy bitmaps make finding the next
+ * tick with work to do a handful of bit operations, so the timeout is
+ * only armed for ticks where something happens.
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <assert.h>
+
+#include <avahi-common/timeval.h>
+
+#include "expire.h"
+#include "debug.h"
+
+#define SLOT_MASK (EXPIRE_WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(L) (EXPIRE_WHEEL_BITS * (L))
+#define NEVER UINT64_MAX
+
+static ExpireEntry *wheel[EXPIRE_WHEEL_LEVELS][EXPIRE_WHEEL_SLOTS];
+static uint64_t occupied[EXPIRE_WHEEL_LEVELS]; /**< bit s set if slot s is non-empty */
+static uint64_t wheel_now = 0; /**< last tick processed */
+static uint64_t wheel_armed = NEVER; /**< tick the timeout is armed for */
+
+static const AvahiPoll *wheel_poll = NULL;
+static AvahiTimeout *wheel_timeout = NULL;
+static AvahiTimeoutCallback wheel_callback = NULL;
+
+static unsigned long pending = 0, expired = 0, batches = 0;
+
+static uint64_t monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void slot_insert(int level, int slot, ExpireEntry *e) {
+  ExpireEntry **head = &wheel[level][slot];
+
+  e->level = level;
+  e->slot = slot;
+  e->next = *head;
+  if (*head)
+    (*head)->pprev = &e->next;
+  *head = e;
+  e->pprev = head;
+  occupied[level] |= 1ULL << slot;
+}
+
+static void entry_unlink(ExpireEntry *e) {
+  *e->pprev = e->next;
+  if (e->next)
+    e->next->pprev = e->pprev;
+  if (!wheel[e->level][e->slot])
+    occupied[e->level] &= ~(1ULL << e->slot);
+  e->next = NULL;
+  e->pprev = NULL;
+}
+
+/** File an entry at the level and slot for its deadline, relative to wheel_now */
+static void wheel_insert(ExpireEntry *e) {
+  uint64_t delta;
+  int level = 0;
+
+  if (e->deadline < wheel_now)
+    e->deadline = wheel_now;
+  delta = e->deadline - wheel_now;
+  while (level < EXPIRE_WHEEL_LEVELS - 1 && delta >> LEVEL_SHIFT(level + 1))
+    level++;
+  if (delta >> LEVEL_SHIFT(EXPIRE_WHEEL_LEVELS)) {
+    /* beyond the wheel's range: park in the furthest top-level slot,
+     * it gets refiled when that slot is cascaded */
+    slot_insert(level, ((wheel_now >> LEVEL_SHIFT(level)) - 1) & SLOT_MASK, e);
+  } else {
+    slot_insert(level, (e->deadline >> LEVEL_SHIFT(level)) & SLOT_MASK, e);
+  }
+}
+
+static void cascade(int level, int slot) {
+  ExpireEntry *e;
+
+  while ((e = wheel[level][slot])) {
+    entry_unlink(e);
+    wheel_insert(e);
+  }
+}
+
+/** Process tick t: cascade the levels whose slot boundary it is, then expire its slot */
+static void wheel_tick(uint64_t t) {
+  ExpireEntry *batch = NULL, *e = NULL;
+  int level, slot;
+
+  wheel_now = t;
+  for (level = 1; level < EXPIRE_WHEEL_LEVELS; level++) {
+    if (t & ((1ULL << LEVEL_SHIFT(level)) - 1))
+      break;
+    cascade(level, (t >> LEVEL_SHIFT(level)) & SLOT_MASK);
+  }
+
+  slot = t & SLOT_MASK;
+  if (!(batch = wheel[0][slot]))
+    return;
+
+  /* Detach the whole slot, so callbacks can schedule and cancel freely */
+  wheel[0][slot] = NULL;
+  occupied[0] &= ~(1ULL << slot);
+  batch->pprev = &batch;
+  batches++;
+  while ((e = batch)) {
+    entry_unlink(e);
+    pending--;
+    expired++;
+    wheel_callback(wheel_timeout, e->userdata);
+  }
+}
+
+/** @return next tick at which an entry expires or a non-empty slot is cascaded */
+static uint64_t wheel_next(void) {
+  uint64_t next = NEVER, cur, bits, t;
+  int level, rot;
+
+  for (level = 0; level < EXPIRE_WHEEL_LEVELS; level++) {
+    if (!occupied[level])
+      continue;
+    cur = wheel_now >> LEVEL_SHIFT(level);
+    /* bit k of bits is slot cur+1+k */
+    rot = (cur + 1) & SLOT_MASK;
+    bits = rot ? (occupied[level] >> rot) | (occupied[level] << (64 - rot)) : occupied[level];
+    t = (cur + 1 + __builtin_ctzll(bits)) << LEVEL_SHIFT(level);
+    if (t < next)
+      next = t;
+  }
+  return next;
+}
+
+static void wheel_rearm(void) {
+  uint64_t next = pending ? wheel_next() : NEVER, now_ms;
+  struct timeval tv;
+
+  if (next == wheel_armed)
+    return;
+  wheel_armed = next;
+  if (next == NEVER) {
+    wheel_poll->timeout_update(wheel_timeout, NULL);
+    return;
+  }
+  now_ms = monotonic_ms();
+  avahi_elapse_time(&tv, next * 1000 > now_ms ? next * 1000 - now_ms : 0, 0);
+  wheel_poll->timeout_update(wheel_timeout, &tv);
+}
+
+static void wheel_timeout_callback(AvahiTimeout *t, void *userdata) {
+  uint64_t now = monotonic_ms() / 1000, next;
+
+  wheel_armed = NEVER;
+  while (pending && (next = wheel_next()) <= now)
+    wheel_tick(next);
+  if (now > wheel_now)
+    wheel_now = now;
+  wheel_rearm();
+}
+
+int expire_start(const AvahiPoll *poll_api, AvahiTimeoutCallback callback) {
+  assert(poll_api && callback);
+
+  CHECK((wheel_timeout = poll_api->timeout_new(poll_api, NULL, wheel_timeout_callback, NULL)),
+	"Failed to create expiration timer");
+  wheel_poll = poll_api;
+  wheel_callback = callback;
+  wheel_now = monotonic_ms() / 1000;
+  wheel_armed = NEVER;
+  return 0;
+error:
+  return -1;
+}
+
+void expire_stop(void) {
+  int level, slot;
+
+  for (level = 0; level < EXPIRE_WHEEL_LEVELS; level++) {
+    for (slot = 0; slot < EXPIRE_WHEEL_SLOTS; slot++) {
+      while (wheel[level][slot])
+	entry_unlink(wheel[level][slot]);
+    }
+  }
+  pending = 0;
+  if (wheel_timeout)
+    wheel_poll->timeout_free(wheel_timeout);
+  wheel_timeout = NULL;
+  wheel_poll = NULL;
+}
+
+int expire_running(void) {
+  return wheel_timeout != NULL;
+}
+
+void expire_schedule(ExpireEntry *e, void *userdata, long seconds) {
+  assert(wheel_timeout);
+
+  if (e->pprev) {
+    entry_unlink(e);
+    pending--;
+  }
+  e->userdata = userdata;
+  /* round up, so entries never expire early */
+  e->deadline = (monotonic_ms() + (seconds > 0 ? seconds : 0) * 1000 + 999) / 1000;
+  if (e->deadline <= wheel_now)
+    e->deadline = wheel_now + 1;
+  wheel_insert(e);
+  pending++;
+  wheel_rearm();
+}
+
+void expire_cancel(ExpireEntry *e) {
+  if (!e->pprev)
+    return;
+  entry_unlink(e);
+  pending--;
+  /* leave the timeout armed; an early wakeup just finds nothing to do */
+}
+
+long expire_remaining(const ExpireEntry *e) {
+  uint64_t now_ms = monotonic_ms();
+
+  if (!e->pprev)
+    return -1;
+  /* round down, undoing expire_schedule()'s rounding up */
+  return e->deadline * 1000 > now_ms ? (long)((e->deadline * 1000 - now_ms) / 1000) : 0;
+}
+
+void expire_print_stats(FILE *f) {
+  fprintf(f, "expire_pending=%lu\n", pending);
+  fprintf(f, "expired=%lu\n", expired);
+  fprintf(f, "expire_batches=%lu\n", batches);
+}
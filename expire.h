@@ -0,0 +1,91 @@
+/**
+ *       @file  expire.h
+ *      @brief  expiration scheduler for the Commotion Service Manager
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#ifndef EXPIRE_H
+#define EXPIRE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <avahi-common/watch.h>
+
+/** Bits of the tick count covered by each level of the timing wheel */
+#define EXPIRE_WHEEL_BITS 6
+#define EXPIRE_WHEEL_SLOTS (1 << EXPIRE_WHEEL_BITS)
+/** Number of levels; 4 levels of 64 one-second slots cover ~194 days */
+#define EXPIRE_WHEEL_LEVELS 4
+
+typedef struct ExpireEntry ExpireEntry;
+/** An expiration scheduled on the timing wheel. Embed in the object that expires. */
+struct ExpireEntry {
+  uint64_t deadline; /**< tick (second) the entry expires at */
+  void *userdata;
+  int level, slot;
+  ExpireEntry *next, **pprev; /**< pprev is NULL if the entry isn't scheduled */
+};
+
+/**
+ * Start the expiration scheduler. All expirations share one Avahi timeout.
+ * @param poll_api poll object to run the timeout on
+ * @param callback function called for each expired entry, with the
+ *        scheduler's timeout and the entry's userdata
+ * @return 0=success, -1=fail
+ */
+int expire_start(const AvahiPoll *poll_api, AvahiTimeoutCallback callback);
+
+/**
+ * Stop the expiration scheduler, dropping any scheduled expirations
+ */
+void expire_stop(void);
+
+/**
+ * @return 1 if the expiration scheduler is running, 0 otherwise
+ */
+int expire_running(void);
+
+/**
+ * Schedule (or reschedule) an expiration
+ * @param e entry to schedule
+ * @param userdata passed to the callback on expiry
+ * @param seconds seconds from now until expiry
+ */
+void expire_schedule(ExpireEntry *e, void *userdata, long seconds);
+
+/**
+ * Cancel an expiration. Does nothing if the entry isn't scheduled.
+ * @param e entry to cancel
+ */
+void expire_cancel(ExpireEntry *e);
+
+/**
+ * @param e entry to look up
+ * @return seconds until the entry expires, -1 if it isn't scheduled
+ */
+long expire_remaining(const ExpireEntry *e);
+
+/**
+ * Print expiration counters
+ * @param f file to print to
+ */
+void expire_print_stats(FILE *f);
+
+#endif
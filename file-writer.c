@@ -0,0 +1,227 @@
+/**
+ *       @file  file-writer.c
+ *      @brief  atomic, off-loop file writer for the Commotion Service Manager
+ *
+ * Output files are serialized on the main loop, where the service list
+ * can be read safely, and handed to a helper thread for the slow part:
+ * the filesystem. A large dump, or a slow flash filesystem, then never
+ * holds up event processing.
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <avahi-common/malloc.h>
+
+#include "file-writer.h"
+#include "debug.h"
+
+/** Suffix of temporary files, as required by mkstemp() */
+#define TMP_SUFFIX ".XXXXXX"
+
+typedef struct FileJob FileJob;
+struct FileJob {
+  char *path;
+  char *buf;
+  size_t len;
+  uint64_t gen;
+  uint64_t *written_gen; /**< set to gen once written, may be NULL */
+  FileJob *next;
+};
+
+static pthread_t writer;
+static int writer_running = 0;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static FileJob *queue_head = NULL, *queue_tail = NULL;
+static int stopping = 0;
+
+/* protected by writer_lock */
+static unsigned long written = 0, coalesced = 0, write_errors = 0;
+
+int write_file_atomic(const char *path, const char *buf, size_t len) {
+  char *tmp = NULL;
+  size_t done = 0;
+  ssize_t n;
+  int fd = -1, created = 0;
+
+  CHECK_MEM((tmp = avahi_malloc(strlen(path) + sizeof(TMP_SUFFIX))));
+  strcpy(tmp, path);
+  strcat(tmp, TMP_SUFFIX);
+  CHECK((fd = mkstemp(tmp)) >= 0, "Could not create temporary file for %s", path);
+  created = 1;
+
+  while (done < len) {
+    if ((n = write(fd, buf + done, len - done)) < 0) {
+      if (errno == EINTR)
+	continue;
+      CHECK(0, "Could not write %s", tmp);
+    }
+    done += n;
+  }
+  /* mkstemp() creates files only the owner can read */
+  CHECK(fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) == 0, "Could not set permissions of %s", tmp);
+  CHECK(close(fd) == 0, "Could not write %s", tmp);
+  fd = -1;
+  CHECK(rename(tmp, path) == 0, "Could not replace %s", path);
+  avahi_free(tmp);
+  return 0;
+
+error:
+  if (fd >= 0)
+    close(fd);
+  if (created)
+    unlink(tmp);
+  avahi_free(tmp);
+  return -1;
+}
+
+static void job_free(FileJob *job) {
+  avahi_free(job->path);
+  free(job->buf);
+  avahi_free(job);
+}
+
+static int job_write(FileJob *job) {
+  int ret = write_file_atomic(job->path, job->buf, job->len);
+
+  pthread_mutex_lock(&writer_lock);
+  if (ret == 0) {
+    written++;
+    if (job->written_gen)
+      *job->written_gen = job->gen;
+  } else
+    write_errors++;
+  pthread_mutex_unlock(&writer_lock);
+  job_free(job);
+  return ret;
+}
+
+static void *writer_thread(void *arg) {
+  FileJob *job;
+
+  for (;;) {
+    pthread_mutex_lock(&writer_lock);
+    while (!queue_head && !stopping)
+      pthread_cond_wait(&writer_cond, &writer_lock);
+    if (!(job = queue_head)) {
+      /* stopping, and nothing left to write */
+      pthread_mutex_unlock(&writer_lock);
+      break;
+    }
+    if (!(queue_head = job->next))
+      queue_tail = NULL;
+    pthread_mutex_unlock(&writer_lock);
+
+    job_write(job);
+  }
+  return NULL;
+}
+
+int file_writer_start(void) {
+  stopping = 0;
+  CHECK(pthread_create(&writer, NULL, writer_thread, NULL) == 0, "Failed to start file writer thread");
+  writer_running = 1;
+  return 0;
+error:
+  return -1;
+}
+
+void file_writer_stop(void) {
+  if (!writer_running)
+    return;
+  pthread_mutex_lock(&writer_lock);
+  stopping = 1;
+  pthread_cond_signal(&writer_cond);
+  pthread_mutex_unlock(&writer_lock);
+  pthread_join(writer, NULL);
+  writer_running = 0;
+}
+
+int file_writer_submit(const char *path, char *buf, size_t len) {
+  return file_writer_submit_gen(path, buf, len, 0, NULL);
+}
+
+int file_writer_submit_gen(const char *path, char *buf, size_t len, uint64_t gen, uint64_t *written_gen) {
+  FileJob *job = NULL, *queued = NULL;
+
+  if (!(job = avahi_new0(FileJob, 1)) || !(job->path = avahi_strdup(path))) {
+    ERROR("Out of memory");
+    avahi_free(job);
+    free(buf);
+    return -1;
+  }
+  job->buf = buf;
+  job->len = len;
+  job->gen = gen;
+  job->written_gen = written_gen;
+
+  if (!writer_running)
+    return job_write(job);
+
+  pthread_mutex_lock(&writer_lock);
+  for (queued = queue_head; queued; queued = queued->next) {
+    if (strcmp(queued->path, path) == 0)
+      break;
+  }
+  if (queued) {
+    /* the queued contents are stale, just swap in the new ones */
+    free(queued->buf);
+    queued->buf = buf;
+    queued->len = len;
+    queued->gen = gen;
+    queued->written_gen = written_gen;
+    job->buf = NULL;
+    coalesced++;
+  } else {
+    if (queue_tail)
+      queue_tail->next = job;
+    else
+      queue_head = job;
+    queue_tail = job;
+    pthread_cond_signal(&writer_cond);
+  }
+  pthread_mutex_unlock(&writer_lock);
+  if (queued)
+    job_free(job);
+  return 0;
+}
+
+uint64_t file_writer_written_gen(const uint64_t *written_gen) {
+  uint64_t gen;
+
+  pthread_mutex_lock(&writer_lock);
+  gen = *written_gen;
+  pthread_mutex_unlock(&writer_lock);
+  return gen;
+}
+
+void file_writer_print_stats(FILE *f) {
+  pthread_mutex_lock(&writer_lock);
+  fprintf(f, "files_written=%lu\n", written);
+  fprintf(f, "file_writes_coalesced=%lu\n", coalesced);
+  fprintf(f, "file_write_errors=%lu\n", write_errors);
+  pthread_mutex_unlock(&writer_lock);
+}
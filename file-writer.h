@@ -0,0 +1,89 @@
+/**
+ *       @file  file-writer.h
+ *      @brief  atomic, off-loop file writer for the Commotion Service Manager
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#ifndef FILE_WRITER_H
+#define FILE_WRITER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Replace a file's contents atomically: write them to a temporary file
+ * in the same directory, then rename() it over the file. Readers see
+ * either the old or the new contents, never a partial write.
+ * @param path file to write
+ * @param buf contents
+ * @param len length of buf
+ * @return 0=success, -1=fail
+ */
+int write_file_atomic(const char *path, const char *buf, size_t len);
+
+/**
+ * Start the writer thread
+ * @return 0=success, -1=fail
+ */
+int file_writer_start(void);
+
+/**
+ * Stop the writer thread, after it has written everything queued
+ */
+void file_writer_stop(void);
+
+/**
+ * Queue a buffer to be written to a file with write_file_atomic(). If a
+ * write to the same file is still queued, it is replaced, since only
+ * the newest contents matter. Without the writer thread running, the
+ * file is written before returning.
+ * @param path file to write
+ * @param buf contents, allocated with malloc(); the writer frees it
+ * @param len length of buf
+ * @return 0=success, -1=fail
+ */
+int file_writer_submit(const char *path, char *buf, size_t len);
+
+/**
+ * Like file_writer_submit(), but also records which generation of the
+ * contents reached the file. Once the write succeeds, the writer sets
+ * *written_gen to gen; if it fails, *written_gen is left alone.
+ * @param path file to write
+ * @param buf contents, allocated with malloc(); the writer frees it
+ * @param len length of buf
+ * @param gen generation of the contents
+ * @param written_gen where to record gen, read with file_writer_written_gen()
+ * @return 0=success, -1=fail
+ */
+int file_writer_submit_gen(const char *path, char *buf, size_t len, uint64_t gen, uint64_t *written_gen);
+
+/**
+ * @param written_gen generation passed to file_writer_submit_gen()
+ * @return the generation last written successfully, 0 if none
+ */
+uint64_t file_writer_written_gen(const uint64_t *written_gen);
+
+/**
+ * Print file writer counters
+ * @param f file to print to
+ */
+void file_writer_print_stats(FILE *f);
+
+#endif
@@ -0,0 +1,180 @@
+/**
+ *       @file  intern.c
+ *      @brief  interned strings for the Commotion Service Manager
+ *
+ * A mesh has a handful of service types, one domain, and one host name
+ * per node, however many services each node announces. Services share
+ * one reference-counted copy of each of these strings instead of
+ * holding their own.
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include <avahi-common/malloc.h>
+
+#include "intern.h"
+#include "debug.h"
+
+typedef struct {
+  uint32_t hash;
+  uint32_t refs;
+  char str[]; /**< handed out to callers */
+} InternEntry;
+
+#define ENTRY_OF(s) ((InternEntry*)((s) - offsetof(InternEntry, str)))
+
+#define INTERN_MIN_SIZE 64
+
+/** Open-addressed (linear probing) table of the interned strings */
+static InternEntry **table = NULL;
+static size_t table_size = 0; /**< number of slots, always a power of 2 */
+static size_t table_count = 0;
+
+/* bytes held by the table's strings, and bytes separate copies would take on top */
+static unsigned long refs = 0, bytes = 0, bytes_shared = 0;
+
+static uint32_t intern_hash(const char *s) {
+  uint32_t hash = 2166136261u;
+  for (; *s; s++) {
+    hash ^= (unsigned char)*s;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static InternEntry **table_slot(const char *s, uint32_t hash) {
+  size_t k;
+
+  if (!table_size)
+    return NULL;
+  for (k = hash & (table_size - 1); table[k]; k = (k + 1) & (table_size - 1))
+    if (table[k]->hash == hash && strcmp(table[k]->str, s) == 0)
+      break;
+  return &table[k];
+}
+
+static int table_resize(size_t new_size) {
+  InternEntry **old_table = table;
+  size_t old_size = table_size, j, k;
+
+  CHECK_MEM((table = avahi_new0(InternEntry*, new_size)));
+  table_size = new_size;
+  for (j = 0; j < old_size; j++) {
+    if (!old_table[j])
+      continue;
+    for (k = old_table[j]->hash & (new_size - 1); table[k]; k = (k + 1) & (new_size - 1));
+    table[k] = old_table[j];
+  }
+  avahi_free(old_table);
+  return 0;
+error:
+  table = old_table;
+  return -1;
+}
+
+char *intern(const char *s) {
+  InternEntry **slot = NULL, *e = NULL;
+  uint32_t hash;
+  size_t len;
+
+  if (!s)
+    return NULL;
+  hash = intern_hash(s);
+  len = strlen(s) + 1;
+  if ((slot = table_slot(s, hash)) && *slot) {
+    e = *slot;
+    e->refs++;
+    refs++;
+    bytes_shared += len;
+    return e->str;
+  }
+
+  /* keep the load factor at or below 1/2 */
+  if (2 * (table_count + 1) > table_size) {
+    if (table_resize(table_size ? 2 * table_size : INTERN_MIN_SIZE) < 0)
+      return NULL;
+    slot = table_slot(s, hash);
+  }
+  CHECK_MEM((e = avahi_malloc(sizeof(InternEntry) + len)));
+  e->hash = hash;
+  e->refs = 1;
+  memcpy(e->str, s, len);
+  *slot = e;
+  table_count++;
+  refs++;
+  bytes += len;
+  return e->str;
+error:
+  return NULL;
+}
+
+char *intern_find(const char *s) {
+  InternEntry **slot = s ? table_slot(s, intern_hash(s)) : NULL;
+
+  return slot && *slot ? (*slot)->str : NULL;
+}
+
+void intern_release(char *s) {
+  InternEntry *e;
+  size_t mask, hole, k, home, len;
+
+  if (!s)
+    return;
+  e = ENTRY_OF(s);
+  assert(e->refs > 0);
+  len = strlen(s) + 1;
+  refs--;
+  if (--e->refs > 0) {
+    bytes_shared -= len;
+    return;
+  }
+
+  /* remove with backward-shift deletion, as in the service index */
+  mask = table_size - 1;
+  for (hole = e->hash & mask; table[hole] != e; hole = (hole + 1) & mask);
+  for (k = (hole + 1) & mask; table[k]; k = (k + 1) & mask) {
+    home = table[k]->hash & mask;
+    if (((k - home) & mask) >= ((k - hole) & mask)) {
+      table[hole] = table[k];
+      hole = k;
+    }
+  }
+  table[hole] = NULL;
+  bytes -= len;
+  avahi_free(e);
+
+  if (--table_count == 0) {
+    avahi_free(table);
+    table = NULL;
+    table_size = 0;
+  }
+}
+
+void intern_print_stats(FILE *f) {
+  fprintf(f, "interned_strings=%lu\n", (unsigned long)table_count);
+  fprintf(f, "interned_refs=%lu\n", refs);
+  fprintf(f, "interned_bytes=%lu\n", bytes);
+  fprintf(f, "interned_bytes_shared=%lu\n", bytes_shared);
+}
@@ -0,0 +1,55 @@
+/**
+ *       @file  intern.h
+ *      @brief  interned strings for the Commotion Service Manager
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdio.h>
+
+/**
+ * Get the shared copy of a string, adding a reference to it. Equal
+ * strings get the same pointer, so interned strings can be compared
+ * with ==. The copy must not be modified. Main loop only.
+ * @param s string to intern
+ * @return the shared copy, NULL if s is NULL or out of memory
+ */
+char *intern(const char *s);
+
+/**
+ * Look up the shared copy of a string without adding a reference
+ * @return the shared copy, NULL if s isn't interned
+ */
+char *intern_find(const char *s);
+
+/**
+ * Drop a reference to an interned string, freeing it with the last one
+ * @param s string returned by intern(), or NULL
+ */
+void intern_release(char *s);
+
+/**
+ * Print interning counters
+ * @param f file to print to
+ */
+void intern_print_stats(FILE *f);
+
+#endif
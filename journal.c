@@ -0,0 +1,168 @@
+/**
+ *       @file  journal.c
+ *      @brief  change journal for the Commotion Service Manager
+ *
+ * Every change to the service registry is stamped with a sequence number
+ * and kept in a fixed-size ring, already formatted, so subscribers can
+ * be sent the changes since the last one they saw instead of re-reading
+ * the whole service list. A subscriber that falls further behind than
+ * the ring holds has to resync.
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/time.h>
+
+#include <avahi-common/malloc.h>
+
+#include "journal.h"
+#include "debug.h"
+
+static const char *event_names[] = {
+  [JOURNAL_ADD] = "ADD",
+  [JOURNAL_RESOLVE] = "RESOLVE",
+  [JOURNAL_UPDATE] = "UPDATE",
+  [JOURNAL_EXPIRE] = "EXPIRE",
+  [JOURNAL_REMOVE] = "REMOVE",
+};
+
+static JournalEntry *ring = NULL; /**< entry for seq is at seq % ring_size */
+static size_t ring_size = DEFAULT_JOURNAL_SIZE;
+static uint64_t last_seq = 0;
+static uint64_t epoch = 0; /**< start time of this run, in microseconds */
+static JournalListener journal_listener = NULL;
+
+static unsigned long dropped = 0; /**< changes that failed to be recorded */
+
+static void ring_clear(void) {
+  size_t j;
+
+  if (!ring)
+    return;
+  for (j = 0; j < ring_size; j++)
+    free(ring[j].line);
+  avahi_free(ring);
+  ring = NULL;
+}
+
+int journal_configure(size_t size) {
+  ring_clear();
+  ring_size = size;
+  return 0;
+}
+
+size_t journal_size(void) {
+  return ring_size;
+}
+
+void journal_free(void) {
+  ring_clear();
+}
+
+void journal_listen(JournalListener listener) {
+  journal_listener = listener;
+}
+
+uint64_t journal_append(JournalEvent event, ServiceInfo *i) {
+  JournalEntry *e = NULL;
+  FILE *f = NULL;
+  char *line = NULL;
+  size_t line_len = 0;
+
+  if (!ring_size)
+    return 0;
+  if (!ring)
+    CHECK_MEM((ring = avahi_new0(JournalEntry, ring_size)));
+
+  CHECK((f = open_memstream(&line, &line_len)), "Failed to format journal entry");
+  fprintf(f, "%" PRIu64 " %s ", last_seq + 1, event_names[event]);
+  if (event == JOURNAL_RESOLVE || event == JOURNAL_UPDATE) {
+    print_service(f, i);
+  } else {
+    print_service_id(f, i);
+    fputc('\n', f);
+  }
+  CHECK(fclose(f) == 0, "Failed to format journal entry");
+
+  e = &ring[++last_seq % ring_size];
+  free(e->line);
+  e->seq = last_seq;
+  e->event = event;
+  e->line = line;
+  e->line_len = line_len;
+  if (journal_listener)
+    journal_listener(e);
+  return last_seq;
+
+error:
+  free(line);
+  dropped++;
+  /* Leave a hole, so subscribers notice they missed a change and resync */
+  last_seq++;
+  if (ring) {
+    e = &ring[last_seq % ring_size];
+    free(e->line);
+    memset(e, 0, sizeof(*e));
+  }
+  return 0;
+}
+
+uint64_t journal_last(void) {
+  return last_seq;
+}
+
+uint64_t journal_first(void) {
+  uint64_t first = last_seq >= ring_size ? last_seq - ring_size + 1 : 1;
+
+  /* only entries appended since the ring was (re)allocated are there */
+  while (first <= last_seq && (!ring || ring[first % ring_size].seq != first))
+    first++;
+  return first;
+}
+
+uint64_t journal_epoch(void) {
+  struct timeval tv;
+
+  if (!epoch) {
+    gettimeofday(&tv, NULL);
+    epoch = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    if (!epoch)
+      epoch = 1;
+  }
+  return epoch;
+}
+
+const JournalEntry *journal_get(uint64_t seq) {
+  JournalEntry *e = NULL;
+
+  if (!ring || !seq || seq > last_seq)
+    return NULL;
+  e = &ring[seq % ring_size];
+  return e->seq == seq ? e : NULL;
+}
+
+void journal_print_stats(FILE *f) {
+  fprintf(f, "journal_epoch=%" PRIu64 "\n", journal_epoch());
+  fprintf(f, "journal_seq=%" PRIu64 "\n", last_seq);
+  fprintf(f, "journal_size=%lu\n", (unsigned long)ring_size);
+  fprintf(f, "journal_dropped=%lu\n", dropped);
+}
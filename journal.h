@@ -0,0 +1,116 @@
+/**
+ *       @file  journal.h
+ *      @brief  change journal for the Commotion Service Manager
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "commotion-service-manager.h"
+
+/** Default number of changes kept in the journal */
+#define DEFAULT_JOURNAL_SIZE 1024
+
+typedef enum {
+  JOURNAL_ADD,     /**< service found by a browser, not resolved yet */
+  JOURNAL_RESOLVE, /**< service resolved and verified */
+  JOURNAL_UPDATE,  /**< already resolved service resolved again */
+  JOURNAL_EXPIRE,  /**< service removed when its lifetime ran out */
+  JOURNAL_REMOVE,  /**< service removed for any other reason */
+} JournalEvent;
+
+/** A change to the service registry */
+typedef struct {
+  uint64_t seq; /**< sequence number, starting at 1 */
+  JournalEvent event;
+  char *line; /**< "<seq> <EVENT> <service>\n", with the service in the USR1 file format */
+  size_t line_len;
+} JournalEntry;
+
+/** Called after each change is appended */
+typedef void (*JournalListener)(const JournalEntry *entry);
+
+/**
+ * Set the number of changes to keep. Drops the current contents, but
+ * not the sequence number.
+ * @param size number of changes, 0 to disable the journal
+ * @return 0=success, -1=fail
+ */
+int journal_configure(size_t size);
+
+/**
+ * @return number of changes kept, 0 if the journal is disabled
+ */
+size_t journal_size(void);
+
+/**
+ * Free the journal
+ */
+void journal_free(void);
+
+/**
+ * Set the function to call after each change. Pass NULL to unset.
+ */
+void journal_listen(JournalListener listener);
+
+/**
+ * Record a change to a service. Identity-only events (add, expire,
+ * remove) carry interface, protocol, name, type and domain; resolve and
+ * update carry the full service.
+ * @return sequence number of the change, 0 if the journal is disabled or
+ *         the change could not be recorded
+ */
+uint64_t journal_append(JournalEvent event, ServiceInfo *i);
+
+/**
+ * @return sequence number of the latest change, 0 if none
+ */
+uint64_t journal_last(void);
+
+/**
+ * @return sequence number of the oldest change still in the journal;
+ *         journal_last() + 1 if it is empty
+ */
+uint64_t journal_first(void);
+
+/**
+ * Sequence numbers restart at 1 whenever the daemon does, so a sequence
+ * number only identifies a change together with the epoch of the run
+ * it came from.
+ * @return identifier of this run of the journal, never 0
+ */
+uint64_t journal_epoch(void);
+
+/**
+ * Look up a change
+ * @return the change, or NULL if seq isn't in the journal (anymore)
+ */
+const JournalEntry *journal_get(uint64_t seq);
+
+/**
+ * Print journal counters
+ * @param f file to print to
+ */
+void journal_print_stats(FILE *f);
+
+#endif
@@ -1,25 +1,52 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <argp.h>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #include <avahi-common/error.h>
 
 #include "commotion.h"
 
 #include "commotion-service-manager.h"
+#include "verify.h"
+#include "refresh.h"
+#include "query.h"
+#include "journal.h"
+#include "file-writer.h"
+#include "snapshot.h"
 #include "debug.h"
 
-#define UPDATE_INTERVAL 64
+#ifdef USE_UCI
+#include <uci.h>
+#include "uci-utils.h"
+#endif
+
+/** Keys for long-only command line options */
+enum {
+  OPT_SAS_CACHE_SIZE = 256,
+  OPT_SAS_CACHE_TTL,
+  OPT_VERDICT_CACHE_SIZE,
+  OPT_REFRESH_MIN,
+  OPT_REFRESH_MAX,
+  OPT_EPOLL,
+  OPT_QUERY_SOCK,
+  OPT_JOURNAL_SIZE,
+  OPT_SNAPSHOT,
+  OPT_SNAPSHOT_INTERVAL,
+  OPT_BINARY_OUT,
+};
 
 extern struct arguments arguments;
 static int pid_filehandle;
 
 extern AvahiSimplePoll *simple_poll;
+extern EpollPoll *epoll_poll;
 extern AvahiServer *server;
 AvahiServerConfig config;
 AvahiSServiceTypeBrowser *stb = NULL;
@@ -40,21 +67,140 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
     case 'o':
       arguments->output_file = arg;
       break;
+    case 's':
+      arguments->stats_file = arg;
+      break;
     case 'n':
       arguments->nodaemon = 1;
       break;
+    case 'f':
+      arguments->full_refresh = 1;
+      break;
     case 'p':
       arguments->pid_file = arg;
       break;
+    case OPT_SAS_CACHE_SIZE:
+      arguments->sas_cache_size = atoi(arg);
+      break;
+    case OPT_SAS_CACHE_TTL:
+      arguments->sas_cache_ttl = atoi(arg);
+      break;
+    case OPT_VERDICT_CACHE_SIZE:
+      arguments->verdict_cache_size = atoi(arg);
+      break;
+    case OPT_REFRESH_MIN:
+      arguments->refresh_min = atoi(arg);
+      break;
+    case OPT_REFRESH_MAX:
+      arguments->refresh_max = atoi(arg);
+      break;
+    case OPT_EPOLL:
+      arguments->epoll = 1;
+      break;
+    case OPT_QUERY_SOCK:
+      arguments->query_sock = arg;
+      break;
+    case OPT_JOURNAL_SIZE:
+      arguments->journal_size = atoi(arg);
+      if (arguments->journal_size < 0)
+        argp_error(state, "journal size must be 0 or more");
+      break;
+    case OPT_BINARY_OUT:
+      arguments->binary_file = arg;
+      break;
+    case OPT_SNAPSHOT:
+      arguments->snapshot_file = arg;
+      break;
+    case OPT_SNAPSHOT_INTERVAL:
+      arguments->snapshot_interval = atoi(arg);
+      if (arguments->snapshot_interval <= 0)
+        argp_error(state, "snapshot interval must be at least 1 second");
+      break;
+    case 't':
+      arguments->verify_threads = atoi(arg);
+      if (arguments->verify_threads < 0 || arguments->verify_threads > MAX_VERIFY_THREADS)
+	argp_error(state, "threads must be between 0 and %d", MAX_VERIFY_THREADS);
+      break;
     default:
       return ARGP_ERR_UNKNOWN;
   }
   return 0;
 }
 
+/** Self-pipe that signals are forwarded through to the main loop */
+static int signal_pipe[2] = {-1, -1};
+static AvahiWatch *signal_watch = NULL;
+
+/**
+ * Signal handler for signals that need more than async-signal-safe
+ * work: pass the signal number on to the main loop
+ */
+static void signal_to_pipe(int signal) {
+  int saved_errno = errno;
+  unsigned char sig = signal;
+  if (write(signal_pipe[1], &sig, 1) < 0) {
+    /* pipe full: the main loop already has signals to handle */
+  }
+  errno = saved_errno;
+}
+
+/**
+ * Handle signals forwarded through the self-pipe, on the main loop
+ */
+static void signal_callback(AvahiWatch *w, int fd, AvahiWatchEvent event, void *userdata) {
+  unsigned char sig;
+  
+  while (read(fd, &sig, 1) == 1) {
+    switch (sig) {
+      case SIGHUP:
+	INFO("Received SIGHUP, reloading configuration");
+#ifdef USE_UCI
+	uci_config_reload();
+#endif
+	break;
+      case SIGUSR1:
+	print_services();
+	break;
+    }
+  }
+}
+
+/**
+ * Create the self-pipe and its watch on the main loop
+ * @param poll_api poll object to run the watch on
+ * @return 0=success, -1=fail
+ */
+static int signal_pipe_start(const AvahiPoll *poll_api) {
+  int j;
+  
+  CHECK(pipe(signal_pipe) == 0, "Failed to create signal pipe");
+  for (j = 0; j < 2; j++) {
+    fcntl(signal_pipe[j], F_SETFL, fcntl(signal_pipe[j], F_GETFL) | O_NONBLOCK);
+    fcntl(signal_pipe[j], F_SETFD, FD_CLOEXEC);
+  }
+  CHECK((signal_watch = poll_api->watch_new(poll_api, signal_pipe[0], AVAHI_WATCH_IN, signal_callback, NULL)),
+	"Failed to create signal watch");
+  return 0;
+error:
+  return -1;
+}
+
+static void signal_pipe_stop(const AvahiPoll *poll_api) {
+  int j;
+  
+  if (signal_watch)
+    poll_api->watch_free(signal_watch);
+  signal_watch = NULL;
+  for (j = 0; j < 2; j++) {
+    if (signal_pipe[j] >= 0)
+      close(signal_pipe[j]);
+    signal_pipe[j] = -1;
+  }
+}
+
 static void shutdown(int signal) {
       DEBUG("Received %s, goodbye!", signal == SIGINT ? "SIGINT" : "SIGTERM");
-      avahi_simple_poll_quit(simple_poll);
+      main_loop_quit();
 }
 
 /**
@@ -150,6 +296,8 @@ static void server_callback(AvahiServer *s, AvahiServerState state, void* userda
     case AVAHI_SERVER_RUNNING:
       DEBUG("Server created and running");
       /* Create the service browser */
+      if (stb)
+	break;
       stb = avahi_s_service_type_browser_new(s, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, "mesh.local", 0, browse_type_callback, s);
       if (!stb)
 	ERROR("Failed to create service type browser: %s", avahi_strerror(avahi_server_errno(s)));
@@ -170,6 +318,17 @@ static void start_server(AvahiTimeout *t, void *userdata) {
   
   assert(t);
   
+  /* periodically re-query the mesh. This prompts other
+   * nodes to re-multicast their services. This is done because mDNS seems to
+   * be very unreliable on mesh, and often nodes don't get service announcements
+   * or can't resolve them. */
+  if (server && !arguments.full_refresh) {
+    DEBUG("Refreshing service browsers");
+    refresh_service_browsers(server);
+    goto schedule;
+  }
+  
+  /* Full refresh: shut down and re-create the server */
   if (stb) {
     DEBUG("Service type browser already exists");
     avahi_s_service_type_browser_free(stb);
@@ -178,28 +337,28 @@ static void start_server(AvahiTimeout *t, void *userdata) {
   
   if (server) {
     DEBUG("Server already exists");
+    free_service_browsers();
+    remove_unresolved_services();
     avahi_server_free(server);
     server = NULL;
   }
   
   /* Allocate a new server */
-  server = avahi_server_new(avahi_simple_poll_get(simple_poll), &config, server_callback, NULL, &error);
+  server = avahi_server_new(main_loop_get(), &config, server_callback, NULL, &error);
   
   /* Check whether creating the server object succeeded */
   if (!server) {
     ERROR("Failed to create server: %s", avahi_strerror(error));
-    avahi_simple_poll_quit(simple_poll);
+    main_loop_quit();
     return;
   }
   
-  /* every UPDATE_INTERVAL seconds, shut down and re-create server. This
-   * has the benefit of causing CSM to send queries to other nodes, prompting
-   * them to re-multicast their services. This is done because mDNS seems to
-   * be very unreliable on mesh, and often nodes don't get service announcements
-   * or can't resolve them. */
-  struct timeval tv = {0};
-  avahi_elapse_time(&tv, 1000*UPDATE_INTERVAL, 0);
-  avahi_simple_poll_get(simple_poll)->timeout_update(t, &tv);
+schedule:
+  {
+    struct timeval tv = {0};
+    avahi_elapse_time(&tv, refresh_next_delay(), 0);
+    main_loop_get()->timeout_update(t, &tv);
+  }
 }
 
 int main(int argc, char*argv[]) {
@@ -210,8 +369,22 @@ int main(int argc, char*argv[]) {
     static struct argp_option options[] = {
       {"bind", 'b', "URI", 0, "commotiond management socket"},
       {"nodaemon", 'n', 0, 0, "Do not fork into the background" },
+      {"full-refresh", 'f', 0, 0, "Re-create the whole mDNS server on every refresh, instead of just the service browsers" },
+      {"refresh-min", OPT_REFRESH_MIN, "SECS", 0, "Shortest interval between mesh re-queries, used while services are changing"},
+      {"refresh-max", OPT_REFRESH_MAX, "SECS", 0, "Longest interval between mesh re-queries, used while services are stable"},
+      {"epoll", OPT_EPOLL, 0, 0, "Run the main loop on epoll instead of Avahi's poll() based simple poll"},
       {"out", 'o', "FILE", 0, "Output file to write services to when USR1 signal is received" },
+      {"binary-out", OPT_BINARY_OUT, "FILE", 0, "Binary file for mmap readers to write services to when USR1 signal is received (see registry-reader.h)" },
       {"pid", 'p', "FILE", 0, "Specify PID file"},
+      {"stats", 's', "FILE", 0, "Output file to write runtime counters to when USR1 signal is received" },
+      {"query-socket", OPT_QUERY_SOCK, "FILE", 0, "Unix socket to answer service queries on (empty = disabled)"},
+      {"journal-size", OPT_JOURNAL_SIZE, "NUM", 0, "Number of service changes kept for query socket subscribers (0 = no subscriptions)"},
+      {"snapshot", OPT_SNAPSHOT, "FILE", 0, "File to save verified services to, and restore them from at startup (empty = disabled)"},
+      {"snapshot-interval", OPT_SNAPSHOT_INTERVAL, "SECS", 0, "Seconds between service snapshots"},
+      {"threads", 't', "NUM", 0, "Number of signature verification threads (0 = verify on the main loop)"},
+      {"sas-cache-size", OPT_SAS_CACHE_SIZE, "NUM", 0, "Max number of cached signing keys (0 = no caching)"},
+      {"sas-cache-ttl", OPT_SAS_CACHE_TTL, "SECS", 0, "Seconds to cache signing keys for"},
+      {"verdict-cache-size", OPT_VERDICT_CACHE_SIZE, "NUM", 0, "Max number of verified announcements to remember (0 = always re-verify)"},
 #ifdef USE_UCI
       {"uci", 'u', 0, 0, "Store service cache in UCI" },
 #endif
@@ -224,8 +397,22 @@ int main(int argc, char*argv[]) {
     arguments.uci = 0;
 #endif
     arguments.nodaemon = 0;
+    arguments.full_refresh = 0;
+    arguments.epoll = 0;
+    arguments.refresh_min = DEFAULT_REFRESH_MIN;
+    arguments.refresh_max = DEFAULT_REFRESH_MAX;
     arguments.output_file = DEFAULT_FILENAME;
+    arguments.binary_file = NULL;
+    arguments.stats_file = DEFAULT_STATS_FILENAME;
+    arguments.query_sock = DEFAULT_QUERY_SOCK;
+    arguments.journal_size = DEFAULT_JOURNAL_SIZE;
+    arguments.snapshot_file = DEFAULT_SNAPSHOT_FILE;
+    arguments.snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
     arguments.pid_file = PIDFILE;
+    arguments.verify_threads = DEFAULT_VERIFY_THREADS;
+    arguments.sas_cache_size = DEFAULT_SAS_CACHE_SIZE;
+    arguments.sas_cache_ttl = DEFAULT_SAS_CACHE_TTL;
+    arguments.verdict_cache_size = DEFAULT_VERDICT_CACHE_SIZE;
     
     static struct argp argp = { options, parse_opt, NULL, doc };
     
@@ -238,17 +425,63 @@ int main(int argc, char*argv[]) {
     CHECK(co_init(),"Failed to initialize Commotion client");
     
     struct sigaction sa = {0};
-    sa.sa_handler = print_services;
-    CHECK(sigaction(SIGUSR1,&sa,NULL) == 0, "Failed to set signal handler");
     sa.sa_handler = shutdown;
     CHECK(sigaction(SIGINT,&sa,NULL) == 0, "Failed to set signal handler");
     CHECK(sigaction(SIGTERM,&sa,NULL) == 0, "Failed to set signal handler");
 
-    /* Initialize the psuedo-RNG */
-    srand(time(NULL));
+    /* Initialize the psuedo-RNG. Mix in the PID so nodes that boot
+     * at the same time don't pick the same refresh jitter. */
+    srand(time(NULL) ^ (getpid() << 16));
+    
+    refresh_sched_init(arguments.refresh_min, arguments.refresh_max);
 
     /* Allocate main loop object */
-    CHECK((simple_poll = avahi_simple_poll_new()),"Failed to create simple poll object.");
+    if (arguments.epoll) {
+      CHECK((epoll_poll = epoll_poll_new()),"Failed to create epoll main loop.");
+    } else {
+      CHECK((simple_poll = avahi_simple_poll_new()),"Failed to create simple poll object.");
+    }
+    
+    /* Move signature verification off of the main loop */
+    sas_cache_configure(arguments.sas_cache_size, arguments.sas_cache_ttl);
+    verdict_cache_configure(arguments.verdict_cache_size);
+    CHECK(verify_pool_start(main_loop_get(), arguments.verify_threads, verify_callback) == 0,
+	  "Failed to start verification threads");
+    
+    /* All service expirations share one timer */
+    CHECK(expire_start(main_loop_get(), service_expired) == 0,
+	  "Failed to start expiration scheduler");
+    
+#ifdef USE_UCI
+    /* Commit UCI changes in batches */
+    if (arguments.uci)
+      CHECK(uci_queue_start(main_loop_get()) == 0, "Failed to start UCI queue");
+    
+    /* Keep UCI settings in memory, reloading them when they change */
+    if (uci_config_watch_start(main_loop_get()) != 0)
+      WARN("Failed to watch UCI config, send SIGHUP to reload it");
+#endif
+    
+    CHECK(signal_pipe_start(main_loop_get()) == 0, "Failed to set up signal handling");
+    sa.sa_handler = signal_to_pipe;
+    CHECK(sigaction(SIGHUP,&sa,NULL) == 0, "Failed to set signal handler");
+    CHECK(sigaction(SIGUSR1,&sa,NULL) == 0, "Failed to set signal handler");
+    
+    /* Write output files off the main loop */
+    if (file_writer_start() != 0)
+      WARN("Failed to start file writer, writing output files on the main loop");
+    
+    /* Answer service queries from the registry */
+    journal_configure(arguments.journal_size);
+    if (*arguments.query_sock && query_start(main_loop_get(), arguments.query_sock) != 0)
+      WARN("Failed to open query socket, services are only available through USR1");
+    
+    /* Pick up where the last run left off, instead of re-verifying every service */
+    if (*arguments.snapshot_file) {
+      snapshot_load(arguments.snapshot_file);
+      if (snapshot_start(main_loop_get(), arguments.snapshot_file, arguments.snapshot_interval) != 0)
+        WARN("Failed to start snapshots, services will be re-verified after a restart");
+    }
 
     /* Do not publish any local records */
     avahi_server_config_init(&config);
@@ -265,10 +498,13 @@ int main(int argc, char*argv[]) {
     // Start timer to create server
     struct timeval tv = {0};
     avahi_elapse_time(&tv, 0, 0);
-    avahi_simple_poll_get(simple_poll)->timeout_new(avahi_simple_poll_get(simple_poll), &tv, start_server, NULL); // create expiration event for service
+    main_loop_get()->timeout_new(main_loop_get(), &tv, start_server, NULL); // create expiration event for service
     
     /* Run the main loop */
-    avahi_simple_poll_loop(simple_poll);
+    if (epoll_poll)
+      epoll_poll_loop(epoll_poll);
+    else
+      avahi_simple_poll_loop(simple_poll);
     
     ret = 0;
 
@@ -277,17 +513,38 @@ error:
     /* Free the configuration data */
     avahi_server_config_free(&config);
 
+    /* Needs service expirations and the file writer */
+    snapshot_stop();
+    verify_pool_stop();
+    expire_stop();
+    query_stop();
+    journal_free();
+    file_writer_stop();
+    co_pool_shutdown();
+#ifdef USE_UCI
+    uci_queue_stop();
+    uci_config_watch_stop();
+#endif
+    sas_cache_free();
+    verdict_cache_free();
+
     co_shutdown();
 
     /* Cleanup things */
     if (stb)
         avahi_s_service_type_browser_free(stb);
 
+    free_service_browsers();
+
     if (server)
         avahi_server_free(server);
     
+    if (simple_poll || epoll_poll)
+        signal_pipe_stop(main_loop_get());
     if (simple_poll)
         avahi_simple_poll_free(simple_poll);
+    if (epoll_poll)
+        epoll_poll_free(epoll_poll);
 
     return ret;
 }
\ No newline at end of file
@@ -0,0 +1,204 @@
+/**
+ *       @file  pool.c
+ *      @brief  slab and arena allocators for the Commotion Service Manager
+ *
+ * The daemon adds and removes services all day long. Allocating each
+ * service's struct and strings separately from malloc leaves the heap of
+ * a router that has run for weeks full of holes that its small
+ * allocator never hands back. Instead, service structs come from a slab
+ * mapped outside the heap, and everything a service owns beyond that
+ * comes from one arena, freed in one go.
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include <avahi-common/malloc.h>
+#include <avahi-common/llist.h>
+
+#include "pool.h"
+#include "debug.h"
+
+/** Header at the start of each mapped page; its objects follow */
+struct SlabPage {
+  void *free; /**< free objects, linked through their first word */
+  unsigned used, capacity;
+  AVAHI_LLIST_FIELDS(SlabPage, page);
+};
+
+/* Each object is preceded by a pointer to its page, padded to keep the
+ * object aligned, so slab_free() finds the page without searching */
+#define SLOT_HEAD ARENA_ALIGN(sizeof(SlabPage*))
+#define PAGE_HEAD ARENA_ALIGN(sizeof(SlabPage))
+#define SLOT_SIZE(slab) (SLOT_HEAD + ARENA_ALIGN((slab)->obj_size))
+
+static SlabPage *page_new(Slab *slab) {
+  SlabPage *page = NULL;
+  char *slot = NULL;
+  unsigned k;
+
+  assert(PAGE_HEAD + SLOT_SIZE(slab) <= SLAB_PAGE_SIZE);
+  page = mmap(NULL, SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  CHECK(page != MAP_FAILED, "Failed to map slab page");
+  page->capacity = (SLAB_PAGE_SIZE - PAGE_HEAD) / SLOT_SIZE(slab);
+  page->used = 0;
+  page->free = NULL;
+  AVAHI_LLIST_INIT(SlabPage, page, page);
+  /* thread the free list back to front, so objects are handed out in address order */
+  for (k = page->capacity; k > 0; k--) {
+    slot = (char*)page + PAGE_HEAD + (k - 1) * SLOT_SIZE(slab);
+    *(SlabPage**)slot = page;
+    *(void**)(slot + SLOT_HEAD) = page->free;
+    page->free = slot + SLOT_HEAD;
+  }
+  slab->pages++;
+  return page;
+error:
+  return NULL;
+}
+
+static void page_unmap(Slab *slab, SlabPage *page) {
+  munmap(page, SLAB_PAGE_SIZE);
+  slab->pages--;
+}
+
+void *slab_alloc(Slab *slab) {
+  SlabPage *page = slab->partial;
+  void *obj = NULL;
+
+  if (!page) {
+    if ((page = slab->spare))
+      slab->spare = NULL;
+    else if (!(page = page_new(slab)))
+      return NULL;
+    AVAHI_LLIST_PREPEND(SlabPage, page, slab->partial, page);
+  }
+  obj = page->free;
+  page->free = *(void**)obj;
+  if (++page->used == page->capacity)
+    AVAHI_LLIST_REMOVE(SlabPage, page, slab->partial, page);
+  slab->objects++;
+  memset(obj, 0, slab->obj_size);
+  return obj;
+}
+
+void slab_free(Slab *slab, void *obj) {
+  SlabPage *page = NULL;
+
+  if (!obj)
+    return;
+  page = *(SlabPage**)((char*)obj - SLOT_HEAD);
+  *(void**)obj = page->free;
+  page->free = obj;
+  slab->objects--;
+  if (page->used-- == page->capacity)
+    AVAHI_LLIST_PREPEND(SlabPage, page, slab->partial, page);
+  if (page->used == 0) {
+    AVAHI_LLIST_REMOVE(SlabPage, page, slab->partial, page);
+    if (slab->spare)
+      page_unmap(slab, slab->spare);
+    slab->spare = page;
+  }
+}
+
+void slab_print_stats(FILE *f, const char *name, const Slab *slab) {
+  fprintf(f, "%s_slab_objects=%lu\n", name, slab->objects);
+  fprintf(f, "%s_slab_pages=%lu\n", name, slab->pages);
+}
+
+struct ArenaBlock {
+  ArenaBlock *next;
+  size_t size, used;
+};
+
+#define BLOCK_HEAD ARENA_ALIGN(sizeof(ArenaBlock))
+
+/* across all arenas */
+static unsigned long arena_blocks = 0, arena_bytes = 0;
+
+static ArenaBlock *block_new(Arena *arena, size_t size) {
+  ArenaBlock *block = NULL;
+
+  if (size < ARENA_MIN_BLOCK)
+    size = ARENA_MIN_BLOCK;
+  CHECK_MEM((block = avahi_malloc(BLOCK_HEAD + size)));
+  block->size = size;
+  block->used = 0;
+  block->next = arena->blocks;
+  arena->blocks = block;
+  arena_blocks++;
+  arena_bytes += size;
+  return block;
+error:
+  return NULL;
+}
+
+int arena_reserve(Arena *arena, size_t size) {
+  size = ARENA_ALIGN(size);
+  if (arena->blocks && arena->blocks->size - arena->blocks->used >= size)
+    return 0;
+  return block_new(arena, size) ? 0 : -1;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+  ArenaBlock *block = arena->blocks;
+  void *ret = NULL;
+
+  size = ARENA_ALIGN(size ? size : 1);
+  if (!block || block->size - block->used < size) {
+    /* grow geometrically, so an arena that outgrows its reservation
+     * needs few blocks */
+    if (!(block = block_new(arena, block && block->size * 2 > size ? block->size * 2 : size)))
+      return NULL;
+  }
+  ret = (char*)block + BLOCK_HEAD + block->used;
+  block->used += size;
+  return ret;
+}
+
+char *arena_strndup(Arena *arena, const char *s, size_t len) {
+  char *ret = NULL;
+
+  if ((ret = arena_alloc(arena, len + 1))) {
+    memcpy(ret, s, len);
+    ret[len] = '\0';
+  }
+  return ret;
+}
+
+void arena_free(Arena *arena) {
+  ArenaBlock *block = NULL;
+
+  while ((block = arena->blocks)) {
+    arena->blocks = block->next;
+    arena_blocks--;
+    arena_bytes -= block->size;
+    avahi_free(block);
+  }
+}
+
+void arena_print_stats(FILE *f) {
+  fprintf(f, "arena_blocks=%lu\n", arena_blocks);
+  fprintf(f, "arena_bytes=%lu\n", arena_bytes);
+}
@@ -0,0 +1,114 @@
+/**
+ *       @file  pool.h
+ *      @brief  slab and arena allocators for the Commotion Service Manager
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/** Bytes mapped at a time for a slab's objects */
+#define SLAB_PAGE_SIZE 16384
+/** Smallest block an arena allocates */
+#define ARENA_MIN_BLOCK 256
+/** Alignment of allocations from slabs and arenas */
+#define POOL_ALIGN 16
+/** Bytes an n byte allocation takes up in an arena */
+#define ARENA_ALIGN(n) (((n) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1))
+
+typedef struct SlabPage SlabPage;
+
+/**
+ * Fixed-size object allocator. Objects are carved out of pages mapped
+ * outside the malloc heap, and a page is unmapped as soon as it is
+ * empty (one empty page is kept to absorb churn), so memory freed by
+ * removing objects goes back to the system. Main loop only.
+ */
+typedef struct {
+  size_t obj_size;
+  SlabPage *partial; /**< pages with free objects, the next allocation's first */
+  SlabPage *spare; /**< empty page kept mapped */
+  unsigned long pages, objects;
+} Slab;
+
+#define SLAB_INIT(type) { sizeof(type), NULL, NULL, 0, 0 }
+
+/**
+ * @return a zeroed object, NULL if out of memory
+ */
+void *slab_alloc(Slab *slab);
+
+/**
+ * Return an object to its slab, in constant time
+ * @param obj object returned by slab_alloc() on the same slab, or NULL
+ */
+void slab_free(Slab *slab, void *obj);
+
+/**
+ * Print a slab's counters
+ * @param f file to print to
+ * @param name prefix of the counters
+ */
+void slab_print_stats(FILE *f, const char *name, const Slab *slab);
+
+typedef struct ArenaBlock ArenaBlock;
+
+/**
+ * Bump allocator for data that is freed all at once. Everything in an
+ * arena is released by arena_free(); there is no freeing single
+ * allocations. Zero-initialize before use.
+ */
+typedef struct {
+  ArenaBlock *blocks; /**< most recent block first */
+} Arena;
+
+/**
+ * Size the arena's next block to hold at least size bytes, so the
+ * allocations that follow don't need a block each
+ * @return 0=success, -1=out of memory
+ */
+int arena_reserve(Arena *arena, size_t size);
+
+/**
+ * @return size bytes, aligned for any type, NULL if out of memory
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+/**
+ * Copy len bytes of a string into the arena, NUL-terminating the copy
+ * @return the copy, NULL if out of memory
+ */
+char *arena_strndup(Arena *arena, const char *s, size_t len);
+
+/**
+ * Release everything allocated from the arena, leaving it empty and
+ * ready for reuse
+ */
+void arena_free(Arena *arena);
+
+/**
+ * Print arena counters, for all arenas
+ * @param f file to print to
+ */
+void arena_print_stats(FILE *f);
+
+#endif
@@ -0,0 +1,518 @@
+/**
+ *       @file  query.c
+ *      @brief  Unix socket query interface for the Commotion Service Manager
+ *
+ * Requests are answered straight from the in-memory service registry,
+ * so clients no longer have to signal the daemon and re-parse the whole
+ * output file. The socket and its clients are non-blocking and served
+ * from the main loop, like every other fd in the daemon.
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <avahi-common/llist.h>
+#include <avahi-common/malloc.h>
+
+#include "commotion-service-manager.h"
+#include "util.h"
+#include "journal.h"
+#include "query.h"
+#include "debug.h"
+
+/** Pending connections queued by listen() */
+#define QUERY_BACKLOG 8
+/** Max number of changes queued for a subscriber at once */
+#define QUERY_FEED_BATCH 64
+
+typedef enum {
+  QUERY_ALL,
+  QUERY_TYPE,
+  QUERY_FINGERPRINT,
+  QUERY_INTERFACE,
+} QueryFilter;
+
+typedef struct QueryClient QueryClient;
+/** A connected client */
+struct QueryClient {
+  int fd;
+  AvahiWatch *watch;
+  char in[QUERY_MAX_REQUEST]; /**< request bytes not yet handled */
+  size_t in_len;
+  char *out; /**< responses not yet sent */
+  size_t out_len, out_sent;
+  int closing; /**< disconnect once out has been sent */
+  int subscribed; /**< streaming changes from the journal */
+  uint64_t next_seq; /**< next change to send a subscriber */
+  AVAHI_LLIST_FIELDS(QueryClient, clients);
+};
+
+static const AvahiPoll *query_poll = NULL;
+static int listen_fd = -1;
+static AvahiWatch *listen_watch = NULL;
+static char *sock_path = NULL;
+static QueryClient *clients = NULL;
+static int n_clients = 0, n_subscribers = 0;
+
+static unsigned long queries = 0, query_errors = 0, query_rows = 0, resyncs = 0;
+
+/*
+ * Requests
+ */
+
+static int service_matches(ServiceInfo *i, QueryFilter filter, const char *arg, size_t arg_len, AvahiIfIndex ifindex) {
+  TxtFields fields;
+  int j;
+
+  if (!i->resolved)
+    return 0;
+  switch (filter) {
+    case QUERY_ALL:
+      return 1;
+    case QUERY_INTERFACE:
+      return i->interface == ifindex;
+    case QUERY_TYPE:
+    case QUERY_FINGERPRINT:
+      if (parse_txt_fields(i->txt, &fields) < 0)
+	return 0;
+      if (filter == QUERY_FINGERPRINT)
+	return fields.fingerprint.len == arg_len && strncasecmp(fields.fingerprint.str, arg, arg_len) == 0;
+      for (j = 0; j < fields.types_len; j++) {
+	if (fields.types[j].len == arg_len && strncasecmp(fields.types[j].str, arg, arg_len) == 0)
+	  return 1;
+      }
+      return 0;
+  }
+  return 0;
+}
+
+static int parse_count(const char *s, long *count) {
+  if (!s || !isNumeric(s) || (*count = atol(s)) < 0)
+    return -1;
+  return 0;
+}
+
+int query_handle(const char *request, FILE *f) {
+  char buf[QUERY_MAX_REQUEST], *save = NULL, *cmd = NULL, *arg = NULL, *opt = NULL;
+  const char *reason = NULL;
+  QueryFilter filter = QUERY_ALL;
+  AvahiIfIndex ifindex = 0;
+  long offset = 0, limit = -1, total = 0, count = 0;
+  size_t arg_len = 0;
+  ServiceInfo *i = NULL;
+
+  queries++;
+  if (strlen(request) >= sizeof(buf)) {
+    reason = "request too long";
+    goto error;
+  }
+  strcpy(buf, request);
+
+  if (!(cmd = strtok_r(buf, " \t\r", &save))) {
+    reason = "empty request";
+    goto error;
+  }
+
+  if (strcmp(cmd, "stats") == 0) {
+    fprintf(f, "OK\n");
+    write_stats(f);
+    fprintf(f, "\n");
+    return 0;
+  } else if (strcmp(cmd, "type") == 0) {
+    filter = QUERY_TYPE;
+  } else if (strcmp(cmd, "fingerprint") == 0) {
+    filter = QUERY_FINGERPRINT;
+  } else if (strcmp(cmd, "interface") == 0) {
+    filter = QUERY_INTERFACE;
+  } else if (strcmp(cmd, "all") != 0) {
+    reason = "unknown request";
+    goto error;
+  }
+
+  if (filter != QUERY_ALL) {
+    if (!(arg = strtok_r(NULL, " \t\r", &save))) {
+      reason = "missing argument";
+      goto error;
+    }
+    arg_len = strlen(arg);
+    if (filter == QUERY_INTERFACE && !(ifindex = if_nametoindex(arg))) {
+      reason = "unknown interface";
+      goto error;
+    }
+  }
+
+  while ((opt = strtok_r(NULL, " \t\r", &save))) {
+    if (strcmp(opt, "offset") == 0) {
+      if (parse_count(strtok_r(NULL, " \t\r", &save), &offset) < 0) {
+	reason = "invalid offset";
+	goto error;
+      }
+    } else if (strcmp(opt, "limit") == 0) {
+      if (parse_count(strtok_r(NULL, " \t\r", &save), &limit) < 0) {
+	reason = "invalid limit";
+	goto error;
+      }
+    } else {
+      reason = "unknown option";
+      goto error;
+    }
+  }
+
+  /* The header carries the total, so count the matches first */
+  for (i = services; i; i = i->info_next) {
+    if (service_matches(i, filter, arg, arg_len, ifindex))
+      total++;
+  }
+  if (offset < total)
+    count = (limit >= 0 && limit < total - offset) ? limit : total - offset;
+  fprintf(f, "OK %ld %ld\n", total, count);
+
+  for (i = services, total = 0; i && total < offset + count; i = i->info_next) {
+    if (!service_matches(i, filter, arg, arg_len, ifindex))
+      continue;
+    if (total++ >= offset)
+      print_service(f, i);
+  }
+  fprintf(f, "\n");
+  query_rows += count;
+  return 0;
+
+error:
+  query_errors++;
+  fprintf(f, "ERR %s\n\n", reason);
+  return -1;
+}
+
+/*
+ * Clients
+ */
+
+static void client_free(QueryClient *c) {
+  AVAHI_LLIST_REMOVE(QueryClient, clients, clients, c);
+  n_clients--;
+  if (c->subscribed)
+    n_subscribers--;
+  if (c->watch)
+    query_poll->watch_free(c->watch);
+  close(c->fd);
+  free(c->out);
+  avahi_free(c);
+}
+
+/**
+ * Send as much pending output as the socket takes
+ * @return 1 if all output was sent, 0 if some is left, -1 on error
+ */
+static int client_flush(QueryClient *c) {
+  ssize_t n;
+
+  while (c->out_sent < c->out_len) {
+    if ((n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL)) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	return 0;
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    c->out_sent += n;
+  }
+  free(c->out);
+  c->out = NULL;
+  c->out_len = c->out_sent = 0;
+  return 1;
+}
+
+/**
+ * Start streaming changes to a client
+ * @param request "subscribe [SEQ EPOCH]"
+ * @return 0=success, -1=request was rejected
+ */
+static int client_subscribe(QueryClient *c, char *request, FILE *f) {
+  char *save = NULL, *seq = NULL, *epoch = NULL;
+  long long from = 0;
+  uint64_t from_epoch = 0;
+
+  queries++;
+  strtok_r(request, " \t\r", &save);
+  if (!journal_size()) {
+    query_errors++;
+    fprintf(f, "ERR journal disabled\n\n");
+    return -1;
+  }
+  if ((seq = strtok_r(NULL, " \t\r", &save)) && (!isNumeric(seq) || (from = atoll(seq)) < 0)) {
+    query_errors++;
+    fprintf(f, "ERR invalid sequence number\n\n");
+    return -1;
+  }
+  if (seq && (epoch = strtok_r(NULL, " \t\r", &save)) && !isNumeric(epoch)) {
+    query_errors++;
+    fprintf(f, "ERR invalid epoch\n\n");
+    return -1;
+  }
+  if (epoch)
+    from_epoch = strtoull(epoch, NULL, 10);
+  c->subscribed = 1;
+  if (!seq)
+    c->next_seq = journal_last() + 1;
+  else if (from_epoch != journal_epoch())
+    c->next_seq = 0; /* from another or unknown run, client_feed() sends a resync */
+  else
+    c->next_seq = (uint64_t)from + 1;
+  n_subscribers++;
+  fprintf(f, "OK %" PRIu64 " %" PRIu64 "\n", journal_last(), journal_epoch());
+  return 0;
+}
+
+/**
+ * Queue up the next batch of changes for a subscriber. If the changes
+ * it needs are no longer in the journal (or, after a restart, never
+ * were), it is sent a resync marker and carries on from the latest one.
+ * @return 0=success, -1=fail
+ */
+static int client_feed(QueryClient *c) {
+  const JournalEntry *e = NULL;
+  uint64_t last = journal_last();
+  FILE *f = NULL;
+  int j;
+
+  assert(c->subscribed && !c->out);
+  if (c->next_seq == last + 1)
+    return 0;
+
+  CHECK((f = open_memstream(&c->out, &c->out_len)), "Failed to allocate query response");
+  if (!c->next_seq || c->next_seq > last || !journal_get(c->next_seq)) {
+    fprintf(f, "%" PRIu64 " RESYNC\n", last);
+    c->next_seq = last + 1;
+    resyncs++;
+  }
+  for (j = 0; j < QUERY_FEED_BATCH && c->next_seq <= last && (e = journal_get(c->next_seq)); j++, c->next_seq++)
+    fwrite(e->line, 1, e->line_len, f);
+  CHECK(fclose(f) == 0, "Failed to write query response");
+  return 0;
+
+error:
+  free(c->out);
+  c->out = NULL;
+  c->out_len = 0;
+  return -1;
+}
+
+/**
+ * Answer every complete request line that has been read. Lines after a
+ * subscribe request are ignored.
+ * @return 0=success, -1=fail
+ */
+static int client_handle_requests(QueryClient *c) {
+  FILE *f = NULL;
+  char *line = c->in, *end = NULL;
+
+  assert(!c->out);
+  if (!memchr(c->in, '\n', c->in_len) && c->in_len < sizeof(c->in))
+    return 0;
+
+  CHECK((f = open_memstream(&c->out, &c->out_len)), "Failed to allocate query response");
+  while (!c->subscribed && (end = memchr(line, '\n', c->in_len - (line - c->in)))) {
+    *end = '\0';
+    if (strncmp(line, "subscribe", strlen("subscribe")) == 0 && strchr(" \t\r", line[strlen("subscribe")]))
+      client_subscribe(c, line, f);
+    else
+      query_handle(line, f);
+    line = end + 1;
+  }
+  c->in_len -= line - c->in;
+  memmove(c->in, line, c->in_len);
+  if (c->in_len == sizeof(c->in) && !c->subscribed) {
+    query_errors++;
+    fprintf(f, "ERR request too long\n\n");
+    c->closing = 1;
+  }
+  CHECK(fclose(f) == 0, "Failed to write query response");
+  return 0;
+
+error:
+  free(c->out);
+  c->out = NULL;
+  c->out_len = 0;
+  return -1;
+}
+
+/**
+ * Send pending output, followed for subscribers by any changes they
+ * haven't seen, as far as the socket takes it
+ * @return 0=success, -1=client should be disconnected
+ */
+static int client_send(QueryClient *c) {
+  AvahiWatchEvent events;
+  int flushed = 1;
+
+  for (;;) {
+    if (c->out && (flushed = client_flush(c)) <= 0)
+      break;
+    if (c->closing)
+      return -1;
+    if (!c->subscribed || client_feed(c) < 0 || !c->out)
+      break;
+  }
+  if (flushed < 0)
+    return -1;
+
+  /* Don't read more requests until the responses have been sent.
+   * Subscribers are still read from, to notice them hanging up. */
+  events = c->out ? AVAHI_WATCH_OUT : AVAHI_WATCH_IN;
+  if (c->subscribed)
+    events |= AVAHI_WATCH_IN;
+  query_poll->watch_update(c->watch, events);
+  return 0;
+}
+
+static void client_callback(AvahiWatch *w, int fd, AvahiWatchEvent event, void *userdata) {
+  QueryClient *c = userdata;
+  char discard[64];
+  ssize_t n;
+
+  if (event & AVAHI_WATCH_ERR)
+    goto disconnect;
+
+  if (event & AVAHI_WATCH_IN) {
+    if (c->subscribed)
+      n = recv(fd, discard, sizeof(discard), 0);
+    else
+      n = recv(fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      goto disconnect;
+    if (n == 0)
+      goto disconnect;
+    if (n > 0 && !c->subscribed) {
+      c->in_len += n;
+      if (client_handle_requests(c) < 0)
+	goto disconnect;
+    }
+  }
+
+  if (client_send(c) < 0)
+    goto disconnect;
+  return;
+
+disconnect:
+  client_free(c);
+}
+
+/** Push a new change to subscribers that are waiting for one */
+static void journal_callback(const JournalEntry *entry) {
+  QueryClient *c = NULL, *next = NULL;
+
+  for (c = clients; c; c = next) {
+    next = c->clients_next;
+    if (c->subscribed && !c->out && client_send(c) < 0)
+      client_free(c);
+  }
+}
+
+static void listen_callback(AvahiWatch *w, int fd, AvahiWatchEvent event, void *userdata) {
+  QueryClient *c = NULL;
+  int client_fd;
+
+  if ((client_fd = accept(fd, NULL, NULL)) < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      WARN("Failed to accept query connection");
+    return;
+  }
+  if (n_clients >= QUERY_MAX_CLIENTS) {
+    WARN("Too many query clients, dropping connection");
+    close(client_fd);
+    return;
+  }
+
+  CHECK(fcntl(client_fd, F_SETFL, O_NONBLOCK) == 0 && fcntl(client_fd, F_SETFD, FD_CLOEXEC) == 0,
+	"Failed to set up query connection");
+  CHECK_MEM((c = avahi_new0(QueryClient, 1)));
+  c->fd = client_fd;
+  CHECK((c->watch = query_poll->watch_new(query_poll, client_fd, AVAHI_WATCH_IN, client_callback, c)),
+	"Failed to watch query client");
+  AVAHI_LLIST_PREPEND(QueryClient, clients, clients, c);
+  n_clients++;
+  return;
+
+error:
+  avahi_free(c);
+  close(client_fd);
+}
+
+int query_start(const AvahiPoll *poll_api, const char *path) {
+  struct sockaddr_un addr = {0};
+
+  assert(poll_api && path);
+  CHECK(strlen(path) < sizeof(addr.sun_path), "Query socket path too long: %s", path);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  CHECK((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) >= 0,
+	"Failed to create query socket");
+  unlink(path);
+  CHECK(bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0, "Failed to bind query socket %s", path);
+  CHECK_MEM((sock_path = avahi_strdup(path)));
+  CHECK(listen(listen_fd, QUERY_BACKLOG) == 0, "Failed to listen on query socket %s", path);
+  CHECK((listen_watch = poll_api->watch_new(poll_api, listen_fd, AVAHI_WATCH_IN, listen_callback, NULL)),
+	"Failed to watch query socket");
+  query_poll = poll_api;
+  journal_listen(journal_callback);
+  return 0;
+
+error:
+  query_stop();
+  return -1;
+}
+
+void query_stop(void) {
+  journal_listen(NULL);
+  while (clients)
+    client_free(clients);
+  if (listen_watch)
+    query_poll->watch_free(listen_watch);
+  listen_watch = NULL;
+  if (listen_fd >= 0)
+    close(listen_fd);
+  listen_fd = -1;
+  if (sock_path) {
+    unlink(sock_path);
+    avahi_free(sock_path);
+  }
+  sock_path = NULL;
+  query_poll = NULL;
+}
+
+void query_print_stats(FILE *f) {
+  fprintf(f, "query_clients=%d\n", n_clients);
+  fprintf(f, "queries=%lu\n", queries);
+  fprintf(f, "query_errors=%lu\n", query_errors);
+  fprintf(f, "query_rows=%lu\n", query_rows);
+  fprintf(f, "query_subscribers=%d\n", n_subscribers);
+  fprintf(f, "query_resyncs=%lu\n", resyncs);
+}
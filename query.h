@@ -0,0 +1,91 @@
+/**
+ *       @file  query.h
+ *      @brief  Unix socket query interface for the Commotion Service Manager
+ *
+ * Clients connect to the query socket and send one request per line:
+ *
+ *     all [offset N] [limit N]
+ *     type TYPE [offset N] [limit N]
+ *     fingerprint SID [offset N] [limit N]
+ *     interface IFNAME [offset N] [limit N]
+ *     stats
+ *     subscribe [SEQ EPOCH]
+ *
+ * "type" matches the type txt fields of an announcement, and
+ * "fingerprint" its fingerprint txt field, both case-insensitively.
+ * Service queries are answered with "OK <total> <count>", where total is
+ * the number of matching services and count the number of rows that
+ * follow, in the same format as the USR1 output file. "stats" is answered
+ * with "OK" and the runtime counters. Failed requests are answered with
+ * "ERR <reason>". Every response ends with an empty line.
+ *
+ * "subscribe" turns the connection into a stream of changes from the
+ * journal, one "<seq> <EVENT> <service>" line each, starting after SEQ
+ * (or from now on). It is answered with "OK <latest seq> <epoch>", and
+ * any further requests on the connection are ignored. Sequence numbers
+ * restart with the daemon, so SEQ must be passed with the EPOCH it was
+ * seen under. If EPOCH is missing or from another run, or the changes
+ * after SEQ are no longer in the journal, the client is sent
+ * "<seq> RESYNC" and should re-read the full list with a separate "all"
+ * query; the stream carries on from seq.
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stdio.h>
+
+#include <avahi-common/watch.h>
+
+/** Default path of the query socket */
+#define DEFAULT_QUERY_SOCK "/var/run/commotion/commotion-service-manager.sock"
+/** Max length of a request line, including the newline */
+#define QUERY_MAX_REQUEST 512
+/** Max number of simultaneously connected clients */
+#define QUERY_MAX_CLIENTS 32
+
+/**
+ * Start serving queries on a Unix socket. Any existing file at path is replaced.
+ * @param poll_api poll object to serve the socket from
+ * @param path filesystem path of the socket
+ * @return 0=success, -1=fail
+ */
+int query_start(const AvahiPoll *poll_api, const char *path);
+
+/**
+ * Stop serving queries, disconnecting all clients and removing the socket
+ */
+void query_stop(void);
+
+/**
+ * Answer a single request
+ * @param request request line, without the trailing newline
+ * @param f file to write the response to
+ * @return 0=success, -1=request was rejected (an ERR response is still written)
+ */
+int query_handle(const char *request, FILE *f);
+
+/**
+ * Print query counters
+ * @param f file to print to
+ */
+void query_print_stats(FILE *f);
+
+#endif
@@ -0,0 +1,99 @@
+/**
+ *       @file  refresh.c
+ *      @brief  adaptive scheduling of mesh re-query cycles
+ *
+ * mDNS is unreliable on mesh, so the service browsers are periodically
+ * recreated to prompt other nodes to re-announce. A fixed period keeps
+ * nodes that booted together in lock-step, flooding the mesh with
+ * simultaneous queries, and wastes airtime once nothing is changing.
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "refresh.h"
+
+static int interval_min = DEFAULT_REFRESH_MIN;
+static int interval_max = DEFAULT_REFRESH_MAX;
+static int interval = UPDATE_INTERVAL;
+static unsigned long churn = 0, failures = 0;
+static unsigned long refreshes = 0;
+/** Keys of recently rejected announcements, indexed by key % size */
+static uint64_t rejected[REFRESH_REJECTED_SIZE];
+static unsigned long repeat_failures = 0;
+
+void refresh_sched_init(int min_secs, int max_secs) {
+  interval_min = min_secs > 0 ? min_secs : 1;
+  interval_max = max_secs > interval_min ? max_secs : interval_min;
+  if (interval < interval_min)
+    interval = interval_min;
+  if (interval > interval_max)
+    interval = interval_max;
+}
+
+void refresh_note_churn(void) {
+  churn++;
+}
+
+void refresh_note_failure(uint64_t key) {
+  uint64_t *slot = &rejected[key % REFRESH_REJECTED_SIZE];
+
+  if (key && *slot == key) {
+    repeat_failures++;
+    return;
+  }
+  *slot = key;
+  failures++;
+}
+
+unsigned int refresh_next_delay(void) {
+  long delay_ms, jitter_ms;
+  
+  if (churn || failures) {
+    /* something changed: check again soon */
+    interval /= 2;
+    if (interval < interval_min)
+      interval = interval_min;
+  } else {
+    /* nothing changed: back off */
+    interval += interval / 2 + 1;
+    if (interval > interval_max)
+      interval = interval_max;
+  }
+  churn = failures = 0;
+  refreshes++;
+  
+  delay_ms = 1000L * interval;
+  jitter_ms = delay_ms * REFRESH_JITTER_PERCENT / 100;
+  if (jitter_ms > 0)
+    delay_ms += rand() % (2 * jitter_ms + 1) - jitter_ms;
+  
+  return delay_ms > 0 ? (unsigned int)delay_ms : 1;
+}
+
+int refresh_current_interval(void) {
+  return interval;
+}
+
+void refresh_print_stats(FILE *f) {
+  fprintf(f, "refresh_interval=%d\n", interval);
+  fprintf(f, "refreshes=%lu\n", refreshes);
+  fprintf(f, "refresh_repeat_failures=%lu\n", repeat_failures);
+}
@@ -0,0 +1,80 @@
+/**
+ *       @file  refresh.h
+ *      @brief  adaptive scheduling of mesh re-query cycles
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#ifndef REFRESH_H
+#define REFRESH_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/** Interval (in seconds) of the first refresh cycle */
+#define UPDATE_INTERVAL 64
+/** Shortest interval (in seconds) between refreshes, used after churn */
+#define DEFAULT_REFRESH_MIN 16
+/** Longest interval (in seconds) between refreshes, used once the mesh is stable */
+#define DEFAULT_REFRESH_MAX 512
+/** Each interval is randomly moved by up to this percentage, so nodes don't stay in step */
+#define REFRESH_JITTER_PERCENT 25
+/** Number of recently rejected announcements remembered */
+#define REFRESH_REJECTED_SIZE 64
+
+/**
+ * Set the bounds of the refresh interval
+ * @param min_secs shortest interval
+ * @param max_secs longest interval
+ */
+void refresh_sched_init(int min_secs, int max_secs);
+
+/**
+ * Record that a service entered or left the registry of resolved services
+ */
+void refresh_note_churn(void);
+
+/**
+ * Record that a service failed to resolve or validate. A node that keeps
+ * announcing the same bad service would otherwise hold the interval at
+ * its minimum, so a failure already recorded for the same announcement
+ * is not counted again.
+ * @param key identifies the announcement, e.g. a hash of its name and txt fields
+ */
+void refresh_note_failure(uint64_t key);
+
+/**
+ * Pick the delay until the next refresh, based on what happened since
+ * the last one. Shortens the interval after churn or failures, and
+ * backs off while the mesh is stable.
+ * @return delay in milliseconds, including jitter
+ */
+unsigned int refresh_next_delay(void);
+
+/**
+ * @return current refresh interval in seconds, before jitter
+ */
+int refresh_current_interval(void);
+
+/**
+ * Print refresh scheduler state
+ * @param f file to print to
+ */
+void refresh_print_stats(FILE *f);
+
+#endif
@@ -0,0 +1,177 @@
+/**
+ *       @file  registry-export.c
+ *      @brief  binary service export for the Commotion Service Manager
+ *
+ * Writes the service list in the mmap-able format of registry-reader.h.
+ * Records are sorted by name so readers can binary search them, and TXT
+ * entries are stored raw, without the escaping of the text dump.
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <net/if.h>
+
+#include <avahi-common/malloc.h>
+
+#include "registry-export.h"
+#include "registry-reader.h"
+#include "file-writer.h"
+#include "debug.h"
+
+/** Heap being filled in */
+typedef struct {
+  char *base;
+  uint32_t len;
+} Heap;
+
+static CsmRegistryString heap_put(Heap *heap, const char *s, size_t len) {
+  CsmRegistryString ret = { heap->len, len };
+
+  memcpy(heap->base + heap->len, s, len);
+  heap->base[heap->len + len] = '\0';
+  heap->len += len + 1;
+  return ret;
+}
+
+static CsmRegistryString heap_put_str(Heap *heap, const char *s) {
+  return heap_put(heap, s ? s : "", s ? strlen(s) : 0);
+}
+
+static size_t str_size(const char *s) {
+  return (s ? strlen(s) : 0) + 1;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcasecmp((*(ServiceInfo* const*)a)->name, (*(ServiceInfo* const*)b)->name);
+}
+
+int registry_export_serialize(ServiceInfo *list, uint64_t generation, char **buf, size_t *len) {
+  ServiceInfo *i, **sorted = NULL;
+  char (*ifnames)[IF_NAMESIZE] = NULL;
+  CsmRegistryHeader *h = NULL;
+  CsmRegistryRecord *rec = NULL;
+  CsmRegistryString *txt = NULL;
+  const char *record;
+  size_t record_len;
+  Heap heap = {0};
+  uint32_t count = 0, txt_count = 0, j, k;
+  uint64_t heap_len = 0;
+  AvahiIfIndex last_if = AVAHI_IF_UNSPEC;
+  time_t now = time(NULL);
+  long remaining;
+
+  *buf = NULL;
+  *len = 0;
+
+  for (i = list; i; i = i->info_next)
+    if (i->resolved)
+      count++;
+  CHECK_MEM((sorted = avahi_new(ServiceInfo*, count ? count : 1)));
+  CHECK_MEM((ifnames = avahi_malloc0(IF_NAMESIZE * (count ? count : 1))));
+  for (i = list, j = 0; i; i = i->info_next)
+    if (i->resolved)
+      sorted[j++] = i;
+  qsort(sorted, count, sizeof(ServiceInfo*), compare_names);
+
+  /* Size the heap; services mostly share an interface, so only look up changes */
+  for (j = 0; j < count; j++) {
+    i = sorted[j];
+    if (j > 0 && i->interface == last_if)
+      strcpy(ifnames[j], ifnames[j - 1]);
+    else if (!if_indextoname(i->interface, ifnames[j]))
+      ifnames[j][0] = '\0';
+    last_if = i->interface;
+    heap_len += str_size(i->name) + str_size(i->type) + str_size(i->domain)
+                + str_size(i->host_name) + str_size(i->address) + str_size(ifnames[j]);
+    if (i->txt) {
+      /* the heap keeps each record's NUL, but not its length byte */
+      heap_len += i->txt->len - i->txt->count;
+      txt_count += i->txt->count;
+    }
+  }
+  CHECK(heap_len < UINT32_MAX, "Service list too large to export");
+
+  *len = sizeof(CsmRegistryHeader) + count * sizeof(CsmRegistryRecord)
+         + txt_count * sizeof(CsmRegistryString) + heap_len;
+  CHECK_MEM((*buf = calloc(1, *len)));
+  h = (CsmRegistryHeader*)*buf;
+  memcpy(h->magic, CSM_REGISTRY_MAGIC, 4);
+  h->version = CSM_REGISTRY_VERSION;
+  h->header_len = sizeof(CsmRegistryHeader);
+  h->record_len = sizeof(CsmRegistryRecord);
+  h->generation = generation;
+  h->count = count;
+  h->txt_count = txt_count;
+  h->records_off = sizeof(CsmRegistryHeader);
+  h->txt_off = h->records_off + count * sizeof(CsmRegistryRecord);
+  h->heap_off = h->txt_off + txt_count * sizeof(CsmRegistryString);
+  h->heap_len = heap_len;
+
+  rec = (CsmRegistryRecord*)(*buf + h->records_off);
+  txt = (CsmRegistryString*)(*buf + h->txt_off);
+  heap.base = *buf + h->heap_off;
+  for (j = 0, txt_count = 0; j < count; j++, rec++) {
+    i = sorted[j];
+    rec->interface = i->interface;
+    rec->protocol = i->protocol;
+    rec->port = i->port;
+    rec->flags = i->provisional ? CSM_REGISTRY_PROVISIONAL : 0;
+    if (i->provisional)
+      rec->expiry = i->restored_expiry;
+    else if ((remaining = expire_remaining(&i->expire)) >= 0)
+      rec->expiry = now + remaining;
+    rec->lifetime = i->lifetime;
+    rec->name = heap_put_str(&heap, i->name);
+    rec->type = heap_put_str(&heap, i->type);
+    rec->domain = heap_put_str(&heap, i->domain);
+    rec->host_name = heap_put_str(&heap, i->host_name);
+    rec->address = heap_put_str(&heap, i->address);
+    rec->interface_name = heap_put_str(&heap, ifnames[j]);
+    rec->txt_first = txt_count;
+    for (k = 0; i->txt && k < i->txt->count; k++, rec->txt_count++) {
+      record = txt_blob_record(i->txt, k, &record_len);
+      txt[txt_count++] = heap_put(&heap, record, record_len);
+    }
+  }
+
+  avahi_free(sorted);
+  avahi_free(ifnames);
+  return count;
+
+error:
+  avahi_free(sorted);
+  avahi_free(ifnames);
+  free(*buf);
+  *buf = NULL;
+  *len = 0;
+  return -1;
+}
+
+int registry_export(const char *path, uint64_t *written_gen) {
+  char *buf = NULL;
+  size_t len = 0;
+  uint64_t gen = registry_generation();
+
+  if (registry_export_serialize(services, gen, &buf, &len) < 0)
+    return -1;
+  return file_writer_submit_gen(path, buf, len, gen, written_gen);
+}
@@ -0,0 +1,51 @@
+/**
+ *       @file  registry-export.h
+ *      @brief  binary service export for the Commotion Service Manager
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#ifndef REGISTRY_EXPORT_H
+#define REGISTRY_EXPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "commotion-service-manager.h"
+
+/**
+ * Build the binary export of the resolved services of a list, in the
+ * format described in registry-reader.h
+ * @param list services to export
+ * @param generation registry generation to stamp the export with
+ * @param[out] buf export, allocated with malloc()
+ * @param[out] len length of buf
+ * @return number of services exported, -1 on failure
+ */
+int registry_export_serialize(ServiceInfo *list, uint64_t generation, char **buf, size_t *len);
+
+/**
+ * Publish the binary export of the registry through the file writer
+ * @param path file to write
+ * @param written_gen set to the exported generation once the file is
+ *        written, see file_writer_submit_gen()
+ * @return 0=success, -1=fail
+ */
+int registry_export(const char *path, uint64_t *written_gen);
+
+#endif
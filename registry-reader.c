@@ -0,0 +1,174 @@
+/**
+ *       @file  registry-reader.c
+ *      @brief  reader for the Commotion Service Manager's binary service export
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "registry-reader.h"
+
+/** @return 1 if [off, off + count * size) lies within a file of length len */
+static int in_bounds(uint64_t off, uint64_t count, uint64_t size, size_t len) {
+  return off <= len && count <= (len - off) / size;
+}
+
+int csm_registry_open(CsmRegistry *reg, const char *path) {
+  const CsmRegistryHeader *h = NULL;
+  struct stat st;
+  void *map = MAP_FAILED;
+  int fd = -1, err = EINVAL;
+
+  memset(reg, 0, sizeof(*reg));
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    err = errno;
+    goto error;
+  }
+  if ((size_t)st.st_size < sizeof(CsmRegistryHeader))
+    goto error;
+  if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    err = errno;
+    goto error;
+  }
+  close(fd);
+  fd = -1;
+
+  h = map;
+  if (memcmp(h->magic, CSM_REGISTRY_MAGIC, 4) != 0
+      || h->version != CSM_REGISTRY_VERSION
+      || h->header_len != sizeof(CsmRegistryHeader)
+      || h->record_len != sizeof(CsmRegistryRecord)
+      || h->records_off % 8 || h->txt_off % 4
+      || !in_bounds(h->records_off, h->count, sizeof(CsmRegistryRecord), st.st_size)
+      || !in_bounds(h->txt_off, h->txt_count, sizeof(CsmRegistryString), st.st_size)
+      || !in_bounds(h->heap_off, h->heap_len, 1, st.st_size))
+    goto error;
+
+  reg->map = map;
+  reg->len = st.st_size;
+  reg->dev = st.st_dev;
+  reg->ino = st.st_ino;
+  reg->header = h;
+  reg->records = (const CsmRegistryRecord*)((const char*)map + h->records_off);
+  reg->txt = (const CsmRegistryString*)((const char*)map + h->txt_off);
+  reg->heap = (const char*)map + h->heap_off;
+  return 0;
+
+error:
+  if (map != MAP_FAILED)
+    munmap(map, st.st_size);
+  if (fd >= 0)
+    close(fd);
+  errno = err;
+  return -1;
+}
+
+void csm_registry_close(CsmRegistry *reg) {
+  if (reg->map)
+    munmap(reg->map, reg->len);
+  memset(reg, 0, sizeof(*reg));
+}
+
+int csm_registry_changed(const CsmRegistry *reg, const char *path) {
+  struct stat st;
+
+  /* the daemon renames a new file into place, it never rewrites one */
+  if (stat(path, &st) < 0)
+    return 1;
+  return st.st_dev != reg->dev || st.st_ino != reg->ino;
+}
+
+uint64_t csm_registry_generation(const CsmRegistry *reg) {
+  return reg->header ? reg->header->generation : 0;
+}
+
+uint32_t csm_registry_count(const CsmRegistry *reg) {
+  return reg->header ? reg->header->count : 0;
+}
+
+const CsmRegistryRecord *csm_registry_record(const CsmRegistry *reg, uint32_t idx) {
+  return idx < csm_registry_count(reg) ? &reg->records[idx] : NULL;
+}
+
+const char *csm_registry_string(const CsmRegistry *reg, CsmRegistryString s) {
+  if (!reg->header || s.off >= reg->header->heap_len || s.len >= reg->header->heap_len - s.off
+      || reg->heap[s.off + s.len] != '\0')
+    return NULL;
+  return reg->heap + s.off;
+}
+
+const CsmRegistryRecord *csm_registry_find(const CsmRegistry *reg, const char *name) {
+  uint32_t lo = 0, hi = csm_registry_count(reg), mid;
+  const char *mid_name;
+  int cmp;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (!(mid_name = csm_registry_string(reg, reg->records[mid].name)))
+      return NULL;
+    if ((cmp = strcasecmp(name, mid_name)) == 0)
+      return &reg->records[mid];
+    if (cmp < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return NULL;
+}
+
+/** @return 1 if the record's TXT entries are within the TXT table */
+static int txt_in_bounds(const CsmRegistry *reg, const CsmRegistryRecord *rec) {
+  return (uint64_t)rec->txt_first + rec->txt_count <= reg->header->txt_count;
+}
+
+const char *csm_registry_txt_entry(const CsmRegistry *reg, const CsmRegistryRecord *rec, uint32_t idx, size_t *len) {
+  const char *entry;
+
+  if (idx >= rec->txt_count || !txt_in_bounds(reg, rec)
+      || !(entry = csm_registry_string(reg, reg->txt[rec->txt_first + idx])))
+    return NULL;
+  if (len)
+    *len = reg->txt[rec->txt_first + idx].len;
+  return entry;
+}
+
+const char *csm_registry_txt(const CsmRegistry *reg, const CsmRegistryRecord *rec, const char *key, size_t *len) {
+  size_t key_len = strlen(key), entry_len;
+  const char *entry;
+  uint32_t idx;
+
+  if (!txt_in_bounds(reg, rec))
+    return NULL;
+  for (idx = 0; idx < rec->txt_count; idx++) {
+    if (!(entry = csm_registry_txt_entry(reg, rec, idx, &entry_len)))
+      continue;
+    if (entry_len > key_len && entry[key_len] == '=' && memcmp(entry, key, key_len) == 0) {
+      if (len)
+	*len = entry_len - key_len - 1;
+      return entry + key_len + 1;
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,157 @@
+/**
+ *       @file  registry-reader.h
+ *      @brief  reader for the Commotion Service Manager's binary service export
+ *
+ * The binary export is the service list in a form readers can mmap and
+ * index directly, instead of tokenizing and unescaping the text dump. It
+ * is a header, a table of fixed-width records sorted by service name, a
+ * table of TXT entries, and a heap of NUL-terminated strings, all in host
+ * byte order (the file never leaves the node). The daemon replaces it
+ * with rename(), so a mapping always sees one complete generation; call
+ * csm_registry_changed() to find out when to map the new one.
+ *
+ * This header and registry-reader.c don't depend on the rest of the
+ * daemon, and are built into libcsmregistry.a for other programs.
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#ifndef REGISTRY_READER_H
+#define REGISTRY_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CSM_REGISTRY_MAGIC "CSMR"
+#define CSM_REGISTRY_VERSION 1
+
+/** Record flag: service restored from a snapshot, not yet seen again */
+#define CSM_REGISTRY_PROVISIONAL 0x1
+
+/** A string in the heap */
+typedef struct {
+  uint32_t off; /**< offset in the heap */
+  uint32_t len; /**< length, not counting the terminating NUL */
+} CsmRegistryString;
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t header_len; /**< sizeof(CsmRegistryHeader) */
+  uint32_t record_len; /**< sizeof(CsmRegistryRecord) */
+  uint64_t generation; /**< bumped by the daemon whenever the service list changes */
+  uint32_t count; /**< number of records */
+  uint32_t txt_count; /**< number of TXT entries, for all records */
+  uint64_t records_off, txt_off, heap_off, heap_len; /**< offsets from the start of the file */
+} CsmRegistryHeader;
+
+typedef struct {
+  int32_t interface; /**< interface index */
+  int32_t protocol; /**< 0 = IPv4, 1 = IPv6, -1 = unspecified */
+  uint16_t port;
+  uint16_t reserved;
+  uint32_t flags; /**< CSM_REGISTRY_* flags */
+  int64_t expiry; /**< wall-clock time the service expires at, 0 if never */
+  int64_t lifetime; /**< lifetime announced in the lifetime TXT field */
+  CsmRegistryString name, type, domain, host_name, address, interface_name;
+  uint32_t txt_first, txt_count; /**< the record's entries in the TXT table */
+} CsmRegistryRecord;
+
+/** A mapped export */
+typedef struct {
+  void *map;
+  size_t len;
+  dev_t dev;
+  ino_t ino;
+  const CsmRegistryHeader *header;
+  const CsmRegistryRecord *records;
+  const CsmRegistryString *txt; /**< TXT table, raw "key=value" entries */
+  const char *heap;
+} CsmRegistry;
+
+/**
+ * Map an export. Only the header and table bounds are checked here;
+ * strings are checked as they are read.
+ * @param reg registry to fill in
+ * @param path export file
+ * @return 0=success, -1=fail (errno is set; EINVAL for a malformed file)
+ */
+int csm_registry_open(CsmRegistry *reg, const char *path);
+
+/**
+ * Unmap an export
+ */
+void csm_registry_close(CsmRegistry *reg);
+
+/**
+ * @return 1 if path has been replaced since reg was opened, 0 if not
+ */
+int csm_registry_changed(const CsmRegistry *reg, const char *path);
+
+/**
+ * @return generation of the mapped export
+ */
+uint64_t csm_registry_generation(const CsmRegistry *reg);
+
+/**
+ * @return number of services in the export
+ */
+uint32_t csm_registry_count(const CsmRegistry *reg);
+
+/**
+ * @return the idx'th service, in order of name; NULL if out of range
+ */
+const CsmRegistryRecord *csm_registry_record(const CsmRegistry *reg, uint32_t idx);
+
+/**
+ * @return the string, or NULL if s is out of the heap's bounds
+ */
+const char *csm_registry_string(const CsmRegistry *reg, CsmRegistryString s);
+
+/**
+ * Look up a service by name, case-insensitively, by binary search
+ * @return the service, or NULL if there is none
+ */
+const CsmRegistryRecord *csm_registry_find(const CsmRegistry *reg, const char *name);
+
+/**
+ * Look up a TXT field of a service. For fields that repeat (type), use
+ * csm_registry_txt_entry() instead.
+ * @param key field name, e.g. "fingerprint"
+ * @param[out] len length of the value, if not NULL
+ * @return the value, or NULL if the service has no such field
+ */
+const char *csm_registry_txt(const CsmRegistry *reg, const CsmRegistryRecord *rec, const char *key, size_t *len);
+
+/**
+ * @param idx entry of the service, from 0 to rec->txt_count - 1
+ * @param[out] len length of the entry, if not NULL
+ * @return the raw "key=value" TXT entry, or NULL if out of range
+ */
+const char *csm_registry_txt_entry(const CsmRegistry *reg, const CsmRegistryRecord *rec, uint32_t idx, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,419 @@
+/**
+ *       @file  snapshot.c
+ *      @brief  warm-start registry snapshot for the Commotion Service Manager
+ *
+ * After a restart, every service on the mesh would otherwise have to be
+ * resolved and have its signature checked by commotiond again before it
+ * shows up. Instead, the verified services are periodically saved to a
+ * compact binary file, and restored at startup as provisionally valid:
+ * listed right away, with their signatures primed in the verdict cache,
+ * and confirmed by the next resolve without another round trip to
+ * commotiond. Services that aren't seen again expire after
+ * SNAPSHOT_CONFIRM_SECS.
+ *
+ * The file is a header followed by one record per service, in host byte
+ * order (it never leaves the node):
+ *
+ *     "CSMS" u32 version, u32 count, u64 FNV-1a hash of the records
+ *     i32 interface, i32 protocol, u16 port, i64 expiry, i64 lifetime,
+ *     5 x (u16 length, string, NUL): name, type, domain, host name, address
+ *     u16 txt count, count x (u16 length, bytes)
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <avahi-common/malloc.h>
+#include <avahi-common/timeval.h>
+
+#include "snapshot.h"
+#include "util.h"
+#include "journal.h"
+#include "file-writer.h"
+#include "intern.h"
+#include "debug.h"
+
+#define HEADER_LEN (4 + 4 + 4 + 8)
+
+/** Bounds-checked cursor over a snapshot being parsed */
+typedef struct {
+  const char *p;
+  size_t left;
+} Reader;
+
+static const AvahiPoll *snapshot_poll = NULL;
+static AvahiTimeout *snapshot_timeout = NULL;
+static char *snapshot_path = NULL;
+static long snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+static uint64_t saved_gen = 0; /**< registry generation of the last snapshot written; set by the file writer */
+
+static unsigned long written = 0, skipped = 0, restored = 0, stale = 0, errors = 0;
+
+static uint64_t fnv1a(const char *buf, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  size_t j;
+
+  for (j = 0; j < len; j++) {
+    h ^= (unsigned char)buf[j];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static int put_string(FILE *f, const char *s) {
+  size_t len = s ? strlen(s) : 0;
+  uint16_t len16 = len;
+
+  if (len > UINT16_MAX)
+    return -1;
+  fwrite(&len16, sizeof(len16), 1, f);
+  fwrite(s ? s : "", 1, len + 1, f);
+  return 0;
+}
+
+static int put_service(FILE *f, ServiceInfo *i, time_t now) {
+  int32_t interface = i->interface, protocol = i->protocol;
+  int64_t expiry = 0, lifetime = i->lifetime;
+  uint16_t txt_count = i->txt ? i->txt->count : 0, len16;
+  const char *record;
+  size_t len;
+  long remaining;
+  unsigned k;
+
+  if (i->provisional)
+    expiry = i->restored_expiry;
+  else if ((remaining = expire_remaining(&i->expire)) >= 0)
+    expiry = now + remaining;
+
+  fwrite(&interface, sizeof(interface), 1, f);
+  fwrite(&protocol, sizeof(protocol), 1, f);
+  fwrite(&i->port, sizeof(i->port), 1, f);
+  fwrite(&expiry, sizeof(expiry), 1, f);
+  fwrite(&lifetime, sizeof(lifetime), 1, f);
+  if (put_string(f, i->name) < 0
+      || put_string(f, i->type) < 0
+      || put_string(f, i->domain) < 0
+      || put_string(f, i->host_name) < 0
+      || put_string(f, i->address) < 0)
+    return -1;
+  fwrite(&txt_count, sizeof(txt_count), 1, f);
+  for (k = 0; k < txt_count; k++) {
+    record = txt_blob_record(i->txt, k, &len);
+    len16 = len;
+    fwrite(&len16, sizeof(len16), 1, f);
+    fwrite(record, 1, len, f);
+  }
+  return 0;
+}
+
+int snapshot_serialize(ServiceInfo *list, char **buf, size_t *len) {
+  FILE *f = NULL;
+  ServiceInfo *i;
+  uint32_t version = SNAPSHOT_VERSION, count = 0;
+  uint64_t hash = 0;
+  time_t now = time(NULL);
+
+  *buf = NULL;
+  *len = 0;
+  CHECK((f = open_memstream(buf, len)), "Failed to serialize snapshot");
+  fwrite(SNAPSHOT_MAGIC, 1, 4, f);
+  fwrite(&version, sizeof(version), 1, f);
+  /* count and hash are filled in below */
+  fwrite(&count, sizeof(count), 1, f);
+  fwrite(&hash, sizeof(hash), 1, f);
+  for (i = list; i; i = i->info_next) {
+    if (!i->resolved)
+      continue;
+    if (put_service(f, i, now) < 0) {
+      WARN("Service too large for snapshot: %s", i->name);
+      continue;
+    }
+    count++;
+  }
+  CHECK(fclose(f) == 0, "Failed to serialize snapshot");
+  f = NULL;
+
+  hash = fnv1a(*buf + HEADER_LEN, *len - HEADER_LEN);
+  memcpy(*buf + 8, &count, sizeof(count));
+  memcpy(*buf + 12, &hash, sizeof(hash));
+  return count;
+
+error:
+  if (f)
+    fclose(f);
+  free(*buf);
+  *buf = NULL;
+  return -1;
+}
+
+static int get(Reader *r, void *out, size_t n) {
+  if (r->left < n)
+    return -1;
+  memcpy(out, r->p, n);
+  r->p += n;
+  r->left -= n;
+  return 0;
+}
+
+/** Read a NUL-terminated string in place */
+static int get_string(Reader *r, const char **s) {
+  uint16_t len;
+
+  if (get(r, &len, sizeof(len)) < 0 || r->left < (size_t)len + 1 || r->p[len] != '\0')
+    return -1;
+  *s = r->p;
+  r->p += len + 1;
+  r->left -= len + 1;
+  return 0;
+}
+
+static int get_record(Reader *r, SnapshotRecord *rec) {
+  int32_t interface, protocol;
+  int64_t expiry, lifetime;
+  uint16_t txt_count, len;
+  AvahiStringList *txt;
+
+  memset(rec, 0, sizeof(*rec));
+  if (get(r, &interface, sizeof(interface)) < 0
+      || get(r, &protocol, sizeof(protocol)) < 0
+      || get(r, &rec->port, sizeof(rec->port)) < 0
+      || get(r, &expiry, sizeof(expiry)) < 0
+      || get(r, &lifetime, sizeof(lifetime)) < 0
+      || get_string(r, &rec->name) < 0
+      || get_string(r, &rec->type) < 0
+      || get_string(r, &rec->domain) < 0
+      || get_string(r, &rec->host_name) < 0
+      || get_string(r, &rec->address) < 0
+      || get(r, &txt_count, sizeof(txt_count)) < 0)
+    return -1;
+  rec->interface = interface;
+  rec->protocol = protocol;
+  rec->expiry = expiry;
+  rec->lifetime = lifetime;
+
+  while (txt_count--) {
+    if (get(r, &len, sizeof(len)) < 0 || r->left < len)
+      goto error;
+    if (!(txt = avahi_string_list_add_arbitrary(rec->txt_lst, (const uint8_t*)r->p, len)))
+      goto error;
+    rec->txt_lst = txt;
+    r->p += len;
+    r->left -= len;
+  }
+  /* entries were prepended, put them back in the saved order */
+  rec->txt_lst = avahi_string_list_reverse(rec->txt_lst);
+  return 0;
+
+error:
+  avahi_string_list_free(rec->txt_lst);
+  rec->txt_lst = NULL;
+  return -1;
+}
+
+int snapshot_parse(const char *buf, size_t len, SnapshotCallback callback, void *userdata) {
+  Reader r;
+  SnapshotRecord rec;
+  uint32_t version, count, j;
+  uint64_t hash;
+
+  CHECK(len >= HEADER_LEN && memcmp(buf, SNAPSHOT_MAGIC, 4) == 0, "Not a snapshot file");
+  r.p = buf + HEADER_LEN;
+  r.left = len - HEADER_LEN;
+  memcpy(&version, buf + 4, sizeof(version));
+  memcpy(&count, buf + 8, sizeof(count));
+  memcpy(&hash, buf + 12, sizeof(hash));
+  CHECK(version == SNAPSHOT_VERSION, "Unsupported snapshot version %u", version);
+  CHECK(hash == fnv1a(r.p, r.left), "Snapshot is corrupt");
+
+  /* check every record before handing out any */
+  for (j = 0; j < count; j++) {
+    CHECK(get_record(&r, &rec) == 0, "Snapshot is truncated");
+    avahi_string_list_free(rec.txt_lst);
+  }
+  CHECK(r.left == 0, "Snapshot has trailing data");
+
+  r.p = buf + HEADER_LEN;
+  r.left = len - HEADER_LEN;
+  for (j = 0; j < count; j++) {
+    get_record(&r, &rec);
+    callback(&rec, userdata);
+    avahi_string_list_free(rec.txt_lst);
+  }
+  return count;
+
+error:
+  return -1;
+}
+
+/** Add a service from the snapshot to the registry, as provisionally valid */
+static void restore_service(SnapshotRecord *rec, void *userdata) {
+  time_t now = *(time_t*)userdata;
+  long remaining = SNAPSHOT_CONFIRM_SECS;
+  ServiceInfo *i = NULL;
+
+  if (rec->expiry && rec->expiry <= now) {
+    stale++;
+    return;
+  }
+  if (find_service(rec->name))
+    return;
+  if (rec->expiry && rec->expiry - now < remaining)
+    remaining = rec->expiry - now;
+
+  CHECK(strlen(rec->name) < sizeof(i->name), "Invalid name in snapshot: %s", rec->name);
+  CHECK_MEM((i = service_new()));
+  i->interface = rec->interface;
+  i->protocol = rec->protocol;
+  i->port = rec->port;
+  i->lifetime = rec->lifetime;
+  i->restored_expiry = rec->expiry;
+  strcpy(i->name, rec->name);
+  CHECK_MEM((i->type = intern(rec->type)));
+  CHECK_MEM((i->domain = intern(rec->domain)));
+  CHECK_MEM((i->host_name = intern(rec->host_name)));
+  CHECK(strlen(rec->address) < sizeof(i->address), "Invalid address in snapshot: %s", rec->name);
+  strcpy(i->address, rec->address);
+  CHECK(service_set_txt(i, rec->txt_lst) == 0, "Could not copy txt fields: %s", rec->name);
+  CHECK(verdict_cache_prime(i) == 0, "Incomplete announcement in snapshot: %s", i->name);
+  CHECK(service_index_add(i) == 0, "Failed to index service '%s'", i->name);
+
+  i->resolved = 1;
+  i->provisional = 1;
+  AVAHI_LLIST_PREPEND(ServiceInfo, info, services, i);
+  registry_touch(NULL);
+  journal_append(JOURNAL_RESOLVE, i);
+  expire_schedule(&i->expire, i, remaining);
+  restored++;
+  return;
+
+error:
+  service_free(i);
+  errors++;
+}
+
+int snapshot_load(const char *path) {
+  FILE *f = NULL;
+  char *buf = NULL;
+  long len;
+  unsigned long before = restored;
+  time_t now = time(NULL);
+
+  if (!(f = fopen(path, "r"))) {
+    if (errno != ENOENT)
+      WARN("Could not open snapshot %s", path);
+    return 0;
+  }
+  CHECK(fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0,
+	"Could not read snapshot %s", path);
+  CHECK_MEM((buf = avahi_malloc(len ? len : 1)));
+  CHECK(fread(buf, 1, len, f) == (size_t)len, "Could not read snapshot %s", path);
+  fclose(f);
+  f = NULL;
+
+  if (!expire_running() && expire_start(main_loop_get(), service_expired) < 0) {
+    ERROR("Could not start expiration scheduler");
+    goto error;
+  }
+  CHECK(snapshot_parse(buf, len, restore_service, &now) >= 0, "Ignoring snapshot %s", path);
+  avahi_free(buf);
+
+  /* the registry is what was just read, no need to write it back */
+  saved_gen = registry_generation();
+  INFO("Restored %lu services from snapshot", restored - before);
+  return restored - before;
+
+error:
+  if (f)
+    fclose(f);
+  avahi_free(buf);
+  errors++;
+  return -1;
+}
+
+int snapshot_save(void) {
+  char *buf = NULL;
+  size_t len = 0;
+  uint64_t gen = registry_generation();
+
+  if (!snapshot_path)
+    return 0;
+  if (gen == file_writer_written_gen(&saved_gen)) {
+    skipped++;
+    return 0;
+  }
+  CHECK(snapshot_serialize(services, &buf, &len) >= 0, "Failed to write snapshot");
+  /* the writer takes the buffer, even on failure, and only records
+   * the generation once the snapshot is written */
+  CHECK(file_writer_submit_gen(snapshot_path, buf, len, gen, &saved_gen) == 0, "Failed to write snapshot");
+  written++;
+  return 0;
+
+error:
+  errors++;
+  return -1;
+}
+
+static void snapshot_timeout_callback(AvahiTimeout *t, void *userdata) {
+  struct timeval tv = {0};
+
+  snapshot_save();
+  avahi_elapse_time(&tv, 1000 * snapshot_interval, 0);
+  snapshot_poll->timeout_update(t, &tv);
+}
+
+int snapshot_start(const AvahiPoll *poll_api, const char *path, long interval) {
+  struct timeval tv = {0};
+
+  CHECK(interval > 0, "Invalid snapshot interval");
+  CHECK_MEM((snapshot_path = avahi_strdup(path)));
+  snapshot_poll = poll_api;
+  snapshot_interval = interval;
+  avahi_elapse_time(&tv, 1000 * interval, 0);
+  CHECK((snapshot_timeout = poll_api->timeout_new(poll_api, &tv, snapshot_timeout_callback, NULL)),
+	"Failed to create snapshot timer");
+  return 0;
+
+error:
+  avahi_free(snapshot_path);
+  snapshot_path = NULL;
+  return -1;
+}
+
+void snapshot_stop(void) {
+  if (!snapshot_path)
+    return;
+  snapshot_save();
+  if (snapshot_timeout)
+    snapshot_poll->timeout_free(snapshot_timeout);
+  snapshot_timeout = NULL;
+  snapshot_poll = NULL;
+  avahi_free(snapshot_path);
+  snapshot_path = NULL;
+}
+
+void snapshot_print_stats(FILE *f) {
+  fprintf(f, "snapshots_written=%lu\n", written);
+  fprintf(f, "snapshots_skipped=%lu\n", skipped);
+  fprintf(f, "snapshot_services_restored=%lu\n", restored);
+  fprintf(f, "snapshot_services_stale=%lu\n", stale);
+  fprintf(f, "snapshot_errors=%lu\n", errors);
+}
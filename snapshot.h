@@ -0,0 +1,118 @@
+/**
+ *       @file  snapshot.h
+ *      @brief  warm-start registry snapshot for the Commotion Service Manager
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <avahi-common/watch.h>
+#include <avahi-common/strlst.h>
+
+#include "commotion-service-manager.h"
+
+/** Default path of the snapshot file */
+#define DEFAULT_SNAPSHOT_FILE "/var/run/commotion/commotion-service-manager.snapshot"
+/** Default number of seconds between snapshots */
+#define DEFAULT_SNAPSHOT_INTERVAL 300
+/** Seconds a restored service has to be seen again before it is dropped */
+#define SNAPSHOT_CONFIRM_SECS 300
+
+#define SNAPSHOT_MAGIC "CSMS"
+#define SNAPSHOT_VERSION 1
+
+/** A service as stored in the snapshot */
+typedef struct {
+  AvahiIfIndex interface;
+  AvahiProtocol protocol;
+  const char *name, *type, *domain, *host_name, *address;
+  uint16_t port;
+  long lifetime;
+  time_t expiry; /**< wall-clock time the service expires at, 0 if never */
+  AvahiStringList *txt_lst; /**< callback may take it, setting it to NULL */
+} SnapshotRecord;
+
+/** Called for each record of a snapshot */
+typedef void (*SnapshotCallback)(SnapshotRecord *rec, void *userdata);
+
+/**
+ * Serialize the resolved services of a list
+ * @param list services to serialize
+ * @param[out] buf snapshot, allocated with malloc()
+ * @param[out] len length of buf
+ * @return number of services serialized, -1 on failure
+ */
+int snapshot_serialize(ServiceInfo *list, char **buf, size_t *len);
+
+/**
+ * Check a snapshot and call a function for each record. Strings in the
+ * records point into buf.
+ * @param buf snapshot
+ * @param len length of buf
+ * @param callback function to call for each record
+ * @param userdata passed to callback
+ * @return number of records, -1 if the snapshot is invalid (callback is
+ *         then never called)
+ */
+int snapshot_parse(const char *buf, size_t len, SnapshotCallback callback, void *userdata);
+
+/**
+ * Restore the services in a snapshot file as provisionally valid. They
+ * are shown like any other service, but expire within
+ * SNAPSHOT_CONFIRM_SECS unless a browser sees them again; their
+ * signatures are put in the verdict cache, so confirming them only takes
+ * a resolve. Expired services and services already known are skipped.
+ * @param path snapshot file
+ * @return number of services restored, -1 on failure
+ */
+int snapshot_load(const char *path);
+
+/**
+ * Write the snapshot periodically, whenever the registry has changed
+ * @param poll_api poll object to run the timer on
+ * @param path snapshot file
+ * @param interval seconds between snapshots
+ * @return 0=success, -1=fail
+ */
+int snapshot_start(const AvahiPoll *poll_api, const char *path, long interval);
+
+/**
+ * Write a final snapshot and stop the timer. Must be called while the
+ * expiration scheduler and file writer are still running.
+ */
+void snapshot_stop(void);
+
+/**
+ * Write the snapshot now, if the registry has changed since the last one
+ * @return 0=success, -1=fail
+ */
+int snapshot_save(void);
+
+/**
+ * Print snapshot counters
+ * @param f file to print to
+ */
+void snapshot_print_stats(FILE *f);
+
+#endif
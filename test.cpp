@@ -23,8 +23,12 @@
  */
 
 #include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
 // #include <list>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <avahi-core/lookup.h>
 #include <avahi-common/simple-watch.h>
 #include <avahi-common/llist.h>
@@ -34,11 +38,29 @@ extern "C" {
 #include <serval-crypto.h>
 #include "commotion-service-manager.h"
 #include "util.h"
+#include "verify.h"
+#include "refresh.h"
+#include "query.h"
+#include "journal.h"
+#include "file-writer.h"
+#include "snapshot.h"
+#include "registry-export.h"
+#include "registry-reader.h"
+#include "intern.h"
+#include "pool.h"
+#include "txt-blob.h"
 }
 #include "gtest/gtest.h"
 
 #define SIG_LENGTH 128
 
+/** Build a blob from a string list, freeing the list */
+static TxtBlob *MakeBlob(AvahiStringList *txt) {
+  TxtBlob *blob = txt_blob_new(NULL, txt, 0, 0);
+  avahi_string_list_free(txt);
+  return blob;
+}
+
 class CSMTest : public ::testing::Test {
   protected:
     AvahiSServiceTypeBrowser *stb;
@@ -121,8 +143,10 @@ class CSMTest : public ::testing::Test {
 	avahi_s_service_type_browser_free(stb);
       if (sb)
 	avahi_s_service_browser_free(sb);
+      free_service_browsers();
       if (server)
 	avahi_server_free(server);
+      expire_stop();
       if (simple_poll)
 	avahi_simple_poll_free(simple_poll);
     }
@@ -219,6 +243,33 @@ TEST_F(CSMTest, TxtListToStringTest) {
   free(expect);
 }
 
+TEST_F(CSMTest, ParseTxtFieldsTest) {
+  TxtFields fields;
+  
+  CreateTxtList();
+  
+  TxtBlob *blob = txt_blob_new(NULL, txt_lst, 0, 0);
+  ASSERT_TRUE(blob);
+  ASSERT_EQ(0, parse_txt_fields(blob, &fields));
+  EXPECT_TRUE(txt_fields_complete(&fields));
+  EXPECT_STREQ(name, fields.name.str);
+  EXPECT_EQ(strlen(name), fields.name.len);
+  EXPECT_STREQ(uri, fields.uri.str);
+  EXPECT_STREQ(description, fields.description.str);
+  EXPECT_STREQ(sid, fields.fingerprint.str);
+  EXPECT_EQ(FINGERPRINT_LEN, fields.fingerprint.len);
+  EXPECT_STREQ(signature, fields.signature.str);
+  EXPECT_EQ(2, fields.types_len);
+  avahi_free(blob);
+  
+  blob = MakeBlob(avahi_string_list_new("name=a", "uri=b", "noseparator", NULL));
+  ASSERT_EQ(0, parse_txt_fields(blob, &fields));
+  EXPECT_FALSE(txt_fields_complete(&fields));
+  EXPECT_EQ(0, parse_txt_fields(NULL, &fields));
+  EXPECT_FALSE(txt_fields_complete(&fields));
+  avahi_free(blob);
+}
+
 void CSMTest::CreateAvahiServer() {
   simple_poll = avahi_simple_poll_new();
   ASSERT_TRUE(simple_poll);
@@ -240,6 +291,20 @@ TEST_F(CSMTest, BrowseTypeCallbackTest1) {
   ASSERT_EQ(0,avahi_simple_poll_iterate(simple_poll,0));
 }
 
+TEST_F(CSMTest, RefreshServiceBrowsersTest) {
+  CreateAvahiServer();
+  
+  browse_type_callback(stb, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, AVAHI_BROWSER_NEW, type, domain, AVAHI_LOOKUP_RESULT_MULTICAST, server);
+  ASSERT_EQ(1u, service_browser_count());
+  /* a repeated NEW for a known type doesn't create a second browser */
+  browse_type_callback(stb, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, AVAHI_BROWSER_NEW, type, domain, AVAHI_LOOKUP_RESULT_MULTICAST, server);
+  EXPECT_EQ(1u, service_browser_count());
+  /* nor does recreating the browsers */
+  refresh_service_browsers(server);
+  EXPECT_EQ(1u, service_browser_count());
+  ASSERT_EQ(0,avahi_simple_poll_iterate(simple_poll,0));
+}
+
 TEST_F(CSMTest, BrowseTypeCallbackTest2) {
   CreateAvahiServer();
   
@@ -267,6 +332,27 @@ TEST_F(CSMTest, AddFindRemoveServiceTest) {
   ASSERT_FALSE(find_service(name));
 }
 
+TEST(ServiceIndexTest, AddFindRemoveTest) {
+  ServiceInfo a, b;
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+  strcpy(a.name, "Service A");
+  strcpy(b.name, "service b");
+  
+  ASSERT_EQ(0, service_index_add(&a));
+  ASSERT_EQ(0, service_index_add(&b));
+  EXPECT_EQ(&a, find_service("SERVICE A"));
+  EXPECT_EQ(&b, find_service("Service B"));
+  EXPECT_EQ(service_name_hash("SERVICE A"), service_name_hash("service a"));
+  
+  service_index_remove(&a);
+  EXPECT_FALSE(find_service("service a"));
+  EXPECT_EQ(&b, find_service("service b"));
+  
+  service_index_remove(&b);
+  EXPECT_FALSE(find_service("service b"));
+}
+
 void CSMTest::CreateServiceBrowser() {
   CreateAvahiServer();
   sb = avahi_s_service_browser_new(server, 
@@ -318,12 +404,674 @@ TEST_F(CSMTest, VerifyAnnouncementTest) {
   CreateTxtList();
   ASSERT_TRUE(txt_lst);
   
-  service->txt_lst = avahi_string_list_copy(txt_lst);
+  ASSERT_EQ(0, service_set_txt(service, txt_lst));
   service->resolved = true;
   
   ASSERT_EQ(0,verify_announcement(service));
 }
 
+static unsigned long GetStat(const char *key) {
+  char *buf = NULL, *line;
+  size_t len = 0;
+  unsigned long val = 0;
+  FILE *f = open_memstream(&buf, &len);
+  verify_print_stats(f);
+  fclose(f);
+  if ((line = strstr(buf, key)) && line[strlen(key)] == '=')
+    val = strtoul(line + strlen(key) + 1, NULL, 10);
+  free(buf);
+  return val;
+}
+
+TEST_F(CSMTest, VerifyAnnouncementReusesConnectionTest) {
+  CreateService();
+  CreateTxtList();
+  ASSERT_TRUE(txt_lst);
+  
+  ASSERT_EQ(0, service_set_txt(service, txt_lst));
+  
+  ASSERT_EQ(0,verify_announcement(service));
+  unsigned long avoided = GetStat("co_connects_avoided");
+  /* change the announcement so the verdict isn't served from cache */
+  service->port = port + 1;
+  ASSERT_EQ(1,verify_announcement(service));
+  EXPECT_EQ(avoided + 1, GetStat("co_connects_avoided"));
+}
+
+TEST(VerifyTest, SasCacheTest) {
+  char sas[2*SAS_SIZE+1] = {0}, cached[2*SAS_SIZE+1] = {0};
+  
+  ASSERT_TRUE(sas_fetch(SID, sas, sizeof(sas)));
+  unsigned long hits = GetStat("sas_cache_hits");
+  ASSERT_TRUE(sas_fetch(SID, cached, sizeof(cached)));
+  EXPECT_EQ(hits + 1, GetStat("sas_cache_hits"));
+  EXPECT_STREQ(sas, cached);
+  
+  /* lookups that fail are remembered too */
+  EXPECT_FALSE(sas_fetch("0000000000000000000000000000000000000000000000000000000000000000", sas, sizeof(sas)));
+  unsigned long negative_hits = GetStat("sas_cache_negative_hits");
+  EXPECT_FALSE(sas_fetch("0000000000000000000000000000000000000000000000000000000000000000", sas, sizeof(sas)));
+  EXPECT_EQ(negative_hits + 1, GetStat("sas_cache_negative_hits"));
+}
+
+TEST_F(CSMTest, VerifyAnnouncementCachedTest) {
+  CreateService();
+  CreateTxtList();
+  ASSERT_TRUE(txt_lst);
+  
+  ASSERT_EQ(0, service_set_txt(service, txt_lst));
+  
+  ASSERT_EQ(0,verify_announcement(service));
+  unsigned long hits = GetStat("verdict_cache_hits");
+  ASSERT_EQ(0,verify_announcement(service));
+  EXPECT_EQ(hits + 1, GetStat("verdict_cache_hits"));
+  
+  /* a changed announcement must not hit the cache */
+  service->port = port + 1;
+  EXPECT_EQ(1,verify_announcement(service));
+}
+
+TEST(RefreshTest, AdaptiveIntervalTest) {
+  int j;
+  unsigned int delay;
+  
+  refresh_sched_init(10, 100);
+  
+  /* back off to the max while nothing changes */
+  for (j = 0; j < 20; j++)
+    delay = refresh_next_delay();
+  EXPECT_EQ(100, refresh_current_interval());
+  EXPECT_GE(delay, 100 * 1000 * (100 - REFRESH_JITTER_PERCENT) / 100);
+  EXPECT_LE(delay, 100 * 1000 * (100 + REFRESH_JITTER_PERCENT) / 100);
+  
+  /* churn shortens it */
+  refresh_note_churn();
+  refresh_next_delay();
+  EXPECT_EQ(50, refresh_current_interval());
+  for (j = 0; j < 10; j++) {
+    refresh_note_failure(j + 1);
+    refresh_next_delay();
+  }
+  EXPECT_EQ(10, refresh_current_interval());
+  
+  /* the same bad announcement seen again every cycle lets it back off */
+  refresh_note_failure(1234);
+  refresh_next_delay();
+  for (j = 0; j < 20; j++) {
+    refresh_note_failure(1234);
+    refresh_next_delay();
+  }
+  EXPECT_EQ(100, refresh_current_interval());
+}
+
+static void CountExpired(AvahiTimeout *t, void *userdata) {
+  EXPECT_TRUE(t != NULL);
+  (*(int*)userdata)++;
+}
+
+TEST(ExpireTest, ExpireCancelTest) {
+  AvahiSimplePoll *poll = avahi_simple_poll_new();
+  ExpireEntry a = ExpireEntry(), b = ExpireEntry(), c = ExpireEntry(), d = ExpireEntry();
+  int fired_a = 0, fired_b = 0, fired_c = 0, fired_d = 0;
+  time_t start;
+  
+  ASSERT_TRUE(poll);
+  ASSERT_EQ(0, expire_start(avahi_simple_poll_get(poll), CountExpired));
+  expire_schedule(&a, &fired_a, 1);
+  expire_schedule(&b, &fired_b, 1);
+  expire_schedule(&c, &fired_c, 1);
+  expire_schedule(&d, &fired_d, 100000);
+  expire_cancel(&c);
+  expire_cancel(&c);
+  
+  start = time(NULL);
+  while ((!fired_a || !fired_b) && time(NULL) - start < 5)
+    avahi_simple_poll_iterate(poll, 100);
+  
+  EXPECT_EQ(1, fired_a);
+  EXPECT_EQ(1, fired_b);
+  EXPECT_EQ(0, fired_c);
+  EXPECT_EQ(0, fired_d);
+  
+  expire_stop();
+  avahi_simple_poll_free(poll);
+}
+
+static void CountTimeout(AvahiTimeout *t, void *userdata) {
+  (*(int*)userdata)++;
+}
+
+static void ReadWatch(AvahiWatch *w, int fd, AvahiWatchEvent event, void *userdata) {
+  char c;
+  EXPECT_EQ(AVAHI_WATCH_IN, event);
+  EXPECT_EQ(1, read(fd, &c, 1));
+  (*(int*)userdata)++;
+}
+
+TEST(EpollTest, WatchTimeoutTest) {
+  EpollPoll *ep = epoll_poll_new();
+  const AvahiPoll *api = NULL;
+  AvahiWatch *w1 = NULL, *w2 = NULL;
+  AvahiTimeout *t1 = NULL, *t2 = NULL;
+  int fds[2], read1 = 0, read2 = 0, fired1 = 0, fired2 = 0;
+  struct timeval tv;
+  
+  ASSERT_TRUE(ep);
+  api = epoll_poll_get(ep);
+  ASSERT_EQ(0, pipe(fds));
+  
+  /* two watches on the same fd, as AvahiSimplePoll allows */
+  ASSERT_TRUE((w1 = api->watch_new(api, fds[0], AVAHI_WATCH_IN, ReadWatch, &read1)));
+  ASSERT_TRUE((w2 = api->watch_new(api, fds[0], AVAHI_WATCH_IN, ReadWatch, &read2)));
+  api->watch_free(w2);
+  ASSERT_EQ(1, write(fds[1], "x", 1));
+  EXPECT_EQ(0, epoll_poll_iterate(ep, 1000));
+  EXPECT_EQ(1, read1);
+  EXPECT_EQ(0, read2);
+  
+  t1 = api->timeout_new(api, avahi_elapse_time(&tv, 10, 0), CountTimeout, &fired1);
+  t2 = api->timeout_new(api, avahi_elapse_time(&tv, 10, 0), CountTimeout, &fired2);
+  ASSERT_TRUE(t1 && t2);
+  api->timeout_update(t2, NULL);
+  while (!fired1)
+    ASSERT_EQ(0, epoll_poll_iterate(ep, 1000));
+  EXPECT_EQ(0, fired2);
+  
+  epoll_poll_quit(ep);
+  EXPECT_EQ(1, epoll_poll_iterate(ep, -1));
+  
+  /* remaining watches and timeouts are freed with the loop */
+  epoll_poll_free(ep);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+static char *Query(const char *request) {
+  char *out = NULL;
+  size_t out_len = 0;
+  FILE *f = open_memstream(&out, &out_len);
+  query_handle(request, f);
+  fclose(f);
+  return out;
+}
+
+TEST(QueryTest, FilterPaginateTest) {
+  ServiceInfo a, b, c, *saved = services;
+  char *out = NULL;
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+  memset(&c, 0, sizeof(c));
+  strcpy(a.name, "a");
+  strcpy(b.name, "b");
+  strcpy(c.name, "c");
+  a.txt = MakeBlob(avahi_string_list_new("type=Community", "fingerprint=AAAA", NULL));
+  b.txt = MakeBlob(avahi_string_list_new("type=Wiki", "type=community", "fingerprint=BBBB", NULL));
+  c.txt = MakeBlob(avahi_string_list_new("type=Community", NULL));
+  a.resolved = b.resolved = 1;
+  services = NULL;
+  AVAHI_LLIST_PREPEND(ServiceInfo, info, services, &a);
+  AVAHI_LLIST_PREPEND(ServiceInfo, info, services, &b);
+  AVAHI_LLIST_PREPEND(ServiceInfo, info, services, &c);
+  
+  /* unresolved services are never returned */
+  out = Query("all");
+  EXPECT_EQ(0, strncmp(out, "OK 2 2\n", 7));
+  free(out);
+  
+  out = Query("type COMMUNITY offset 1 limit 5");
+  EXPECT_EQ(0, strncmp(out, "OK 2 1\n", 7));
+  EXPECT_TRUE(strstr(out, ";a;") && !strstr(out, ";b;"));
+  free(out);
+  
+  out = Query("fingerprint bbbb");
+  EXPECT_EQ(0, strncmp(out, "OK 1 1\n", 7));
+  EXPECT_TRUE(strstr(out, ";b;"));
+  free(out);
+  
+  out = Query("all limit 0");
+  EXPECT_STREQ("OK 2 0\n\n", out);
+  free(out);
+  
+  out = Query("type");
+  EXPECT_STREQ("ERR missing argument\n\n", out);
+  free(out);
+  
+  out = Query("all offset x");
+  EXPECT_STREQ("ERR invalid offset\n\n", out);
+  free(out);
+  
+  services = saved;
+  avahi_free(a.txt);
+  avahi_free(b.txt);
+  avahi_free(c.txt);
+}
+
+TEST(RegistryTest, RowCacheTest) {
+  ServiceInfo a;
+  const char *row = NULL;
+  size_t row_len = 0;
+  uint64_t gen = registry_generation();
+  memset(&a, 0, sizeof(a));
+  strcpy(a.name, "a");
+  a.type = (char*)"_commotion._tcp";
+  a.domain = (char*)"mesh.local";
+  a.host_name = (char*)"a.local";
+  a.port = 80;
+  
+  ASSERT_TRUE((row = service_row(&a, &row_len)));
+  EXPECT_EQ(strlen(row), row_len);
+  EXPECT_TRUE(strstr(row, ";a;_commotion._tcp;mesh.local;a.local;;80;\n"));
+  /* the row is reused until the service is touched */
+  a.port = 8080;
+  EXPECT_EQ(row, service_row(&a, NULL));
+  EXPECT_EQ(gen, registry_generation());
+  
+  registry_touch(&a);
+  EXPECT_EQ(gen + 1, registry_generation());
+  ASSERT_TRUE((row = service_row(&a, NULL)));
+  EXPECT_TRUE(strstr(row, ";8080;"));
+  
+  registry_touch(NULL);
+  EXPECT_EQ(gen + 2, registry_generation());
+  free(a.row);
+}
+
+TEST(JournalTest, RingTest) {
+  ServiceInfo a;
+  const JournalEntry *e = NULL;
+  uint64_t first = journal_last() + 1;
+  memset(&a, 0, sizeof(a));
+  strcpy(a.name, "a");
+  a.type = (char*)"_commotion._tcp";
+  a.domain = (char*)"mesh.local";
+  a.host_name = (char*)"a.local";
+  
+  ASSERT_EQ(0, journal_configure(4));
+  EXPECT_EQ(first, journal_append(JOURNAL_ADD, &a));
+  EXPECT_EQ(first + 1, journal_append(JOURNAL_RESOLVE, &a));
+  ASSERT_TRUE((e = journal_get(first + 1)));
+  EXPECT_EQ(JOURNAL_RESOLVE, e->event);
+  EXPECT_TRUE(strstr(e->line, " RESOLVE ") && strstr(e->line, ";a;_commotion._tcp;mesh.local;a.local;"));
+  
+  /* older changes fall out of the ring */
+  journal_append(JOURNAL_UPDATE, &a);
+  journal_append(JOURNAL_UPDATE, &a);
+  journal_append(JOURNAL_EXPIRE, &a);
+  EXPECT_EQ(first + 4, journal_last());
+  EXPECT_EQ(first + 1, journal_first());
+  EXPECT_FALSE(journal_get(first));
+  EXPECT_FALSE(journal_get(first + 5));
+  ASSERT_TRUE((e = journal_get(first + 4)));
+  EXPECT_EQ(JOURNAL_EXPIRE, e->event);
+  EXPECT_STREQ(";a;_commotion._tcp;mesh.local\n", strstr(e->line, ";a;"));
+  
+  /* a disabled journal records nothing */
+  ASSERT_EQ(0, journal_configure(0));
+  EXPECT_EQ(0u, journal_append(JOURNAL_REMOVE, &a));
+  EXPECT_EQ(first + 4, journal_last());
+  
+  journal_configure(DEFAULT_JOURNAL_SIZE);
+}
+
+/** Connect to the query socket, send a request and collect what comes back */
+static std::string Subscribe(EpollPoll *ep, const char *path, const char *request) {
+  struct sockaddr_un addr;
+  char buf[4096];
+  std::string out;
+  ssize_t n;
+  int fd, j;
+  
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  EXPECT_EQ(0, connect(fd, (struct sockaddr*)&addr, sizeof(addr)));
+  EXPECT_EQ((ssize_t)strlen(request), write(fd, request, strlen(request)));
+  for (j = 0; j < 5; j++) {
+    epoll_poll_iterate(ep, 100);
+    while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+      out.append(buf, n);
+  }
+  close(fd);
+  epoll_poll_iterate(ep, 100);
+  return out;
+}
+
+TEST(QueryTest, SubscribeEpochTest) {
+  const char *path = "/tmp/csm-query-test.sock";
+  EpollPoll *ep = epoll_poll_new();
+  ServiceInfo a;
+  char request[128], expect[128];
+  unsigned long long epoch = journal_epoch(), first, last;
+  std::string out;
+  memset(&a, 0, sizeof(a));
+  strcpy(a.name, "a");
+  a.type = (char*)"_commotion._tcp";
+  a.domain = (char*)"mesh.local";
+  a.host_name = (char*)"a.local";
+  
+  ASSERT_TRUE(ep);
+  ASSERT_EQ(0, journal_configure(DEFAULT_JOURNAL_SIZE));
+  ASSERT_EQ(0, query_start(epoll_poll_get(ep), path));
+  first = journal_append(JOURNAL_ADD, &a);
+  last = journal_append(JOURNAL_EXPIRE, &a);
+  ASSERT_TRUE(first && last);
+  EXPECT_EQ(epoch, journal_epoch());
+  
+  /* same run: the changes after SEQ are streamed as they are */
+  snprintf(request, sizeof(request), "subscribe %llu %llu\n", first, epoch);
+  out = Subscribe(ep, path, request);
+  snprintf(expect, sizeof(expect), "OK %llu %llu\n%llu EXPIRE ", last, epoch, last);
+  EXPECT_EQ(0u, out.find(expect)) << out;
+  EXPECT_EQ(std::string::npos, out.find("RESYNC")) << out;
+  
+  /* a sequence number from another run, or without a run, is resynced */
+  snprintf(request, sizeof(request), "subscribe %llu %llu\n", first, epoch + 1);
+  out = Subscribe(ep, path, request);
+  snprintf(expect, sizeof(expect), "OK %llu %llu\n%llu RESYNC\n", last, epoch, last);
+  EXPECT_EQ(expect, out);
+  
+  snprintf(request, sizeof(request), "subscribe %llu\n", first);
+  out = Subscribe(ep, path, request);
+  EXPECT_EQ(expect, out);
+  
+  query_stop();
+  epoll_poll_free(ep);
+}
+
+TEST(FileWriterTest, SubmitTest) {
+  char path[] = "/tmp/csm-test-XXXXXX", contents[16] = {0};
+  char *first = strdup("first\n"), *second = strdup("second\n");
+  FILE *f = NULL;
+  int fd = mkstemp(path);
+  
+  ASSERT_GE(fd, 0);
+  close(fd);
+  ASSERT_EQ(0, file_writer_start());
+  EXPECT_EQ(0, file_writer_submit(path, first, strlen(first)));
+  EXPECT_EQ(0, file_writer_submit(path, second, strlen(second)));
+  file_writer_stop();
+  
+  /* whichever writes ran, the newest contents win */
+  ASSERT_TRUE((f = fopen(path, "r")));
+  EXPECT_TRUE(fgets(contents, sizeof(contents), f));
+  EXPECT_STREQ("second\n", contents);
+  fclose(f);
+  
+  EXPECT_EQ(-1, write_file_atomic("/nonexistent/dir/file", "x", 1));
+  unlink(path);
+}
+
+TEST(FileWriterTest, WrittenGenTest) {
+  char path[] = "/tmp/csm-test-XXXXXX";
+  uint64_t gen = 0;
+  int fd = mkstemp(path);
+  
+  ASSERT_GE(fd, 0);
+  close(fd);
+  ASSERT_EQ(0, file_writer_start());
+  EXPECT_EQ(0, file_writer_submit_gen(path, strdup("first\n"), 6, 3, &gen));
+  file_writer_stop();
+  EXPECT_EQ(3u, file_writer_written_gen(&gen));
+  
+  /* a failed write leaves the last written generation in place */
+  ASSERT_EQ(0, file_writer_start());
+  EXPECT_EQ(0, file_writer_submit_gen("/nonexistent/dir/file", strdup("x"), 1, 4, &gen));
+  file_writer_stop();
+  EXPECT_EQ(3u, file_writer_written_gen(&gen));
+  unlink(path);
+}
+
+static void collect_record(SnapshotRecord *rec, void *userdata) {
+  SnapshotRecord *out = (SnapshotRecord*)userdata;
+  *out = *rec;
+  /* take the txt list, the rest points into the buffer */
+  rec->txt_lst = NULL;
+}
+
+TEST(SnapshotTest, RoundTripTest) {
+  ServiceInfo a, b;
+  SnapshotRecord rec;
+  char *buf = NULL;
+  size_t len = 0;
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+  a.interface = 2;
+  strcpy(a.name, "a");
+  a.type = (char*)"_commotion._tcp";
+  a.domain = (char*)"mesh.local";
+  a.host_name = (char*)"a.local";
+  strcpy(a.address, "10.0.0.1");
+  a.port = 80;
+  a.lifetime = 3600;
+  a.resolved = 1;
+  a.provisional = 1;
+  a.restored_expiry = 1234567890;
+  a.txt = MakeBlob(avahi_string_list_add(avahi_string_list_add(NULL, "name=a"), "ttl=5"));
+  /* unresolved services aren't saved */
+  strcpy(b.name, "b");
+  a.info_next = &b;
+  
+  ASSERT_EQ(1, snapshot_serialize(&a, &buf, &len));
+  memset(&rec, 0, sizeof(rec));
+  ASSERT_EQ(1, snapshot_parse(buf, len, collect_record, &rec));
+  EXPECT_EQ(2, rec.interface);
+  EXPECT_STREQ("a", rec.name);
+  EXPECT_STREQ("a.local", rec.host_name);
+  EXPECT_STREQ("10.0.0.1", rec.address);
+  EXPECT_EQ(80, rec.port);
+  EXPECT_EQ(3600, rec.lifetime);
+  EXPECT_EQ(1234567890, rec.expiry);
+  ASSERT_TRUE(rec.txt_lst && rec.txt_lst->next && !rec.txt_lst->next->next);
+  EXPECT_STREQ("ttl=5", (char*)rec.txt_lst->text);
+  EXPECT_STREQ("name=a", (char*)rec.txt_lst->next->text);
+  avahi_string_list_free(rec.txt_lst);
+  
+  /* corrupt and truncated snapshots are rejected as a whole */
+  buf[len - 1] ^= 1;
+  EXPECT_EQ(-1, snapshot_parse(buf, len, collect_record, &rec));
+  buf[len - 1] ^= 1;
+  EXPECT_EQ(-1, snapshot_parse(buf, len - 1, collect_record, &rec));
+  EXPECT_EQ(-1, snapshot_parse(buf, 3, collect_record, &rec));
+  
+  free(buf);
+  avahi_free(a.txt);
+}
+
+TEST(RegistryExportTest, MapTest) {
+  ServiceInfo a, b;
+  CsmRegistry reg;
+  const CsmRegistryRecord *rec = NULL;
+  char path[] = "/tmp/csm-test-XXXXXX", *buf = NULL;
+  size_t len = 0;
+  int fd = mkstemp(path);
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+  strcpy(a.name, "Wiki");
+  a.type = (char*)"_commotion._tcp";
+  a.domain = (char*)"mesh.local";
+  a.host_name = (char*)"wiki.local";
+  strcpy(a.address, "10.0.0.1");
+  a.port = 80;
+  a.resolved = 1;
+  a.txt = MakeBlob(avahi_string_list_add(avahi_string_list_add(NULL, "fingerprint=ABCD"), "description=\"quoted\";\n"));
+  b = a;
+  strcpy(b.name, "chat");
+  b.provisional = 1;
+  b.txt = NULL;
+  a.info_next = &b;
+  
+  ASSERT_GE(fd, 0);
+  close(fd);
+  ASSERT_EQ(2, registry_export_serialize(&a, 42, &buf, &len));
+  ASSERT_EQ(0, write_file_atomic(path, buf, len));
+  free(buf);
+  
+  ASSERT_EQ(0, csm_registry_open(&reg, path));
+  EXPECT_EQ(42u, csm_registry_generation(&reg));
+  EXPECT_EQ(2u, csm_registry_count(&reg));
+  /* sorted by name */
+  ASSERT_TRUE((rec = csm_registry_record(&reg, 0)));
+  EXPECT_STREQ("chat", csm_registry_string(&reg, rec->name));
+  EXPECT_EQ(CSM_REGISTRY_PROVISIONAL, rec->flags);
+  EXPECT_FALSE(csm_registry_record(&reg, 2));
+  
+  ASSERT_TRUE((rec = csm_registry_find(&reg, "WIKI")));
+  EXPECT_STREQ("wiki.local", csm_registry_string(&reg, rec->host_name));
+  EXPECT_STREQ("10.0.0.1", csm_registry_string(&reg, rec->address));
+  EXPECT_EQ(80, rec->port);
+  EXPECT_STREQ("ABCD", csm_registry_txt(&reg, rec, "fingerprint", &len));
+  EXPECT_EQ(4u, len);
+  /* TXT entries are stored raw, not escaped */
+  EXPECT_STREQ("\"quoted\";\n", csm_registry_txt(&reg, rec, "description", NULL));
+  EXPECT_FALSE(csm_registry_txt(&reg, rec, "uri", NULL));
+  EXPECT_FALSE(csm_registry_find(&reg, "nonexistent"));
+  
+  /* the daemon replaces the file instead of rewriting it */
+  EXPECT_EQ(0, csm_registry_changed(&reg, path));
+  ASSERT_EQ(0, write_file_atomic(path, "CSMR", 4));
+  EXPECT_EQ(1, csm_registry_changed(&reg, path));
+  csm_registry_close(&reg);
+  
+  EXPECT_EQ(-1, csm_registry_open(&reg, path));
+  EXPECT_EQ(EINVAL, errno);
+  
+  unlink(path);
+  avahi_free(a.txt);
+}
+
+TEST(InternTest, ShareReleaseTest) {
+  char type[] = "_commotion._tcp";
+  char *a = intern(type), *b = NULL, *c = NULL;
+  
+  ASSERT_TRUE(a);
+  EXPECT_NE(type, a);
+  EXPECT_STREQ(type, a);
+  /* equal strings share one copy */
+  EXPECT_EQ(a, (b = intern("_commotion._tcp")));
+  EXPECT_EQ(a, intern_find(type));
+  EXPECT_NE(a, (c = intern("_http._tcp")));
+  EXPECT_FALSE(intern(NULL));
+  
+  /* the copy lives until the last reference is dropped */
+  intern_release(a);
+  EXPECT_EQ(b, intern_find(type));
+  intern_release(b);
+  EXPECT_FALSE(intern_find(type));
+  EXPECT_EQ(c, intern_find("_http._tcp"));
+  intern_release(c);
+  intern_release(NULL);
+}
+
+TEST(PoolTest, SlabArenaTest) {
+  Slab slab = SLAB_INIT(ServiceInfo);
+  ServiceInfo *objs[200];
+  Arena arena;
+  char *s = NULL;
+  int j;
+
+  for (j = 0; j < 200; j++) {
+    ASSERT_TRUE((objs[j] = (ServiceInfo*)slab_alloc(&slab)));
+    objs[j]->port = j;
+  }
+  EXPECT_EQ(200UL, slab.objects);
+  unsigned long pages = slab.pages;
+  EXPECT_GT(pages, 1UL);
+  /* a freed object is handed out again, zeroed */
+  slab_free(&slab, objs[7]);
+  EXPECT_EQ(objs[7], (objs[7] = (ServiceInfo*)slab_alloc(&slab)));
+  EXPECT_EQ(0, objs[7]->port);
+  EXPECT_EQ(pages, slab.pages);
+  /* emptied pages are unmapped, but for one */
+  for (j = 0; j < 200; j++)
+    slab_free(&slab, objs[j]);
+  EXPECT_EQ(0UL, slab.objects);
+  EXPECT_EQ(1UL, slab.pages);
+
+  memset(&arena, 0, sizeof(arena));
+  ASSERT_EQ(0, arena_reserve(&arena, 1000));
+  ASSERT_TRUE((s = arena_strndup(&arena, "fingerprint=ABCD", 11)));
+  EXPECT_STREQ("fingerprint", s);
+  for (j = 0; j < 100; j++)
+    ASSERT_TRUE(arena_alloc(&arena, 100));
+  EXPECT_STREQ("fingerprint", s);
+  arena_free(&arena);
+  EXPECT_FALSE(arena.blocks);
+}
+
+TEST(PoolTest, ServiceTxtTest) {
+  AvahiStringList *txt = avahi_string_list_new("name=a", "type=Wiki", NULL);
+  ServiceInfo *i = service_new();
+
+  ASSERT_TRUE(i);
+  ASSERT_EQ(0, service_set_txt(i, txt));
+  avahi_string_list_free(txt);
+  ASSERT_TRUE(i->txt);
+  EXPECT_STREQ("Wiki", txt_blob_find(i->txt, "type", NULL));
+
+  /* new fields go in a fresh arena */
+  txt = avahi_string_list_new("name=b", NULL);
+  ASSERT_EQ(0, service_set_txt(i, txt));
+  avahi_string_list_free(txt);
+  EXPECT_EQ(1, i->txt->count);
+  EXPECT_STREQ("b", txt_blob_find(i->txt, "name", NULL));
+  EXPECT_FALSE(txt_blob_find(i->txt, "type", NULL));
+  service_free(i);
+}
+
+TEST(TxtBlobTest, FindPrependFormatTest) {
+  AvahiStringList *txt = avahi_string_list_new("name=a", "noseparator", "type=Wiki", "description=\"quoted\"", NULL);
+  TxtBlob *blob = txt_blob_new(NULL, txt, 1, 64), *copy = NULL;
+  char *expect = NULL, buf[256];
+  size_t len = 0;
+
+  ASSERT_TRUE(blob);
+  EXPECT_EQ(4, blob->count);
+  /* same order as the list */
+  EXPECT_STREQ("description=\"quoted\"", txt_blob_record(blob, 0, &len));
+  EXPECT_EQ(strlen("description=\"quoted\""), len);
+  EXPECT_STREQ("a", txt_blob_find(blob, "name", &len));
+  EXPECT_EQ(1u, len);
+  EXPECT_STREQ("", txt_blob_find(blob, "noseparator", &len));
+  EXPECT_EQ(0u, len);
+  EXPECT_FALSE(txt_blob_find(blob, "nam", NULL));
+  EXPECT_FALSE(txt_blob_find(blob, "uri", NULL));
+
+  /* formatted as txt_list_to_string() does */
+  expect = txt_list_to_string(txt);
+  ASSERT_EQ(strlen(expect), txt_blob_format(blob, NULL));
+  txt_blob_format(blob, buf);
+  EXPECT_STREQ(expect, buf);
+  free(expect);
+
+  /* one record was left room for */
+  ASSERT_EQ(0, txt_blob_prepend(blob, "expiration=soon", strlen("expiration=soon")));
+  EXPECT_EQ(-1, txt_blob_prepend(blob, "x=y", 3));
+  EXPECT_STREQ("expiration=soon", txt_blob_record(blob, 0, NULL));
+  EXPECT_STREQ("soon", txt_blob_find(blob, "expiration", NULL));
+  EXPECT_STREQ("a", txt_blob_find(blob, "name", NULL));
+
+  ASSERT_TRUE((copy = txt_blob_copy(blob)));
+  EXPECT_EQ(5, copy->count);
+  EXPECT_STREQ("Wiki", txt_blob_find(copy, "type", NULL));
+  avahi_free(copy);
+  avahi_free(blob);
+  avahi_string_list_free(txt);
+}
+
+TEST(UtilTest, EscapeTest) {
+  int len = 0;
+  char *escaped = escape((char*)"a\"b\nc\rd", &len);
+  EXPECT_STREQ("a&quot;b&#10;c&#13;d", escaped);
+  EXPECT_EQ((int)strlen(escaped), len);
+  free(escaped);
+  
+  escaped = escape((char*)"", &len);
+  EXPECT_STREQ("", escaped);
+  EXPECT_EQ(0, len);
+  free(escaped);
+}
+
 TEST(UtilTest, TtlTest) {
   EXPECT_TRUE(isValidTtl("0"));
   EXPECT_TRUE(isValidTtl("5"));
@@ -356,6 +1104,39 @@ TEST(UtilTest, SignatureTest) {
   EXPECT_FALSE(isValidSignature("0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEG",128)); // non-hex
 }
 
+TEST(UtilTest, HexTest) {
+  char hex[] = "0123456789abcdefABCDEF0123456789abcdefABCDEF0123456789abcdefABCDEF0123456789";
+  size_t len = strlen(hex);
+  unsigned char bin[64];
+  
+  EXPECT_TRUE(isHex(hex, len));
+  EXPECT_TRUE(isHex(hex, 0));
+  /* a bad char anywhere must be caught, in both the vector and tail loops */
+  for (size_t i = 0; i < len; i++) {
+    char saved = hex[i];
+    const char bad[] = {'/', ':', '@', 'G', '`', 'g', ' ', '\0', (char)0x80, (char)0xC1};
+    for (size_t j = 0; j < sizeof(bad); j++) {
+      hex[i] = bad[j];
+      EXPECT_FALSE(isHex(hex, len)) << "position " << i << " char " << (int)bad[j];
+    }
+    hex[i] = saved;
+  }
+  
+  ASSERT_EQ(0, hexDecode("00fFa5", 6, bin));
+  EXPECT_EQ(0x00, bin[0]);
+  EXPECT_EQ(0xFF, bin[1]);
+  EXPECT_EQ(0xA5, bin[2]);
+  EXPECT_EQ(-1, hexDecode("0g", 2, bin));
+  EXPECT_EQ(-1, hexDecode("abc", 3, bin));
+  
+  EXPECT_TRUE(decodeFingerprint("0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF", 64, bin));
+  EXPECT_EQ(0x01, bin[0]);
+  EXPECT_EQ(0xEF, bin[31]);
+  EXPECT_FALSE(decodeFingerprint("0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEG", 64, bin));
+  EXPECT_TRUE(decodeSignature("0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF", 128, bin));
+  EXPECT_EQ(0xEF, bin[63]);
+}
+
 void CSMTest::ResolveCallbackTestSetup() {
   CreateService();
   CreateTxtList();
@@ -499,4 +1280,107 @@ TEST_F(CSMTest, ResolveCallbackTest5) {
   EXPECT_EQ(0,service->resolved);
   
   service = NULL; // was freed by resolve_callback
-}
\ No newline at end of file
+}
+
+TEST_F(CSMTest, ConfirmProvisionalServiceTest) {
+  ServiceInfo a;
+  char path[] = "/tmp/csm-test-XXXXXX", *buf = NULL;
+  size_t len = 0;
+  FILE *f = NULL;
+  int fd = mkstemp(path), j;
+  time_t start;
+  
+  ASSERT_GE(fd, 0);
+  close(fd);
+  /* a permanent announcement */
+  lifetime = 0;
+  CreateTxtList();
+  CreateServiceBrowser();
+  
+  /* restore a service from a snapshot, due to be confirmed within 2
+   * seconds rather than SNAPSHOT_CONFIRM_SECS */
+  memset(&a, 0, sizeof(a));
+  strcpy(a.name, name);
+  a.type = (char*)type;
+  a.domain = (char*)domain;
+  a.host_name = (char*)host_name;
+  strcpy(a.address, "127.0.0.1");
+  a.port = port;
+  a.resolved = 1;
+  a.provisional = 1;
+  a.restored_expiry = time(NULL) + 2;
+  ASSERT_TRUE((a.txt = txt_blob_new(NULL, txt_lst, 0, 0)));
+  ASSERT_EQ(1, snapshot_serialize(&a, &buf, &len));
+  avahi_free(a.txt);
+  ASSERT_TRUE((f = fopen(path, "w")));
+  ASSERT_EQ(len, fwrite(buf, 1, len, f));
+  fclose(f);
+  free(buf);
+  ASSERT_EQ(1, snapshot_load(path));
+  unlink(path);
+  ASSERT_TRUE((service = find_service(name)));
+  EXPECT_TRUE(service->provisional);
+  EXPECT_FALSE(service->resolver);
+  EXPECT_GE(expire_remaining(&service->expire), 0);
+  
+  /* its first NEW starts a resolve, which is handed off for verification */
+  ASSERT_EQ(0, verify_pool_start(avahi_simple_poll_get(simple_poll), 1, verify_callback));
+  browse_service_callback(sb, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, AVAHI_BROWSER_NEW, name, type, domain, AVAHI_LOOKUP_RESULT_MULTICAST, server);
+  ASSERT_TRUE(service->resolver);
+  resolve_callback(
+    service->resolver,
+    AVAHI_IF_UNSPEC,
+    AVAHI_PROTO_UNSPEC,
+    AVAHI_RESOLVER_FOUND,
+    name,
+    type,
+    domain,
+    host_name,
+    addr,
+    port,
+    txt_lst,
+    AVAHI_LOOKUP_RESULT_MULTICAST,
+    service);
+  EXPECT_FALSE(service->resolver);
+  ASSERT_TRUE(service->verify_job);
+  
+  /* NEWs from other interfaces don't resolve it again while it's being verified */
+  browse_service_callback(sb, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, AVAHI_BROWSER_NEW, name, type, domain, AVAHI_LOOKUP_RESULT_MULTICAST, server);
+  EXPECT_FALSE(service->resolver);
+  browse_service_callback(sb, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, AVAHI_BROWSER_NEW, name, type, domain, AVAHI_LOOKUP_RESULT_MULTICAST, server);
+  EXPECT_FALSE(service->resolver);
+  
+  for (j = 0; j < 50 && service->provisional; j++)
+    avahi_simple_poll_iterate(simple_poll, 100);
+  EXPECT_FALSE(service->provisional);
+  EXPECT_FALSE(service->verify_job);
+  EXPECT_EQ(1, service->resolved);
+  EXPECT_EQ(service, find_service(name));
+  verify_pool_stop();
+  
+  /* once confirmed, the confirm timer is gone and the service stays */
+  EXPECT_EQ(-1, expire_remaining(&service->expire));
+  for (start = time(NULL); time(NULL) - start < 4;)
+    avahi_simple_poll_iterate(simple_poll, 100);
+  EXPECT_EQ(service, find_service(name));
+  if (find_service(name) != service)
+    service = NULL; // was freed when it expired
+}
+
+TEST_F(CSMTest, RemoveUnresolvedServicesTest) {
+  ServiceInfo *pending = NULL;
+  
+  CreateService();
+  ASSERT_TRUE(service->resolver);
+  ASSERT_TRUE((pending = add_service(AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, "pending", type, domain)));
+  ASSERT_TRUE(pending->resolver);
+  
+  /* a service already resolved (e.g. restored from the snapshot) only
+   * loses its resolver; one never resolved is dropped */
+  service->resolved = 1;
+  service->provisional = 1;
+  remove_unresolved_services();
+  EXPECT_EQ(service, find_service(name));
+  EXPECT_FALSE(service->resolver);
+  EXPECT_FALSE(find_service("pending"));
+}
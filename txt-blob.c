@@ -0,0 +1,169 @@
+/**
+ *       @file  txt-blob.c
+ *      @brief  compact storage of a service's TXT records
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <avahi-common/malloc.h>
+
+#include "txt-blob.h"
+#include "util.h"
+#include "debug.h"
+
+#define BLOB_DATA(blob) ((uint8_t*)&(blob)->index[(blob)->max_count])
+
+size_t txt_blob_size(AvahiStringList *txt, unsigned spare_count, size_t spare_len) {
+  size_t count = spare_count, len = spare_len;
+
+  for (; txt; txt = txt->next) {
+    if (txt->size > TXT_RECORD_MAX)
+      return 0;
+    count++;
+    len += txt->size;
+  }
+  /* offsets and lengths must fit in the index */
+  if (count > UINT16_MAX || len + 2 * count > UINT16_MAX)
+    return 0;
+  return TXT_BLOB_SIZE(count, len);
+}
+
+/** Append a record, which there must be room for */
+static void blob_append(TxtBlob *blob, const uint8_t *text, size_t len) {
+  uint8_t *data = BLOB_DATA(blob) + blob->len;
+  const uint8_t *eq = memchr(text, '=', len);
+  TxtIndex *entry = &blob->index[blob->count++];
+
+  entry->off = blob->len + 1;
+  entry->len = len;
+  entry->key_len = eq ? eq - text : len;
+  data[0] = len;
+  memcpy(data + 1, text, len);
+  data[len + 1] = '\0';
+  blob->len += len + 2;
+}
+
+TxtBlob *txt_blob_new(Arena *arena, AvahiStringList *txt, unsigned spare_count, size_t spare_len) {
+  TxtBlob *blob = NULL;
+  AvahiStringList *t;
+  size_t size, count = spare_count;
+
+  CHECK((size = txt_blob_size(txt, spare_count, spare_len)), "TXT records too large");
+  for (t = txt; t; t = t->next)
+    count++;
+  CHECK_MEM((blob = arena ? arena_alloc(arena, size) : avahi_malloc(size)));
+  blob->count = 0;
+  blob->max_count = count;
+  blob->len = 0;
+  blob->max_len = size - TXT_BLOB_SIZE(count, 0) + 2 * count;
+  for (t = txt; t; t = t->next)
+    blob_append(blob, t->text, t->size);
+  return blob;
+error:
+  return NULL;
+}
+
+TxtBlob *txt_blob_copy(const TxtBlob *blob) {
+  TxtBlob *copy = NULL;
+
+  CHECK_MEM((copy = avahi_malloc(sizeof(TxtBlob) + blob->count * sizeof(TxtIndex) + blob->len)));
+  copy->count = copy->max_count = blob->count;
+  copy->len = copy->max_len = blob->len;
+  memcpy(copy->index, blob->index, blob->count * sizeof(TxtIndex));
+  memcpy(BLOB_DATA(copy), BLOB_DATA(blob), blob->len);
+  return copy;
+error:
+  return NULL;
+}
+
+int txt_blob_prepend(TxtBlob *blob, const char *text, size_t len) {
+  uint8_t *data = BLOB_DATA(blob);
+  const char *eq = memchr(text, '=', len);
+  unsigned k;
+
+  if (len > TXT_RECORD_MAX || blob->count == blob->max_count || blob->len + len + 2 > blob->max_len)
+    return -1;
+  memmove(data + len + 2, data, blob->len);
+  memmove(&blob->index[1], &blob->index[0], blob->count * sizeof(TxtIndex));
+  for (k = 1; k <= blob->count; k++)
+    blob->index[k].off += len + 2;
+  blob->index[0].off = 1;
+  blob->index[0].len = len;
+  blob->index[0].key_len = eq ? eq - text : len;
+  data[0] = len;
+  memcpy(data + 1, text, len);
+  data[len + 1] = '\0';
+  blob->count++;
+  blob->len += len + 2;
+  return 0;
+}
+
+const char *txt_blob_record(const TxtBlob *blob, unsigned k, size_t *len) {
+  if (len)
+    *len = blob->index[k].len;
+  return (const char*)BLOB_DATA(blob) + blob->index[k].off;
+}
+
+const char *txt_blob_find(const TxtBlob *blob, const char *key, size_t *len) {
+  size_t key_len = strlen(key);
+  const TxtIndex *entry;
+  const char *text;
+  unsigned k;
+
+  if (!blob)
+    return NULL;
+  for (k = 0; k < blob->count; k++) {
+    entry = &blob->index[k];
+    if (entry->key_len != key_len)
+      continue;
+    text = (const char*)BLOB_DATA(blob) + entry->off;
+    if (memcmp(text, key, key_len) != 0)
+      continue;
+    if (key_len == entry->len) {
+      if (len)
+	*len = 0;
+      return text + key_len;
+    }
+    if (len)
+      *len = entry->len - key_len - 1;
+    return text + key_len + 1;
+  }
+  return NULL;
+}
+
+size_t txt_blob_format(const TxtBlob *blob, char *buf) {
+  StrBuilder sb = { buf, 0 };
+  const char *text;
+  size_t len;
+  unsigned k;
+
+  for (k = 0; blob && k < blob->count; k++) {
+    text = txt_blob_record(blob, k, &len);
+    sb_append(&sb, OPEN_DELIMITER, OPEN_DELIMITER_LEN);
+    sb_append_escaped(&sb, text, strnlen(text, len));
+    sb_append(&sb, CLOSE_DELIMITER, CLOSE_DELIMITER_LEN);
+    if (k + 1 < blob->count)
+      sb_append(&sb, FIELD_DELIMITER, FIELD_DELIMITER_LEN);
+  }
+  if (buf)
+    buf[sb.len] = '\0';
+  return sb.len;
+}
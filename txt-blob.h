@@ -0,0 +1,114 @@
+/**
+ *       @file  txt-blob.h
+ *      @brief  compact storage of a service's TXT records
+ *
+ * A TxtBlob holds all of a service's TXT records in one block: an index
+ * of fixed-size entries followed by the records, each a length byte,
+ * the record's text and a NUL, so values can be used as C strings. The
+ * index keeps each record's offset and key length, so a field is found
+ * without scanning the text. Offsets are relative to the blob, so it is
+ * copied with memcpy().
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#ifndef TXT_BLOB_H
+#define TXT_BLOB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <avahi-common/strlst.h>
+
+#include "pool.h"
+
+/** Longest TXT record, as limited by its length byte */
+#define TXT_RECORD_MAX 255
+
+typedef struct {
+  uint16_t off; /**< offset of the record's text in the blob's data */
+  uint8_t len; /**< length of the record */
+  uint8_t key_len; /**< length of the key, before the '='; len if there is no '=' */
+} TxtIndex;
+
+typedef struct {
+  uint16_t count; /**< records */
+  uint16_t max_count; /**< room in the index */
+  uint16_t len; /**< bytes of data used */
+  uint16_t max_len; /**< room for data */
+  TxtIndex index[]; /**< max_count entries, followed by max_len bytes of data */
+} TxtBlob;
+
+/**
+ * Bytes a blob takes up
+ * @param count records, and records to leave room for
+ * @param len bytes of text of those records
+ */
+#define TXT_BLOB_SIZE(count, len) (sizeof(TxtBlob) + (count) * (sizeof(TxtIndex) + 2) + (len))
+
+/**
+ * Build a blob from a string list, keeping its order
+ * @param arena arena to allocate the blob from; NULL to use avahi_malloc()
+ * @param txt records
+ * @param spare_count records to leave room for, for txt_blob_prepend()
+ * @param spare_len bytes of text to leave room for
+ * @return the blob, NULL if out of memory or txt is too large
+ */
+TxtBlob *txt_blob_new(Arena *arena, AvahiStringList *txt, unsigned spare_count, size_t spare_len);
+
+/**
+ * @return bytes txt_blob_new() needs for txt, or 0 if it is too large
+ */
+size_t txt_blob_size(AvahiStringList *txt, unsigned spare_count, size_t spare_len);
+
+/**
+ * @return a copy of blob, trimmed to its contents and allocated with
+ *         avahi_malloc(); NULL if out of memory
+ */
+TxtBlob *txt_blob_copy(const TxtBlob *blob);
+
+/**
+ * Add a record in front of the others
+ * @return 0=success, -1=no room left in the blob
+ */
+int txt_blob_prepend(TxtBlob *blob, const char *text, size_t len);
+
+/**
+ * @param k record, from 0 to blob->count - 1
+ * @param[out] len length of the record, if not NULL
+ * @return the record's NUL-terminated text
+ */
+const char *txt_blob_record(const TxtBlob *blob, unsigned k, size_t *len);
+
+/**
+ * Look up the first record with a key
+ * @param[out] len length of the value, if not NULL
+ * @return the NUL-terminated value ("" for a record without '='), or
+ *         NULL if there is no such record
+ */
+const char *txt_blob_find(const TxtBlob *blob, const char *key, size_t *len);
+
+/**
+ * Format the records as txt_list_to_string() does
+ * @param buf buffer of at least the returned length + 1 bytes, or NULL
+ *        to only measure
+ * @return length of the string, not counting the terminating NUL
+ */
+size_t txt_blob_format(const TxtBlob *blob, char *buf);
+
+#endif
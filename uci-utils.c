@@ -25,12 +25,20 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
 #ifdef USESYSLOG
 #include <syslog.h>
 #endif
 
 #include <uci.h>
 
+#include <avahi-common/llist.h>
+#include <avahi-common/malloc.h>
+#include <avahi-common/timeval.h>
+
 #include "uci-utils.h"
 #include "debug.h"
 #include "util.h"
@@ -39,6 +47,89 @@
 #define UCI_CHECK(A, M, ...) if(!(A)) { char *err = NULL; uci_get_errorstr(c,&err,NULL); ERROR(M ": %s", ##__VA_ARGS__, err); free(err); errno=0; goto error; }
 #define UCI_WARN(M, ...) char *err = NULL; uci_get_errorstr(c,&err,NULL); WARN(M ": %s", ##__VA_ARGS__, err); free(err);
 
+enum {
+  UCI_OP_WRITE,
+  UCI_OP_REMOVE,
+};
+
+typedef struct UciOp UciOp;
+/** A change waiting to be written to UCI */
+struct UciOp {
+  int op;
+  char *uuid;
+  size_t uuid_len;
+  TxtBlob *txt; /**< copy of the service's txt fields, for writes */
+  AVAHI_LLIST_FIELDS(UciOp, queue);
+};
+
+static UciOp *uci_queue = NULL;
+static int uci_queue_len = 0;
+static const AvahiPoll *uci_poll = NULL;
+static AvahiTimeout *uci_flush_timeout = NULL;
+static unsigned long uci_ops_queued = 0;
+static unsigned long uci_ops_coalesced = 0;
+static unsigned long uci_commits = 0;
+static unsigned long uci_options_written = 0;
+static unsigned long uci_options_skipped = 0;
+
+/** Open-addressed set of the uuids of applications local to this node */
+static char **local_apps = NULL;
+static size_t local_apps_size = 0;
+static int local_apps_loaded = 0;
+
+/** Settings from the applications.settings section */
+static struct {
+  int loaded;
+  long default_lifetime; /**< 0 if applications may be permanent */
+} settings = {0};
+
+static const AvahiPoll *config_poll = NULL;
+static AvahiWatch *config_watch = NULL;
+static int config_watch_fd = -1;
+/** The applications config as last loaded or committed by us, so the
+ * watch can ignore the events our own commits cause */
+static struct stat config_seen;
+static int config_seen_valid = 0;
+static unsigned long config_reloads_skipped = 0;
+
+/** Directory UCI configs are read from and written to */
+static const char *uci_confdir(void) {
+  return getenv("UCI_INSTANCE_PATH") ? : UCIPATH;
+}
+
+/**
+ * Stat the applications config
+ * @param[out] st stat of the file
+ * @return 0=success, -1=fail
+ */
+static int config_stat(struct stat *st) {
+  char path[PATH_MAX];
+  
+  if (snprintf(path, sizeof(path), "%s/applications", uci_confdir()) >= (int)sizeof(path))
+    return -1;
+  return stat(path, st);
+}
+
+/**
+ * @return 1 if the applications config is the same file we last saw, 0 otherwise
+ */
+static int config_unchanged(void) {
+  struct stat st;
+  
+  return config_seen_valid
+	 && config_stat(&st) == 0
+	 && st.st_dev == config_seen.st_dev
+	 && st.st_ino == config_seen.st_ino
+	 && st.st_size == config_seen.st_size
+	 && st.st_mtim.tv_sec == config_seen.st_mtim.tv_sec
+	 && st.st_mtim.tv_nsec == config_seen.st_mtim.tv_nsec;
+}
+
+/** Remember the applications config as it is now */
+static void config_mark_seen(void) {
+  config_seen_valid = (config_stat(&config_seen) == 0);
+}
+
 /**
  * Derives the UCI-encoded name of a service, as a concatenation of URI and port
  * @param i ServiceInfo object of the service
@@ -47,21 +138,19 @@
  */
 char *get_uuid(ServiceInfo *i, size_t *uuid_len) {
   char *uuid = NULL;
-  char *uri = NULL;
+  const char *uri = NULL;
   char *uri_escaped = NULL;
   char port[6] = "";
   size_t uri_escaped_len, uri_len = 0;
-  AvahiStringList *uri_txt = NULL;
   
   assert(i);
   
-  CHECK((uri_txt = avahi_string_list_find(i->txt_lst,"uri")),"Failed to find uri txt record");
-  avahi_string_list_get_pair(uri_txt,NULL,&uri,&uri_len);
-  CHECK(uri && uri_len,"Failed to fetch uri txt record");
+  CHECK((uri = txt_blob_find(i->txt,"uri",&uri_len)),"Failed to find uri txt record");
+  CHECK(uri_len,"Failed to fetch uri txt record");
   CHECK((uri_escaped = uci_escape(uri,uri_len,&uri_escaped_len)),"Failed to escape URI");
   if (i->port > 0)
     sprintf(port,"%d",i->port);
-  CHECK_MEM((uuid = (char*)calloc(uri_escaped_len + strlen(port),sizeof(char))));
+  CHECK_MEM((uuid = (char*)calloc(uri_escaped_len + strlen(port) + 1,sizeof(char))));
   strncpy(uuid,uri_escaped,uri_escaped_len);
   strcat(uuid,port);
   *uuid_len = uri_escaped_len + strlen(port);
@@ -120,246 +209,746 @@ error:
 }
 
 /**
- * Write a service to UCI
- * @param i ServiceInfo object of the service
+ * Find an option of a UCI section by name, without a string lookup
+ * @param s section to search
+ * @param name option name
+ * @return the option, or NULL if the section doesn't have it
+ */
+static struct uci_option *uci_find_option(struct uci_section *s, const char *name) {
+  struct uci_element *e = NULL;
+  
+  uci_foreach_element(&s->options, e) {
+    if (!strcmp(e->name, name))
+      return uci_to_option(e);
+  }
+  return NULL;
+}
+
+/**
+ * Look up an option of an application, for changing it. uci_lookup_ptr()
+ * leaves the name fields pointing into the lookup string, which
+ * get_uci_section() frees, so point them at the caller's strings instead.
+ * @return -1 = fail, > 0 success/ptr flags
+ */
+static int get_app_option(struct uci_context *c,
+			  struct uci_ptr *ptr,
+			  const char *uuid,
+			  size_t uuid_len,
+			  const char *option) {
+  int ret = get_uci_section(c,ptr,"applications",12,uuid,uuid_len,option,option ? strlen(option) : 0);
+  ptr->package = "applications";
+  ptr->section = uuid;
+  ptr->option = option;
+  return ret;
+}
+
+/**
+ * Set an option of an application, unless it already has that value
+ * @param c uci_context
+ * @param s the application's section
+ * @param uuid name of the application's section
+ * @param uuid_len length of uuid
+ * @param option option name
+ * @param value new value
  * @return 0=success, -1=fail
  */
-int uci_write(ServiceInfo *i) {
-  struct uci_context *c = NULL;
-  struct uci_ptr sec_ptr,sig_ptr,type_ptr,approved_ptr;
-  int uci_ret, ret = -1;
-  char *sig = NULL, *uuid = NULL;
-  struct uci_package *pak = NULL;
-  struct uci_section *sec = NULL;
+static int uci_set_changed(struct uci_context *c,
+			   struct uci_section *s,
+			   const char *uuid,
+			   size_t uuid_len,
+			   const char *option,
+			   const char *value) {
+  struct uci_ptr ptr;
+  struct uci_option *o = uci_find_option(s, option);
+  
+  if (o && o->type == UCI_TYPE_STRING && !strcmp(o->v.string, value)) {
+    uci_options_skipped++;
+    return 0;
+  }
+  CHECK(get_app_option(c,&ptr,uuid,uuid_len,option) > 0,"Failed %s lookup",option);
+  ptr.value = value;
+  UCI_CHECK(uci_set(c, &ptr) == UCI_OK,"(UCI) Failed to set");
+  INFO("(UCI) Set succeeded: %s=%s",option,value);
+  uci_options_written++;
+  return 0;
+error:
+  return -1;
+}
+
+/**
+ * Delete an option of an application, if it has it
+ * @return 0=success, -1=fail
+ */
+static int uci_delete_option(struct uci_context *c,
+			     struct uci_section *s,
+			     const char *uuid,
+			     size_t uuid_len,
+			     const char *option) {
+  struct uci_ptr ptr;
+  
+  if (!uci_find_option(s, option))
+    return 0;
+  CHECK(get_app_option(c,&ptr,uuid,uuid_len,option) > 0,"Failed %s lookup",option);
+  UCI_CHECK(uci_delete(c, &ptr) == UCI_OK,"(UCI) Failed to delete %s",option);
+  INFO("(UCI) Delete succeeded: %s",option);
+  uci_options_written++;
+  return 0;
+error:
+  return -1;
+}
+
+/**
+ * Check if a UCI list option holds a value
+ */
+static int uci_list_has(struct uci_option *o, const char *value, size_t value_len) {
   struct uci_element *e = NULL;
-  AvahiStringList *txt = NULL;
-  size_t sig_len = 0, uuid_len = 0;
-  enum {
-    NO_TYPE_SECTION,
-    NO_TYPE_MATCHES,
-    TYPE_MATCH_FOUND,
-  };
-  int type_state = NO_TYPE_SECTION;
   
-  c = uci_alloc_context();
-  uci_set_confdir(c, getenv("UCI_INSTANCE_PATH") ? : UCIPATH);
-  assert(c);
-  assert(i);
+  if (!o || o->type != UCI_TYPE_LIST)
+    return 0;
+  uci_foreach_element(&o->v.list, e) {
+    if (strlen(e->name) == value_len && !strncmp(e->name, value, value_len))
+      return 1;
+  }
+  return 0;
+}
 
-  avahi_string_list_get_pair(avahi_string_list_find(i->txt_lst,"signature"),NULL,&sig,&sig_len);
+/**
+ * Bring an application's type list in line with the announced types
+ * @return 0=success, -1=fail
+ */
+static int uci_sync_types(struct uci_context *c,
+			  struct uci_section *s,
+			  const char *uuid,
+			  size_t uuid_len,
+			  TxtFields *fields) {
+  struct uci_ptr ptr;
+  struct uci_option *o = uci_find_option(s, "type");
+  struct uci_element *e = NULL;
+  int j, k, stale = 0;
+  
+  /* Types that are stored but no longer announced */
+  if (o && o->type == UCI_TYPE_LIST) {
+    uci_foreach_element(&o->v.list, e) {
+      for (k = 0; k < fields->types_len; k++) {
+	if (strlen(e->name) == fields->types[k].len && !strncmp(e->name, fields->types[k].str, fields->types[k].len))
+	  break;
+      }
+      if (k == fields->types_len) {
+	stale = 1;
+	break;
+      }
+    }
+  } else if (o) {
+    stale = 1;
+  }
   
-  CHECK((uuid = get_uuid(i,&uuid_len)),"Failed to get UUID");
+  /* The version of UCI packaged with LuCI doesn't have uci_del_list, so
+   * stale types mean rewriting the whole list */
+  if (stale) {
+    CHECK(uci_delete_option(c,s,uuid,uuid_len,"type") == 0,"Failed to delete type list");
+    o = NULL;
+  }
+  
+  for (j = 0; j < fields->types_len; j++) {
+    /* type views are the tail of their txt entry, so they're NUL-terminated */
+    const char *type = fields->types[j].str;
+    size_t type_len = fields->types[j].len;
+    
+    if (uci_list_has(o, type, type_len)) {
+      uci_options_skipped++;
+      continue;
+    }
+    for (k = 0; k < j; k++) {
+      if (fields->types[k].len == type_len && !strncmp(fields->types[k].str, type, type_len))
+	break;
+    }
+    if (k < j)
+      continue;
+    CHECK(get_app_option(c,&ptr,uuid,uuid_len,"type") > 0,"Failed type lookup");
+    ptr.value = type;
+    UCI_CHECK(uci_add_list(c, &ptr) == UCI_OK,"(UCI) Failed to add type");
+    INFO("(UCI) Add list succeeded: type=%s",type);
+    uci_options_written++;
+  }
+  return 0;
+error:
+  return -1;
+}
 
-  CHECK(sig_len == SIG_LENGTH &&
-      isHex(sig,sig_len),
+/** Announcement fields stored as options, removed when no longer announced */
+static const char *txt_options[] = {
+  "name", "uri", "icon", "description", "ttl", "lifetime", "fingerprint", "signature", "expiration", NULL
+};
+
+/**
+ * Apply a queued write to a UCI context, without saving. Only options and
+ * list entries that differ from what is already stored are changed.
+ * @param c uci_context shared by the batch
+ * @param op queued write
+ * @param[out] pak set to the applications package if it was changed
+ * @return 0=success, -1=fail
+ */
+static int uci_apply_write(struct uci_context *c, UciOp *op, struct uci_package **pak) {
+  struct uci_ptr sec_ptr, approved_ptr;
+  struct uci_section *sec = NULL;
+  struct uci_option *sig_opt = NULL;
+  int ret = -1;
+  char key[TXT_RECORD_MAX + 1], *uuid = op->uuid;
+  const char *record = NULL;
+  TxtFields fields;
+  size_t uuid_len = op->uuid_len, len, key_len;
+  unsigned k;
+  unsigned long written = uci_options_written;
+  const char **known = NULL;
+  
+  assert(c);
+  assert(op);
+
+  CHECK(parse_txt_fields(op->txt, &fields) == 0, "(UCI) Invalid txt fields");
+  CHECK(fields.signature.len == SIG_LENGTH &&
+      isHex(fields.signature.str,fields.signature.len),
       "(UCI) Invalid signature txt field");
   
   /* Lookup application by name (concatenation of URI + port) */
   CHECK(get_uci_section(c,&sec_ptr,"applications",12,uuid,uuid_len,NULL,0) > 0, "Failed application lookup");
   if (sec_ptr.flags & UCI_LOOKUP_COMPLETE) {
     INFO("(UCI) Found application: %s",uuid);
-    // check for service == fingerprint. if sig different, update it
-    CHECK(get_uci_section(c,&sig_ptr,"applications",12,uuid,uuid_len,"signature",9) > 0,"Failed signature lookup");
-    if (sig_ptr.flags & UCI_LOOKUP_COMPLETE && sig && !strcmp(sig,sig_ptr.o->v.string)) {
-      // signatures equal: do nothing
+    sec = sec_ptr.s;
+    // check for service == fingerprint. if sig same, nothing can have changed
+    sig_opt = uci_find_option(sec, "signature");
+    if (sig_opt && sig_opt->type == UCI_TYPE_STRING &&
+	strlen(sig_opt->v.string) == fields.signature.len &&
+	!strncmp(sig_opt->v.string, fields.signature.str, fields.signature.len)) {
       INFO("(UCI) Signature the same, not updating");
+      uci_options_skipped += op->txt->count;
       ret = 0;
       goto error;
     }
-    // signatures differ: delete existing app
     INFO("(UCI) Signature differs, updating");
   } else {
     INFO("(UCI) Application not found, creating");
+    memset(&sec_ptr, 0, sizeof(struct uci_ptr));
+    sec_ptr.package = "applications";
+    sec_ptr.section = uuid;
+    sec_ptr.value = "application";
+    UCI_CHECK(!uci_set(c, &sec_ptr),"(UCI) Failed to set section");
+    INFO("(UCI) Section set succeeded");
+    uci_options_written++;
+    CHECK(get_uci_section(c,&sec_ptr,"applications",12,uuid,uuid_len,NULL,0) > 0 &&
+	  sec_ptr.flags & UCI_LOOKUP_COMPLETE, "Failed application lookup");
+    sec = sec_ptr.s;
   }
   
-  pak = sec_ptr.p;
-  memset(&sec_ptr, 0, sizeof(struct uci_ptr));
-  
-  // uci_add_section
-  sec_ptr.package = "applications";
-  sec_ptr.section = uuid;
-  sec_ptr.value = "application";
-  UCI_CHECK(!uci_set(c, &sec_ptr),"(UCI) Failed to set section");
-  INFO("(UCI) Section set succeeded");
-  
-  /* set type_opstr to lookup the 'type' fields */
-  CHECK(get_uci_section(c,&type_ptr,"applications",12,uuid,uuid_len,"type",4) > 0,"Failed type lookup");
+  // set changed options
+  for (k = 0; k < op->txt->count; k++) {
+    record = txt_blob_record(op->txt, k, &len);
+    key_len = op->txt->index[k].key_len;
+    memcpy(key, record, key_len);
+    key[key_len] = '\0';
+    if (strcmp(key,"type") != 0)
+      CHECK(uci_set_changed(c,sec,uuid,uuid_len,key,key_len < len ? record + key_len + 1 : "") == 0,"Failed to set %s",key);
+  }
+  CHECK(uci_sync_types(c,sec,uuid,uuid_len,&fields) == 0,"Failed to update types");
   
-  // uci set options/values
-  txt = i->txt_lst;
-  do {
-    if (avahi_string_list_get_pair(txt,(char **)&(sec_ptr.option),(char **)&(sec_ptr.value),NULL))
-      continue;
-    if (!strcmp(sec_ptr.option,"type")) {
-      // NOTE: the version of UCI packaged with LuCI doesn't have uci_del_list, so here's a stupid workaround
-      //uci_ret = uci_del_list(c, &sec_ptr);
-      type_state = NO_TYPE_MATCHES;
-      if (type_ptr.o && type_ptr.o->type == UCI_TYPE_LIST) {
-	uci_foreach_element(&(type_ptr.o->v.list), e) {
-	  if (!strcmp(e->name, sec_ptr.value)) {
-	    type_state = TYPE_MATCH_FOUND;
-	    break;
-	  }
-	}
-      }
-      if (type_state != TYPE_MATCH_FOUND)
-	uci_ret = uci_add_list(c, &sec_ptr);
-    } else {
-      uci_ret = uci_set(c, &sec_ptr);
-    }
-    UCI_CHECK(!uci_ret,"(UCI) Failed to set");
-    INFO("(UCI) Set succeeded: %s=%s",sec_ptr.option,sec_ptr.value);
-  } while (txt = avahi_string_list_get_next(txt));
+  // drop fields that are no longer announced
+  for (known = txt_options; *known; known++) {
+    if (!txt_blob_find(op->txt, *known, NULL))
+      CHECK(uci_delete_option(c,sec,uuid,uuid_len,*known) == 0,"Failed to delete %s",*known);
+  }
   
   // set uuid and approved fields
-  sec_ptr.option = "uuid";
-  sec_ptr.value = uuid;
-  uci_ret = uci_set(c, &sec_ptr);
-  UCI_CHECK(!uci_ret,"(UCI) Failed to set");
-  INFO("(UCI) Set succeeded: %s=%s",sec_ptr.option,sec_ptr.value);
+  CHECK(uci_set_changed(c,sec,uuid,uuid_len,"uuid",uuid) == 0,"Failed to set uuid");
 
 #ifdef OPENWRT
   // For OpenWRT: check known_applications list, approved or blacklisted
   if (get_uci_section(c,&approved_ptr,"applications",12,"known_apps",10,uuid,uuid_len) == -1) {
     WARN("(UCI) Failed known_apps lookup");
   } else if (approved_ptr.flags & UCI_LOOKUP_COMPLETE) {
-    sec_ptr.option = "approved";
     if (!strcmp(approved_ptr.o->v.string,"approved")) {
-      sec_ptr.value = "1";
+      CHECK(uci_set_changed(c,sec,uuid,uuid_len,"approved","1") == 0,"Failed to set approved");
     } else if (!strcmp(approved_ptr.o->v.string,"blacklisted")) {
-      sec_ptr.value = "0";
+      CHECK(uci_set_changed(c,sec,uuid,uuid_len,"approved","0") == 0,"Failed to set approved");
     }
-    uci_ret = uci_set(c, &sec_ptr);
-    UCI_CHECK(!uci_ret,"(UCI) Failed to set");
-    INFO("(UCI) Set succeeded: %s=%s",sec_ptr.option,sec_ptr.value);
   }
 #else
-  sec_ptr.option = "approved";
-  sec_ptr.value = "1";
-  uci_ret = uci_set(c, &sec_ptr);
-  UCI_CHECK(!uci_ret,"(UCI) Failed to set");
-  INFO("(UCI) Set succeeded: %s=%s",sec_ptr.option,sec_ptr.value);
+  CHECK(uci_set_changed(c,sec,uuid,uuid_len,"approved","1") == 0,"Failed to set approved");
 #endif
   
-  // if no type fields in new announcement, remove section from UCI (part of stupid workaround)
-  if (type_state == NO_TYPE_SECTION) {
-    if (type_ptr.o && type_ptr.o->type == UCI_TYPE_LIST) {
-      UCI_CHECK(uci_delete(c, &type_ptr) == UCI_OK,"(UCI) Failed to delete type section");
-    }
-  }
-  
-  // uci_save
-  UCI_CHECK(uci_save(c, pak) == UCI_OK,"(UCI) Failed to save");
-  INFO("(UCI) Save succeeded");
-  
-  UCI_CHECK(uci_commit(c,&pak,false) == UCI_OK,"(UCI) Failed to commit");
-  INFO("(UCI) Commit succeeded");
-
+  DEBUG("(UCI) %lu options changed for %s", uci_options_written - written, uuid);
+  if (uci_options_written != written)
+    *pak = sec_ptr.p;
   ret = 0;
   
 error:
-  if (c) uci_free_context(c);
-  if (uuid) free(uuid);
   return ret;
 }
 
 /**
- * Remove a service from UCI
- * @param i ServiceInfo object of the service
+ * Apply a queued removal to a UCI context, without saving
+ * @param c uci_context shared by the batch
+ * @param op queued removal
+ * @param[out] pak set to the applications package if it was changed
  * @return 0=success, -1=fail
  */
-int uci_remove(ServiceInfo *i) {
+static int uci_apply_remove(struct uci_context *c, UciOp *op, struct uci_package **pak) {
   int ret = -1;
-  struct uci_context *c = NULL;
   struct uci_ptr sec_ptr;
+  
+  assert(c);
+  assert(op);
+  
+  /* Lookup application by name (concatination of URI + port) */
+  CHECK(get_app_option(c,&sec_ptr,op->uuid,op->uuid_len,NULL) > 0, "(UCI_Remove) Failed application lookup");
+  
+  CHECK(sec_ptr.flags & UCI_LOOKUP_COMPLETE,"(UCI_Remove) Application not found: %s",op->uuid);
+  INFO("(UCI_Remove) Found application: %s",op->uuid);
+  
+  UCI_CHECK(uci_delete(c, &sec_ptr) == UCI_OK,"(UCI_Remove) Failed to delete application");
+  INFO("(UCI_Remove) Successfully deleted application");
+  
+  *pak = sec_ptr.p;
+  ret = 0;
+  
+error:
+  return ret;
+}
+
+static void uci_op_free(UciOp *op) {
+  avahi_free(op->txt);
+  free(op->uuid);
+  avahi_free(op);
+}
+
+/**
+ * Write all queued changes to UCI, with a single save and commit
+ * @return 0=success, -1=one or more changes failed
+ */
+int uci_flush(void) {
+  struct uci_context *c = NULL;
   struct uci_package *pak = NULL;
-  char *uuid = NULL;
-  size_t uuid_len = 0;
+  UciOp *op = NULL;
+  int failed = 0, ret = -1;
+  
+  if (uci_flush_timeout)
+    uci_poll->timeout_update(uci_flush_timeout, NULL);
+  if (!uci_queue)
+    return 0;
   
   c = uci_alloc_context();
-  uci_set_confdir(c, getenv("UCI_INSTANCE_PATH") ? : UCIPATH);
   assert(c);
+  uci_set_confdir(c, uci_confdir());
+  
+  DEBUG("(UCI) Flushing %d queued changes", uci_queue_len);
+  while ((op = uci_queue)) {
+    AVAHI_LLIST_REMOVE(UciOp, queue, uci_queue, op);
+    if ((op->op == UCI_OP_WRITE ? uci_apply_write(c, op, &pak) : uci_apply_remove(c, op, &pak)) < 0) {
+      ERROR("(UCI) Could not %s %s", op->op == UCI_OP_WRITE ? "write" : "remove", op->uuid);
+      failed = 1;
+    }
+    uci_op_free(op);
+  }
+  uci_queue_len = 0;
+  
+  if (pak) {
+    /* only skip the reload our commit causes if nobody else has changed
+     * the file since we last read it; uci_commit() merges their changes in */
+    int seen = config_unchanged();
+    
+    UCI_CHECK(uci_save(c, pak) == UCI_OK,"(UCI) Failed to save");
+    INFO("(UCI) Save succeeded");
+    
+    UCI_CHECK(uci_commit(c,&pak,false) == UCI_OK,"(UCI) Failed to commit");
+    INFO("(UCI) Commit succeeded");
+    uci_commits++;
+    if (seen)
+      config_mark_seen();
+    else
+      config_seen_valid = 0;
+  }
+  ret = failed ? -1 : 0;
+  
+error:
+  uci_free_context(c);
+  return ret;
+}
+
+static void uci_flush_callback(AvahiTimeout *t, void *userdata) {
+  uci_flush();
+}
+
+/**
+ * Queue a change, replacing any change already queued for the same service
+ * @param type UCI_OP_WRITE or UCI_OP_REMOVE
+ * @param i ServiceInfo object of the service
+ * @return 0=success, -1=fail
+ */
+static int uci_enqueue(int type, ServiceInfo *i) {
+  UciOp *op = NULL;
+  char *uuid = NULL;
+  size_t uuid_len = 0;
+  TxtBlob *txt = NULL;
+  struct timeval tv;
+  
   assert(i);
   
   CHECK((uuid = get_uuid(i,&uuid_len)),"Failed to get UUID");
+  if (type == UCI_OP_WRITE)
+    CHECK_MEM((txt = txt_blob_copy(i->txt)));
   
-  /* Lookup application by name (concatination of URI + port) */
-  CHECK(get_uci_section(c,&sec_ptr,"applications",12,uuid,uuid_len,NULL,0) > 0, "(UCI_Remove) Failed application lookup");
+  for (op = uci_queue; op; op = op->queue_next) {
+    if (op->uuid_len == uuid_len && memcmp(op->uuid, uuid, uuid_len) == 0)
+      break;
+  }
+  if (op) {
+    /* Only the latest change for a service matters */
+    DEBUG("(UCI) Coalescing queued change for %s", uuid);
+    free(uuid);
+    avahi_free(op->txt);
+    uci_ops_coalesced++;
+  } else {
+    CHECK_MEM((op = avahi_new0(UciOp, 1)));
+    op->uuid = uuid;
+    op->uuid_len = uuid_len;
+    AVAHI_LLIST_PREPEND(UciOp, queue, uci_queue, op);
+    uci_queue_len++;
+  }
+  op->op = type;
+  op->txt = txt;
+  uci_ops_queued++;
+  
+  /* Without a main loop to flush on, write through */
+  if (!uci_flush_timeout || uci_queue_len >= UCI_QUEUE_MAX)
+    return uci_flush();
+  if (uci_queue_len == 1) {
+    avahi_elapse_time(&tv, UCI_FLUSH_DELAY, 0);
+    uci_poll->timeout_update(uci_flush_timeout, &tv);
+  }
+  return 0;
   
-  CHECK(sec_ptr.flags & UCI_LOOKUP_COMPLETE,"(UCI_Remove) Application not found: %s",uuid);
-  INFO("(UCI_Remove) Found application: %s",uuid);
+error:
+  if (uuid) free(uuid);
+  avahi_free(txt);
+  return -1;
+}
+
+/**
+ * Write a service to UCI. The write is queued, and coalesced with other
+ * changes queued for the same service.
+ * @param i ServiceInfo object of the service
+ * @return 0=success, -1=fail
+ */
+int uci_write(ServiceInfo *i) {
+  return uci_enqueue(UCI_OP_WRITE, i);
+}
+
+/**
+ * Remove a service from UCI. The removal is queued, and coalesced with
+ * other changes queued for the same service.
+ * @param i ServiceInfo object of the service
+ * @return 0=success, -1=fail
+ */
+int uci_remove(ServiceInfo *i) {
+  return uci_enqueue(UCI_OP_REMOVE, i);
+}
+
+/**
+ * Start batching UCI changes on a main loop
+ * @param poll_api poll object to run the flush timer on
+ * @return 0=success, -1=fail
+ */
+int uci_queue_start(const AvahiPoll *poll_api) {
+  assert(poll_api);
+  uci_poll = poll_api;
+  CHECK((uci_flush_timeout = poll_api->timeout_new(poll_api, NULL, uci_flush_callback, NULL)),
+	"Failed to create UCI flush timer");
+  return 0;
+error:
+  uci_poll = NULL;
+  return -1;
+}
+
+/**
+ * Flush any queued UCI changes and stop batching
+ */
+void uci_queue_stop(void) {
+  uci_flush();
+  if (uci_flush_timeout)
+    uci_poll->timeout_free(uci_flush_timeout);
+  uci_flush_timeout = NULL;
+  uci_poll = NULL;
+}
+
+/**
+ * Print UCI write counters
+ * @param f file to print to
+ */
+void uci_print_stats(FILE *f) {
+  fprintf(f, "uci_ops_queued=%lu\n", uci_ops_queued);
+  fprintf(f, "uci_ops_coalesced=%lu\n", uci_ops_coalesced);
+  fprintf(f, "uci_commits=%lu\n", uci_commits);
+  fprintf(f, "uci_options_written=%lu\n", uci_options_written);
+  fprintf(f, "uci_options_skipped=%lu\n", uci_options_skipped);
+  fprintf(f, "uci_config_reloads_skipped=%lu\n", config_reloads_skipped);
+}
+
+/**
+ * UCI-encoded name of a service, computed on first use and cached in
+ * the ServiceInfo object
+ * @param i ServiceInfo object of the service
+ * @param[out] uuid_len Length of the UCI-encoded name
+ * @return UCI-encoded name, owned by i, or NULL on failure
+ */
+const char *service_uuid(ServiceInfo *i, size_t *uuid_len) {
+  char *uuid = NULL;
   
-  UCI_CHECK(uci_delete(c, &sec_ptr) == UCI_OK,"(UCI_Remove) Failed to delete application");
-  INFO("(UCI_Remove) Successfully deleted application");
+  assert(i);
+  if (!i->uuid && (uuid = get_uuid(i,&i->uuid_len))) {
+    i->uuid = arena_strndup(&i->arena, uuid, i->uuid_len);
+    free(uuid);
+  }
+  *uuid_len = i->uuid_len;
+  return i->uuid;
+}
+
+static uint32_t uuid_hash(const char *uuid) {
+  uint32_t hash = 2166136261u;
+  for (; *uuid; uuid++) {
+    hash ^= (unsigned char)*uuid;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void local_apps_free(void) {
+  size_t k;
+  for (k = 0; k < local_apps_size; k++)
+    free(local_apps[k]);
+  free(local_apps);
+  local_apps = NULL;
+  local_apps_size = 0;
+  local_apps_loaded = 0;
+}
+
+static int local_apps_has(const char *uuid) {
+  size_t k, mask = local_apps_size - 1;
+  
+  if (!local_apps_size)
+    return 0;
+  for (k = uuid_hash(uuid) & mask; local_apps[k]; k = (k + 1) & mask) {
+    if (!strcmp(local_apps[k], uuid))
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Rebuild the set of local applications (those with localapp=1) from
+ * the applications config
+ * @return 0=success, -1=fail
+ */
+static int local_apps_load(void) {
+  struct uci_context *c = NULL;
+  struct uci_package *pak = NULL;
+  struct uci_element *e = NULL;
+  struct uci_option *o = NULL;
+  char **apps = NULL;
+  size_t count = 0, size = LOCAL_APPS_MIN_SIZE, k;
+  int ret = -1;
   
-  pak = sec_ptr.p;
+  c = uci_alloc_context();
+  assert(c);
+  uci_set_confdir(c, uci_confdir());
   
-  // uci_save
-  UCI_CHECK(uci_save(c, pak) == UCI_OK,"(UCI_Remove) Failed to save");
-  INFO("(UCI_Remove) Save succeeded");
+  UCI_CHECK(uci_load(c, "applications", &pak) == UCI_OK, "(UCI) Failed to load applications");
+  uci_foreach_element(&pak->sections, e) {
+    o = uci_find_option(uci_to_section(e), "localapp");
+    if (o && o->type == UCI_TYPE_STRING && !strcmp(o->v.string, "1"))
+      count++;
+  }
   
-  UCI_CHECK(uci_commit(c,&pak,false) == UCI_OK,"(UCI_Remove) Failed to commit");
-  INFO("(UCI_Remove) Commit succeeded");
+  /* keep the load factor at or below 1/2 */
+  while (size < 2 * count)
+    size *= 2;
+  CHECK_MEM((apps = calloc(size, sizeof(char*))));
+  uci_foreach_element(&pak->sections, e) {
+    o = uci_find_option(uci_to_section(e), "localapp");
+    if (!o || o->type != UCI_TYPE_STRING || strcmp(o->v.string, "1") != 0)
+      continue;
+    for (k = uuid_hash(e->name) & (size - 1); apps[k]; k = (k + 1) & (size - 1));
+    CHECK_MEM((apps[k] = strdup(e->name)));
+  }
   
+  local_apps_free();
+  local_apps = apps;
+  local_apps_size = size;
+  apps = NULL;
+  INFO("(UCI) Loaded %zu local applications", count);
   ret = 0;
   
 error:
-  if (c) uci_free_context(c);
-  if (uuid) free(uuid);
+  if (apps) {
+    for (k = 0; k < size; k++)
+      free(apps[k]);
+    free(apps);
+  }
+  /* don't retry a missing config on every lookup */
+  local_apps_loaded = 1;
+  uci_free_context(c);
   return ret;
 }
 
-/** Determine if a service is local to this node
+/** Determine if a service is local to this node, from the in-memory
+ * set of local applications
  * @param i ServiceInfo object of the service
  * @return 1=it's local, 0=it's not local, -1=error
  */
 int is_local(ServiceInfo *i) {
-  struct uci_ptr local_ptr;
-  char *uuid = NULL;
+  const char *uuid = NULL;
   size_t uuid_len = 0;
+  
+  CHECK((uuid = service_uuid(i,&uuid_len)),"Failed to get UUID");
+  if (!local_apps_loaded)
+    local_apps_load();
+  
+  if (local_apps_has(uuid)) {
+    INFO("Application is local");
+    return 1;
+  }
+  INFO("Application NOT local");
+  return 0;
+  
+error:
+  return -1;
+}
+
+/**
+ * Load the applications.settings section into memory
+ * @return 0=success, -1=fail
+ */
+static int settings_load(void) {
+  struct uci_context *c = NULL;
+  struct uci_package *pak = NULL;
+  struct uci_section *sec = NULL;
+  struct uci_option *allow = NULL, *exp = NULL;
+  struct uci_element *e = NULL;
+  long lifetime = 0;
   int ret = -1;
   
-  struct uci_context *c = uci_alloc_context();
+  c = uci_alloc_context();
+  assert(c);
+  uci_set_confdir(c, uci_confdir());
   
-  CHECK((uuid = get_uuid(i,&uuid_len)),"Failed to get UUID");
+  /* don't retry a missing config on every lookup */
+  settings.loaded = 1;
   
-  /* Make sure application isn't local to this node */
-  CHECK(get_uci_section(c,&local_ptr,"applications",12,uuid,uuid_len,"localapp",8) > 0, "Failed application lookup");
-  if (!(local_ptr.flags & UCI_LOOKUP_COMPLETE) || strcmp(local_ptr.o->v.string,"1") != 0) {
-    INFO("Application NOT local");
-    ret = 0;
-  } else {
-    INFO("Application is local");
-    ret = 1;
-  } 
+  UCI_CHECK(uci_load(c, "applications", &pak) == UCI_OK, "(UCI) Failed to load applications");
+  uci_foreach_element(&pak->sections, e) {
+    if (!strcmp(e->name, "settings")) {
+      sec = uci_to_section(e);
+      break;
+    }
+  }
+  CHECK(sec && (allow = uci_find_option(sec, "allowpermanent")) && allow->type == UCI_TYPE_STRING,
+	"Failed settings lookup");
+  
+  if (strcmp(allow->v.string,"0") == 0) {  // force applications to expire
+    CHECK((exp = uci_find_option(sec, "lifetime")) && exp->type == UCI_TYPE_STRING, "Failed settings lookup");
+    CHECK(isNumeric(exp->v.string) && atol(exp->v.string) >= 0,"Invalid default lifetime");
+    lifetime = atol(exp->v.string);
+  }
+  ret = 0;
   
 error:
-  if (c) uci_free_context(c);
-  if (uuid) free(uuid);
+  settings.default_lifetime = lifetime;
+  uci_free_context(c);
   return ret;
 }
 
-/** Fetch default lifetime from UCI
+/** Fetch default lifetime from UCI. The settings are read once and
+ * cached until uci_config_reload().
  * @return if applications.settings.allowpermanent==0, returns default lifetime
  */
 long default_lifetime(void) {
-  long lifetime = 0;
-#ifdef USE_UCI
-  struct uci_ptr allow, exp;
-  struct uci_context *c = uci_alloc_context();
-  
-  CHECK(get_uci_section(c,&allow,"applications",12,"settings",8,"allowpermanent",14) > 0 &&
-    allow.flags & UCI_LOOKUP_COMPLETE, "Failed settings lookup");
-  
-  if (strcmp(allow.o->v.string,"0") == 0) {  // force applications to expire
-    CHECK(get_uci_section(c,&exp,"applications",12,"settings",8,"lifetime",8) > 0 &&
-      exp.flags & UCI_LOOKUP_COMPLETE, "Failed settings lookup");
-    CHECK(isNumeric(exp.o->v.string) && atol(exp.o->v.string) >= 0,"Invalid default lifetime");
-    lifetime = atol(exp.o->v.string);
+  if (!settings.loaded)
+    settings_load();
+  return settings.default_lifetime;
+}
+
+/**
+ * Reload the UCI settings the daemon keeps in memory
+ * @return 0=success, -1=fail
+ */
+int uci_config_reload(void) {
+  int ret;
+  
+  config_mark_seen();
+  ret = local_apps_load();
+  if (settings_load() < 0)
+    ret = -1;
+  return ret;
+}
+
+static void uci_config_watch_callback(AvahiWatch *w, int fd, AvahiWatchEvent event, void *userdata) {
+  char buf[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev = NULL;
+  ssize_t len;
+  char *p = NULL;
+  int changed = 0;
+  
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+      ev = (const struct inotify_event*)p;
+      if (ev->len && !strcmp(ev->name, "applications"))
+	changed = 1;
+    }
   }
+  if (changed && config_unchanged()) {
+    DEBUG("(UCI) Applications config changed by our own commit, not reloading");
+    config_reloads_skipped++;
+  } else if (changed) {
+    INFO("(UCI) Applications config changed, reloading");
+    uci_config_reload();
+  }
+}
+
+/**
+ * Watch the UCI applications config and reload it when it changes
+ * @param poll_api poll object to run the watch on
+ * @return 0=success, -1=fail
+ */
+int uci_config_watch_start(const AvahiPoll *poll_api) {
+  assert(poll_api);
+  
+  uci_config_reload();
+  
+  /* uci_commit() replaces the file by renaming, so watch the directory */
+  CHECK((config_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0, "Failed to initialize inotify");
+  CHECK(inotify_add_watch(config_watch_fd, uci_confdir(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) >= 0,
+	"Failed to watch %s", uci_confdir());
+  CHECK((config_watch = poll_api->watch_new(poll_api, config_watch_fd, AVAHI_WATCH_IN, uci_config_watch_callback, NULL)),
+	"Failed to create config watch");
+  config_poll = poll_api;
+  return 0;
   
 error:
-  if (c) uci_free_context(c);
-#endif
-  return lifetime;
-}
\ No newline at end of file
+  if (config_watch_fd >= 0)
+    close(config_watch_fd);
+  config_watch_fd = -1;
+  return -1;
+}
+
+/**
+ * Stop watching the UCI applications config, and free the settings
+ * held in memory
+ */
+void uci_config_watch_stop(void) {
+  if (config_watch)
+    config_poll->watch_free(config_watch);
+  config_watch = NULL;
+  if (config_watch_fd >= 0)
+    close(config_watch_fd);
+  config_watch_fd = -1;
+  local_apps_free();
+  settings.loaded = 0;
+  config_seen_valid = 0;
+}
@@ -25,12 +25,21 @@
 #ifndef UCI_UTILS_H
 #define UCI_UTILS_H
 
+#include <stdio.h>
+
 #include "commotion-service-manager.h"
 
 #ifndef UCIPATH
 #define UCIPATH "/etc/config"
 #endif
 
+/** Seconds UCI changes are held for before being committed together */
+#define UCI_FLUSH_DELAY 2
+/** Number of queued UCI changes that forces an early commit */
+#define UCI_QUEUE_MAX 64
+/** Initial size of the local applications set */
+#define LOCAL_APPS_MIN_SIZE 16
+
 /**
  * Derives the UCI-encoded name of a service, as a concatenation of URI and port
  * @param i ServiceInfo object of the service
@@ -40,19 +49,55 @@
 char *get_uuid(ServiceInfo *i, size_t *uuid_len);
 
 /**
- * Remove a service from UCI
+ * UCI-encoded name of a service, computed on first use and cached in
+ * the ServiceInfo object
+ * @param i ServiceInfo object of the service
+ * @param[out] uuid_len Length of the UCI-encoded name
+ * @return UCI-encoded name, owned by i, or NULL on failure
+ */
+const char *service_uuid(ServiceInfo *i, size_t *uuid_len);
+
+/**
+ * Remove a service from UCI. The removal is queued, and coalesced with
+ * other changes queued for the same service.
  * @param i ServiceInfo object of the service
  * @return 0=success, -1=fail
  */
 int uci_remove(ServiceInfo *i);
 
 /**
- * Write a service to UCI
+ * Write a service to UCI. The write is queued, and coalesced with other
+ * changes queued for the same service.
  * @param i ServiceInfo object of the service
  * @return 0=success, -1=fail
  */
 int uci_write(ServiceInfo *i);
 
+/**
+ * Write all queued changes to UCI, with a single save and commit
+ * @return 0=success, -1=one or more changes failed
+ */
+int uci_flush(void);
+
+/**
+ * Start batching UCI changes. Until this is called, and after
+ * uci_queue_stop(), every change is committed immediately.
+ * @param poll_api poll object to run the flush timer on
+ * @return 0=success, -1=fail
+ */
+int uci_queue_start(const AvahiPoll *poll_api);
+
+/**
+ * Flush any queued UCI changes and stop batching
+ */
+void uci_queue_stop(void);
+
+/**
+ * Print UCI write counters
+ * @param f file to print to
+ */
+void uci_print_stats(FILE *f);
+
 /** 
  * Lookup a UCI section or option
  * @param c uci_context pointer
@@ -74,13 +119,34 @@ int get_uci_section(struct uci_context *c,
 		    const char *op,
 		    const size_t op_len);
 
-/** Determine if a service is local to this node
+/** Determine if a service is local to this node, from the in-memory
+ * set of local applications
  * @param i ServiceInfo object of the service
- * @return 1=it's local, 0=it's not local
+ * @return 1=it's local, 0=it's not local, -1=error
  */
 int is_local(ServiceInfo *i);
 
-/** Fetch default lifetime from UCI
+/**
+ * Reload the UCI settings the daemon keeps in memory
+ * @return 0=success, -1=fail
+ */
+int uci_config_reload(void);
+
+/**
+ * Watch the UCI applications config and reload it when it changes
+ * @param poll_api poll object to run the watch on
+ * @return 0=success, -1=fail
+ */
+int uci_config_watch_start(const AvahiPoll *poll_api);
+
+/**
+ * Stop watching the UCI applications config, and free the settings
+ * held in memory
+ */
+void uci_config_watch_stop(void);
+
+/** Fetch default lifetime from UCI. The settings are read once and
+ * cached until uci_config_reload().
  * @return if applications.settings.allowpermanent==0, returns default lifetime
  */
 long default_lifetime(void);
@@ -33,13 +33,172 @@
 #include "util.h"
 #include "debug.h"
 
-int isHex(const char *str, size_t len) {
-  int i;
-  for (i = 0; i < len; ++i) {
-    if (!isxdigit(str[i]))
+/* Store a field unless it was already seen */
+#define TXT_FIELD(F, K) \
+  if (key_len == sizeof(K) - 1 && !memcmp(key, K, sizeof(K) - 1)) { \
+    if (!fields->F.str) { \
+      fields->F.str = val; \
+      fields->F.len = val_len; \
+    } \
+    continue; \
+  }
+
+int parse_txt_fields(const TxtBlob *txt, TxtFields *fields) {
+  const char *key, *val;
+  size_t key_len, val_len, len;
+  unsigned k;
+  
+  memset(fields, 0, sizeof(TxtFields));
+  
+  for (k = 0; txt && k < txt->count; k++) {
+    key = txt_blob_record(txt, k, &len);
+    if ((key_len = txt->index[k].key_len) == len)
+      continue;
+    val = key + key_len + 1;
+    val_len = len - key_len - 1;
+    
+    if (key_len == sizeof("type") - 1 && !memcmp(key, "type", sizeof("type") - 1)) {
+      if (fields->types_len == TXT_MAX_TYPES)
+	return -1;
+      fields->types[fields->types_len].str = val;
+      fields->types[fields->types_len].len = val_len;
+      fields->types_len++;
+      continue;
+    }
+    TXT_FIELD(name, "name");
+    TXT_FIELD(uri, "uri");
+    TXT_FIELD(icon, "icon");
+    TXT_FIELD(description, "description");
+    TXT_FIELD(ttl, "ttl");
+    TXT_FIELD(lifetime, "lifetime");
+    TXT_FIELD(fingerprint, "fingerprint");
+    TXT_FIELD(signature, "signature");
+  }
+  return 0;
+}
+
+int txt_fields_complete(const TxtFields *fields) {
+  return fields->name.str
+         && fields->uri.str
+         && fields->icon.str
+         && fields->description.str
+         && fields->ttl.str
+         && fields->lifetime.str
+         && fields->signature.str
+         && fields->fingerprint.str;
+}
+
+/** 
+ * Value of each hex digit, or NH (0x10) for chars that aren't hex. Unlike
+ * isxdigit() this doesn't depend on the locale.
+ */
+#define NH 0x10
+static const unsigned char hex_values[256] = {
+  NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH,
+  NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH,
+  NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH,
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, NH, NH, NH, NH, NH, NH,
+  NH, 10, 11, 12, 13, 14, 15, NH, NH, NH, NH, NH, NH, NH, NH, NH,
+  NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH,
+  NH, 10, 11, 12, 13, 14, 15, NH, NH, NH, NH, NH, NH, NH, NH, NH,
+  NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH,
+  NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH,
+  NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH,
+  NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH,
+  NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH,
+  NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH,
+  NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH,
+  NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH,
+  NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH, NH,
+};
+#undef NH
+
+static int isHex_scalar(const char *str, size_t len) {
+  unsigned char acc = 0;
+  size_t i;
+  for (i = 0; i < len; ++i)
+    acc |= hex_values[(unsigned char)str[i]];
+  return !(acc & 0x10);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+
+/* Bytes >= 0x80 compare as negative, so they fail both ranges */
+__attribute__((target("sse2")))
+static int isHex_sse2(const char *str, size_t len) {
+  const __m128i below_0 = _mm_set1_epi8('0' - 1), above_9 = _mm_set1_epi8('9' + 1);
+  const __m128i below_a = _mm_set1_epi8('a' - 1), above_f = _mm_set1_epi8('f' + 1);
+  const __m128i lower = _mm_set1_epi8(0x20);
+  size_t i;
+  
+  for (i = 0; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(str + i));
+    __m128i l = _mm_or_si128(v, lower);
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, below_0), _mm_cmplt_epi8(v, above_9));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(l, below_a), _mm_cmplt_epi8(l, above_f));
+    if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xFFFF)
+      return 0;
+  }
+  return isHex_scalar(str + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int isHex_avx2(const char *str, size_t len) {
+  const __m256i below_0 = _mm256_set1_epi8('0' - 1), max_9 = _mm256_set1_epi8('9');
+  const __m256i below_a = _mm256_set1_epi8('a' - 1), max_f = _mm256_set1_epi8('f');
+  const __m256i lower = _mm256_set1_epi8(0x20);
+  size_t i;
+  
+  for (i = 0; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(str + i));
+    __m256i l = _mm256_or_si256(v, lower);
+    /* AVX2 has no signed less-than, so use andnot(v > max, v > min) */
+    __m256i digit = _mm256_andnot_si256(_mm256_cmpgt_epi8(v, max_9), _mm256_cmpgt_epi8(v, below_0));
+    __m256i alpha = _mm256_andnot_si256(_mm256_cmpgt_epi8(l, max_f), _mm256_cmpgt_epi8(l, below_a));
+    if (_mm256_movemask_epi8(_mm256_or_si256(digit, alpha)) != -1)
       return 0;
   }
-  return 1;
+  /* not isHex_sse2(): mixing in legacy SSE code here costs a transition penalty */
+  return isHex_scalar(str + i, len - i);
+}
+#endif
+
+static int isHex_dispatch(const char *str, size_t len);
+static int (*isHex_impl)(const char *str, size_t len) = isHex_dispatch;
+
+/* Pick the best implementation for this CPU on first use */
+static int isHex_dispatch(const char *str, size_t len) {
+  int (*impl)(const char *, size_t) = isHex_scalar;
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    impl = isHex_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    impl = isHex_sse2;
+#endif
+  isHex_impl = impl;
+  return impl(str, len);
+}
+
+int isHex(const char *str, size_t len) {
+  return isHex_impl(str, len);
+}
+
+int hexDecode(const char *hex, size_t hex_len, unsigned char *out) {
+  unsigned char hi, lo, acc = 0;
+  size_t i;
+  
+  if (hex_len % 2)
+    return -1;
+  for (i = 0; i < hex_len; i += 2) {
+    hi = hex_values[(unsigned char)hex[i]];
+    lo = hex_values[(unsigned char)hex[i + 1]];
+    acc |= hi | lo;
+    out[i / 2] = (hi << 4) | (lo & 0x0F);
+  }
+  return (acc & 0x10) ? -1 : 0;
 }
 
 int isNumeric (const char *s)
@@ -70,12 +229,24 @@ int isValidLifetime(const char *lifetime_str) {
   return isNumeric(lifetime_str) && atol(lifetime_str) >= 0;
 }
 
+/* 
+ * A NUL inside the first len chars fails the hex check, so checking the
+ * terminator afterwards is equivalent to strlen(s) == len.
+ */
 int isValidFingerprint(const char *sid, size_t sid_len) {
-  return sid_len == FINGERPRINT_LEN && strlen(sid) == FINGERPRINT_LEN && isHex(sid,sid_len);
+  return sid_len == FINGERPRINT_LEN && isHex(sid,sid_len) && sid[sid_len] == '\0';
 }
 
 int isValidSignature(const char *sig, size_t sig_len) {
-  return sig_len == SIG_LENGTH && strlen(sig) == SIG_LENGTH && isHex(sig,sig_len);
+  return sig_len == SIG_LENGTH && isHex(sig,sig_len) && sig[sig_len] == '\0';
+}
+
+int decodeFingerprint(const char *sid, size_t sid_len, unsigned char *sid_bin) {
+  return sid_len == FINGERPRINT_LEN && hexDecode(sid,sid_len,sid_bin) == 0 && sid[sid_len] == '\0';
+}
+
+int decodeSignature(const char *sig, size_t sig_len, unsigned char *sig_bin) {
+  return sig_len == SIG_LENGTH && hexDecode(sig,sig_len,sig_bin) == 0 && sig[sig_len] == '\0';
 }
 
 /**
@@ -97,7 +268,7 @@ int cmpstringp(const void *p1, const void *p2) {
  * @return pointer to escaped string
  * @warning returned string must be freed by caller
  */
-char *uci_escape(char *to_escape, size_t to_escape_len, size_t *escaped_len) {
+char *uci_escape(const char *to_escape, size_t to_escape_len, size_t *escaped_len) {
   char *escaped = NULL;
   char escaped_char[5];
   int replacement_len = 0;
@@ -135,6 +306,45 @@ error:
   return escaped;
 }
 
+void sb_append_escaped(StrBuilder *sb, const char *s, size_t n) {
+  size_t j, run = 0;
+  
+  for (j = 0; j < n; j++) {
+    switch (s[j]) {
+      case '\"':
+	sb_append(sb, s + run, j - run);
+	sb_append(sb, ESCAPE_QUOTE, ESCAPE_QUOTE_LEN);
+	run = j + 1;
+	break;
+      case '\n':
+	sb_append(sb, s + run, j - run);
+	sb_append(sb, ESCAPE_LF, ESCAPE_LF_LEN);
+	run = j + 1;
+	break;
+      case '\r':
+	sb_append(sb, s + run, j - run);
+	sb_append(sb, ESCAPE_CR, ESCAPE_CR_LEN);
+	run = j + 1;
+	break;
+    }
+  }
+  sb_append(sb, s + run, n - run);
+}
+
+int sb_alloc(StrBuilder *sb) {
+  if (!(sb->buf = (char*)malloc(sb->len + 1)))
+    return -1;
+  sb->len = 0;
+  return 0;
+}
+
+char *sb_finish(StrBuilder *sb) {
+  char *ret = sb->buf;
+  ret[sb->len] = '\0';
+  sb->buf = NULL;
+  return ret;
+}
+
 /**
  * Escape a string for use in printing service to file. Escapes \",\\n,\\r.
  * @param[in] to_escape the string to escape
@@ -143,87 +353,47 @@ error:
  * @warning returned string must be freed by caller
  */
 char *escape(char *to_escape, int *escaped_len) {
-  char *escaped = NULL;
-  char *escape_quote = ESCAPE_QUOTE;
-  char *escape_lf = ESCAPE_LF;
-  char *escape_cr = ESCAPE_CR;
-  int i = 0;
-  int to_escape_len = strlen(to_escape);
+  StrBuilder sb = {0};
+  size_t to_escape_len = strlen(to_escape);
+  int pass;
   
   *escaped_len = 0;
-  while (i<to_escape_len) {
-    
-    /*
-     * Our alloc'd size is always one ahead 
-     * of the string length to accommodate 
-     * the NULL for the NULL-termination.
-     */
-    switch (to_escape[i]) {
-      case '\"':
-	CHECK_MEM((escaped = (char*)realloc(escaped, (*escaped_len) + ESCAPE_QUOTE_LEN + 1)));
-	memcpy(escaped + *escaped_len, escape_quote, ESCAPE_QUOTE_LEN);
-	*escaped_len = *escaped_len + ESCAPE_QUOTE_LEN;
-	break;
-      case '\n':
-	CHECK_MEM((escaped = (char*)realloc(escaped, (*escaped_len) + ESCAPE_LF_LEN + 1)));
-	memcpy(escaped + *escaped_len, escape_lf, ESCAPE_LF_LEN);
-	*escaped_len = *escaped_len + ESCAPE_LF_LEN;
-	break;
-      case '\r':
-	CHECK_MEM((escaped = (char*)realloc(escaped, (*escaped_len) + ESCAPE_CR_LEN + 1)));
-	memcpy(escaped + *escaped_len, escape_cr, ESCAPE_CR_LEN);
-	*escaped_len = *escaped_len + ESCAPE_CR_LEN;
-	break;
-      default:
-	CHECK_MEM((escaped = (char*)realloc(escaped, (*escaped_len)+1+1)));
-	escaped[*escaped_len] = to_escape[i];
-	*escaped_len = *escaped_len + 1;
-    }
-    escaped[*escaped_len] = '\0';
-    i++;
+  for (pass = 0; pass < 2; pass++) {
+    sb_append_escaped(&sb, to_escape, to_escape_len);
+    if (pass == 0)
+      CHECK_MEM(sb_alloc(&sb) == 0);
   }
+  *escaped_len = sb.len;
+  return sb_finish(&sb);
 error:
-  return escaped;
+  return NULL;
 }
 
 /**
  * Convert an AvahiStringList to a string
  */
 char *txt_list_to_string(AvahiStringList *txt) {
-  char *list = NULL;
-  char *open_delimiter = OPEN_DELIMITER;
-  char *close_delimiter = CLOSE_DELIMITER;
-  char *field_delimiter = FIELD_DELIMITER;
-  int list_len = 0;
-  for (; txt; txt = txt->next) {
-    int escaped_len = 0;
-    char *escaped = escape(txt->text, &escaped_len);
-    
-    CHECK_MEM((list = (char*)realloc(list, list_len + 
-    OPEN_DELIMITER_LEN +
-    CLOSE_DELIMITER_LEN +
-    escaped_len + 
-    1)));
-    list[list_len] = '\0';
-    
-    strcat(list, open_delimiter);
-    strcat(list, escaped);
-    strcat(list, close_delimiter);
-    
-    list_len += escaped_len + OPEN_DELIMITER_LEN + CLOSE_DELIMITER_LEN;
-    list[list_len] = '\0';
-    
-    if (txt->next) {
-      CHECK_MEM((list = (char*)realloc(list, list_len + FIELD_DELIMITER_LEN + 1)));
-      strcat(list, field_delimiter);
-      list_len += FIELD_DELIMITER_LEN;
-      list[list_len] = '\0';
+  StrBuilder sb = {0};
+  AvahiStringList *t;
+  int pass;
+  
+  if (!txt)
+    return NULL;
+  
+  for (pass = 0; pass < 2; pass++) {
+    for (t = txt; t; t = t->next) {
+      sb_append(&sb, OPEN_DELIMITER, OPEN_DELIMITER_LEN);
+      sb_append_escaped(&sb, (const char*)t->text, strnlen((const char*)t->text, t->size));
+      sb_append(&sb, CLOSE_DELIMITER, CLOSE_DELIMITER_LEN);
+      if (t->next)
+	sb_append(&sb, FIELD_DELIMITER, FIELD_DELIMITER_LEN);
     }
-    
-    free(escaped);
+    if (pass == 0)
+      CHECK_MEM(sb_alloc(&sb) == 0);
   }
+  return sb_finish(&sb);
 error:
-  return list;
+  return NULL;
 }
 
 // TODO document
@@ -25,8 +25,12 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <string.h>
+
 #include <avahi-core/core.h>
 
+#include "txt-blob.h"
+
 #define ESCAPE_QUOTE "&quot;"
 #define ESCAPE_QUOTE_LEN 6
 #define ESCAPE_LF "&#10;"
@@ -41,7 +45,79 @@
 #define FIELD_DELIMITER ","
 #define FIELD_DELIMITER_LEN 1
 
+/** Max number of type txt fields accepted in an announcement */
+#define TXT_MAX_TYPES 32
+
+/** 
+ * A value inside a TxtBlob record, pointing into the blob's own
+ * storage. Since a value runs to the end of its record, and records are
+ * NUL-terminated, str is also a valid C string.
+ */
+typedef struct {
+  const char *str;
+  size_t len;
+} TxtView;
+
+/** The txt fields of a service announcement */
+typedef struct {
+  TxtView name;
+  TxtView uri;
+  TxtView icon;
+  TxtView description;
+  TxtView ttl;
+  TxtView lifetime;
+  TxtView fingerprint;
+  TxtView signature;
+  TxtView types[TXT_MAX_TYPES];
+  int types_len;
+} TxtFields;
+
+/**
+ * Parse the txt fields of an announcement in a single pass, without
+ * copying. If a field appears more than once, the first one is used.
+ * @param txt txt fields, or NULL
+ * @param[out] fields views into txt; unset fields have str == NULL
+ * @return 0=success, -1=too many type fields
+ */
+int parse_txt_fields(const TxtBlob *txt, TxtFields *fields);
+
+/**
+ * @return 1 if all fields required in an announcement are present, 0 otherwise
+ */
+int txt_fields_complete(const TxtFields *fields);
+
+/**
+ * Check that a string is all hex digits. Uses SSE2/AVX2 where the CPU
+ * supports it, and is not affected by locale.
+ * @param str string to check; must have at least len readable bytes
+ * @param len number of chars to check
+ * @return 1 if all len chars are hex digits, 0 otherwise
+ */
 int isHex(const char *str, size_t len);
+
+/**
+ * Validate and decode a hex string into binary
+ * @param hex hex string; must have at least hex_len readable bytes
+ * @param hex_len number of hex chars, must be even
+ * @param[out] out buffer of at least hex_len/2 bytes
+ * @return 0=success, -1=not valid hex
+ */
+int hexDecode(const char *hex, size_t hex_len, unsigned char *out);
+
+/**
+ * Validate a fingerprint txt field and decode it to a binary Serval ID
+ * @param[out] sid_bin buffer of FINGERPRINT_LEN/2 bytes
+ * @return 1 if valid, 0 otherwise
+ */
+int decodeFingerprint(const char *sid, size_t sid_len, unsigned char *sid_bin);
+
+/**
+ * Validate a signature txt field and decode it to a binary signature
+ * @param[out] sig_bin buffer of SIG_LENGTH/2 bytes
+ * @return 1 if valid, 0 otherwise
+ */
+int decodeSignature(const char *sig, size_t sig_len, unsigned char *sig_bin);
+
 int isNumeric (const char *s);
 int isUCIEncoded(const char *s, size_t s_len);
 int isValidTtl(const char *ttl);
@@ -62,7 +138,43 @@ int cmpstringp(const void *p1, const void *p2);
  * @return pointer to escaped string
  * @warning returned string must be freed by caller
  */
-char *uci_escape(char *to_escape, size_t to_escape_len, size_t *escaped_len);
+char *uci_escape(const char *to_escape, size_t to_escape_len, size_t *escaped_len);
+
+/**
+ * Two-pass string builder. Run the same sequence of appends twice: first
+ * with buf == NULL, which only measures, then after sb_alloc(), which
+ * fills. The output is allocated exactly once, at its final size.
+ */
+typedef struct {
+  char *buf;
+  size_t len;
+} StrBuilder;
+
+/**
+ * Append bytes to a string builder
+ */
+static inline void sb_append(StrBuilder *sb, const char *s, size_t n) {
+  if (sb->buf)
+    memcpy(sb->buf + sb->len, s, n);
+  sb->len += n;
+}
+
+/**
+ * Append a string, escaping ",\n,\r as done by escape()
+ */
+void sb_append_escaped(StrBuilder *sb, const char *s, size_t n);
+
+/**
+ * End the sizing pass: allocate the buffer and rewind for the fill pass
+ * @return 0=success, -1=out of memory
+ */
+int sb_alloc(StrBuilder *sb);
+
+/**
+ * End the fill pass: NUL-terminate and hand over the buffer
+ * @return the built string, to be freed by caller
+ */
+char *sb_finish(StrBuilder *sb);
 
 /**
  * Escape a string for use in printing service to file. Escapes ",\n,\r.
@@ -0,0 +1,671 @@
+/**
+ *       @file  verify.c
+ *      @brief  asynchronous signature verification for the Commotion Service Manager
+ *
+ * Verifying an announcement takes several blocking round trips (Serval
+ * keyring, commotiond), so it is done on a small pool of worker threads.
+ * Finished jobs are written back to the main loop over a pipe, so all
+ * ServiceInfo bookkeeping still happens on the Avahi poll thread.
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <pthread.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdint.h>
+#ifdef USESYSLOG
+#include <syslog.h>
+#endif
+
+#include <avahi-common/malloc.h>
+
+#include "commotion.h"
+
+#include "commotion-service-manager.h"
+#include "verify.h"
+#include "util.h"
+#include "debug.h"
+
+extern struct arguments arguments;
+
+// from libcommotion_serval-sas
+extern int keyring_send_sas_request_client(const char *sid_str, 
+				    const size_t sid_len,
+				    char *sas_buf,
+				    const size_t sas_buf_len);
+
+struct VerifyJob {
+  ServiceInfo *service;  /**< Set on the main loop, under queue_lock; NULL once cancelled */
+  ServiceInfo snapshot;  /**< Private copy of the fields verify_announcement() reads */
+  int verdict;
+  int orphaned;          /**< Result couldn't be returned; verify_cancel() frees it. Under queue_lock */
+  struct VerifyJob *next;
+};
+typedef struct VerifyJob VerifyJob;
+
+static pthread_t workers[MAX_VERIFY_THREADS];
+static int n_workers = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static VerifyJob *queue_head = NULL, *queue_tail = NULL;
+static int stopping = 0;
+
+/** Pool of commotiond connections, shared by all verifications */
+static struct {
+  co_obj_t *conn;
+  int in_use;
+} co_pool[CO_POOL_SIZE];
+static pthread_mutex_t co_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t co_pool_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long co_connects = 0;          /**< connections actually opened */
+static unsigned long co_connects_avoided = 0;  /**< calls served by an existing connection */
+
+/** Cache of signing keys, keyed by (upper-cased) Serval ID */
+typedef struct SasEntry {
+  char sid[FINGERPRINT_LEN + 1];
+  char sas[2*SAS_SIZE + 1];
+  int found;         /**< 0 for negative entries, where the keyring lookup failed */
+  time_t expires;
+  int in_use;
+  struct SasEntry *next; /**< hash chain */
+} SasEntry;
+static SasEntry *sas_entries = NULL;
+static SasEntry **sas_buckets = NULL;
+static int sas_cache_size = DEFAULT_SAS_CACHE_SIZE;
+static int sas_n_buckets = 0;
+static int sas_cache_ttl = DEFAULT_SAS_CACHE_TTL;
+static int sas_victim = 0; /**< next entry to evict once the cache is full */
+static pthread_mutex_t sas_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long sas_hits = 0, sas_negative_hits = 0, sas_misses = 0;
+
+/**
+ * Cache of verification results. Entries are found by a digest of the
+ * (fingerprint, signature, signing template) triple, but the full
+ * template is kept and compared on lookup, so a digest collision can
+ * never make an unverified announcement look valid. The fingerprint and
+ * signature are kept decoded, so they compare regardless of hex case.
+ */
+typedef struct VerdictEntry {
+  uint64_t digest;
+  unsigned char sid[FINGERPRINT_LEN / 2];
+  unsigned char sig[SIG_LENGTH / 2];
+  char *tmpl;
+  size_t tmpl_len;
+  int verdict;
+  struct VerdictEntry *next; /**< hash chain */
+} VerdictEntry;
+static VerdictEntry *verdict_entries = NULL;
+static VerdictEntry **verdict_buckets = NULL;
+static int verdict_cache_size = DEFAULT_VERDICT_CACHE_SIZE;
+static int verdict_n_buckets = 0;
+static int verdict_victim = 0;
+static pthread_mutex_t verdict_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long verdict_hits = 0, verdict_misses = 0;
+
+static int done_pipe[2] = {-1, -1};
+static AvahiWatch *done_watch = NULL;
+static const AvahiPoll *api = NULL;
+static VerifyCallback verify_done = NULL;
+
+static void job_free(VerifyJob *job) {
+  avahi_free(job->snapshot.type);
+  avahi_free(job->snapshot.domain);
+  avahi_free(job->snapshot.txt);
+  avahi_free(job);
+}
+
+static void *verify_worker(void *arg) {
+  VerifyJob *job;
+  ssize_t n;
+
+  for (;;) {
+    pthread_mutex_lock(&queue_lock);
+    while (!queue_head && !stopping)
+      pthread_cond_wait(&queue_cond, &queue_lock);
+    if (stopping) {
+      pthread_mutex_unlock(&queue_lock);
+      break;
+    }
+    job = queue_head;
+    if (!(queue_head = job->next))
+      queue_tail = NULL;
+    pthread_mutex_unlock(&queue_lock);
+
+    job->verdict = verify_announcement(&job->snapshot);
+
+    /* pointer-sized writes to a pipe are atomic */
+    while ((n = write(done_pipe[1], &job, sizeof(job))) < 0 && errno == EINTR);
+    if (n != sizeof(job)) {
+      ERROR("Failed to return verification result");
+      /* the service still points at the job, so only free it if it
+       * was cancelled; otherwise leave it to verify_cancel() */
+      pthread_mutex_lock(&queue_lock);
+      if (job->service)
+	job->orphaned = 1;
+      else
+	job_free(job);
+      pthread_mutex_unlock(&queue_lock);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Runs on the main loop whenever workers have finished jobs
+ */
+static void verify_done_callback(AvahiWatch *w, int fd, AvahiWatchEvent event, void *userdata) {
+  VerifyJob *job;
+  ServiceInfo *i;
+
+  while (read(fd, &job, sizeof(job)) == sizeof(job)) {
+    if ((i = job->service)) {
+      i->verify_job = NULL;
+      verify_done(i, job->verdict);
+    }
+    job_free(job);
+  }
+}
+
+int verify_pool_start(const AvahiPoll *poll_api, int n_threads, VerifyCallback callback) {
+  int j;
+
+  assert(poll_api && callback);
+
+  if (n_threads > MAX_VERIFY_THREADS)
+    n_threads = MAX_VERIFY_THREADS;
+  if (n_threads <= 0)
+    return 0;
+
+  CHECK(pipe(done_pipe) == 0, "Failed to create verification pipe");
+  CHECK(fcntl(done_pipe[0], F_SETFL, O_NONBLOCK) == 0, "Failed to set verification pipe non-blocking");
+  fcntl(done_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(done_pipe[1], F_SETFD, FD_CLOEXEC);
+
+  api = poll_api;
+  verify_done = callback;
+  CHECK((done_watch = api->watch_new(api, done_pipe[0], AVAHI_WATCH_IN, verify_done_callback, NULL)),
+	"Failed to watch verification pipe");
+
+  stopping = 0;
+  for (j = 0; j < n_threads; j++) {
+    CHECK(pthread_create(&workers[j], NULL, verify_worker, NULL) == 0, "Failed to start verification thread");
+    n_workers++;
+  }
+  INFO("Started %d verification threads", n_workers);
+  return 0;
+
+error:
+  verify_pool_stop();
+  return -1;
+}
+
+void verify_pool_stop(void) {
+  VerifyJob *job;
+  int j;
+
+  pthread_mutex_lock(&queue_lock);
+  stopping = 1;
+  pthread_cond_broadcast(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+  for (j = 0; j < n_workers; j++)
+    pthread_join(workers[j], NULL);
+  n_workers = 0;
+
+  /* drop jobs that never started, and results that were never collected */
+  while ((job = queue_head)) {
+    queue_head = job->next;
+    if (job->service)
+      job->service->verify_job = NULL;
+    job_free(job);
+  }
+  queue_tail = NULL;
+  if (done_pipe[0] >= 0) {
+    while (read(done_pipe[0], &job, sizeof(job)) == sizeof(job)) {
+      if (job->service)
+	job->service->verify_job = NULL;
+      job_free(job);
+    }
+  }
+
+  if (done_watch) {
+    api->watch_free(done_watch);
+    done_watch = NULL;
+  }
+  for (j = 0; j < 2; j++) {
+    if (done_pipe[j] >= 0)
+      close(done_pipe[j]);
+    done_pipe[j] = -1;
+  }
+}
+
+int verify_pool_running(void) {
+  return n_workers > 0;
+}
+
+int verify_submit(ServiceInfo *i) {
+  VerifyJob *job = NULL;
+
+  assert(i && !i->verify_job);
+
+  CHECK_MEM((job = avahi_new0(VerifyJob, 1)));
+  job->service = i;
+  job->snapshot.port = i->port;
+  CHECK_MEM((job->snapshot.type = avahi_strdup(i->type)));
+  CHECK_MEM((job->snapshot.domain = avahi_strdup(i->domain)));
+  CHECK_MEM((job->snapshot.txt = txt_blob_copy(i->txt)));
+  job->verdict = 1;
+  i->verify_job = job;
+
+  pthread_mutex_lock(&queue_lock);
+  if (queue_tail)
+    queue_tail->next = job;
+  else
+    queue_head = job;
+  queue_tail = job;
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+
+  return 0;
+error:
+  if (job)
+    job_free(job);
+  return -1;
+}
+
+void verify_cancel(ServiceInfo *i) {
+  VerifyJob *job = i->verify_job;
+
+  if (!job)
+    return;
+  i->verify_job = NULL;
+  pthread_mutex_lock(&queue_lock);
+  if (job->orphaned)
+    job_free(job);
+  else
+    job->service = NULL;
+  pthread_mutex_unlock(&queue_lock);
+}
+
+co_obj_t *co_pool_get(void) {
+  co_obj_t *conn = NULL;
+  int j, slot = -1;
+
+  pthread_mutex_lock(&co_pool_lock);
+  for (;;) {
+    /* prefer a slot that's already connected */
+    for (j = 0; j < CO_POOL_SIZE; j++) {
+      if (co_pool[j].in_use)
+	continue;
+      if (co_pool[j].conn) {
+	slot = j;
+	break;
+      }
+      if (slot < 0)
+	slot = j;
+    }
+    if (slot >= 0)
+      break;
+    pthread_cond_wait(&co_pool_cond, &co_pool_lock);
+  }
+  co_pool[slot].in_use = 1;
+  if ((conn = co_pool[slot].conn))
+    co_connects_avoided++;
+  pthread_mutex_unlock(&co_pool_lock);
+
+  if (!conn) {
+    /* connect without holding the lock, the slot is reserved for us */
+    conn = co_connect(arguments.co_sock, strlen(arguments.co_sock) + 1);
+    pthread_mutex_lock(&co_pool_lock);
+    if (conn) {
+      co_pool[slot].conn = conn;
+      co_connects++;
+    } else {
+      co_pool[slot].in_use = 0;
+      pthread_cond_signal(&co_pool_cond);
+    }
+    pthread_mutex_unlock(&co_pool_lock);
+  }
+
+  return conn;
+}
+
+void co_pool_put(co_obj_t *conn, int broken) {
+  int j;
+
+  if (!conn)
+    return;
+
+  pthread_mutex_lock(&co_pool_lock);
+  for (j = 0; j < CO_POOL_SIZE; j++) {
+    if (co_pool[j].conn == conn) {
+      if (broken)
+	co_pool[j].conn = NULL;
+      co_pool[j].in_use = 0;
+      break;
+    }
+  }
+  pthread_cond_signal(&co_pool_cond);
+  pthread_mutex_unlock(&co_pool_lock);
+
+  if (broken)
+    co_disconnect(conn);
+}
+
+void co_pool_shutdown(void) {
+  int j;
+
+  pthread_mutex_lock(&co_pool_lock);
+  for (j = 0; j < CO_POOL_SIZE; j++) {
+    if (co_pool[j].conn && !co_pool[j].in_use) {
+      co_disconnect(co_pool[j].conn);
+      co_pool[j].conn = NULL;
+    }
+  }
+  pthread_mutex_unlock(&co_pool_lock);
+}
+
+static time_t monotonic_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static unsigned int sid_hash(const char *sid) {
+  unsigned int hash = 2166136261u;
+  for (; *sid; sid++) {
+    hash ^= (unsigned char)*sid;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void sas_cache_configure(int size, int ttl) {
+  pthread_mutex_lock(&sas_lock);
+  assert(!sas_entries);
+  sas_cache_size = size > 0 ? size : 0;
+  sas_cache_ttl = ttl > 0 ? ttl : 0;
+  pthread_mutex_unlock(&sas_lock);
+}
+
+void sas_cache_free(void) {
+  pthread_mutex_lock(&sas_lock);
+  avahi_free(sas_entries);
+  avahi_free(sas_buckets);
+  sas_entries = NULL;
+  sas_buckets = NULL;
+  sas_n_buckets = 0;
+  sas_victim = 0;
+  pthread_mutex_unlock(&sas_lock);
+}
+
+/* must hold sas_lock */
+static SasEntry *sas_cache_find(const char *sid, unsigned int hash) {
+  SasEntry *e;
+  if (!sas_buckets)
+    return NULL;
+  for (e = sas_buckets[hash & (sas_n_buckets - 1)]; e; e = e->next)
+    if (!strcmp(e->sid, sid))
+      return e;
+  return NULL;
+}
+
+/* must hold sas_lock */
+static void sas_cache_insert(const char *sid, unsigned int hash, const char *sas) {
+  SasEntry *e, **pp;
+  
+  if (!sas_cache_size || !sas_cache_ttl)
+    return;
+  
+  if (!sas_entries) {
+    for (sas_n_buckets = 1; sas_n_buckets < sas_cache_size; sas_n_buckets <<= 1);
+    sas_entries = avahi_new0(SasEntry, sas_cache_size);
+    sas_buckets = avahi_new0(SasEntry*, sas_n_buckets);
+    if (!sas_entries || !sas_buckets) {
+      ERROR("Out of memory.");
+      avahi_free(sas_entries);
+      avahi_free(sas_buckets);
+      sas_entries = NULL;
+      sas_buckets = NULL;
+      return;
+    }
+  }
+  
+  if (!(e = sas_cache_find(sid, hash))) {
+    /* take the next slot round-robin, evicting whatever is there */
+    e = &sas_entries[sas_victim];
+    sas_victim = (sas_victim + 1) % sas_cache_size;
+    if (e->in_use) {
+      for (pp = &sas_buckets[sid_hash(e->sid) & (sas_n_buckets - 1)]; *pp != e; pp = &(*pp)->next);
+      *pp = e->next;
+    }
+    strcpy(e->sid, sid);
+    e->in_use = 1;
+    e->next = sas_buckets[hash & (sas_n_buckets - 1)];
+    sas_buckets[hash & (sas_n_buckets - 1)] = e;
+  }
+  
+  if ((e->found = (sas != NULL))) {
+    strncpy(e->sas, sas, sizeof(e->sas) - 1);
+    e->sas[sizeof(e->sas) - 1] = '\0';
+    e->expires = monotonic_now() + sas_cache_ttl;
+  } else {
+    e->sas[0] = '\0';
+    e->expires = monotonic_now() + (sas_cache_ttl < SAS_NEGATIVE_TTL ? sas_cache_ttl : SAS_NEGATIVE_TTL);
+  }
+}
+
+int sas_fetch(const char *sid, char *sas_buf, size_t sas_buf_len) {
+  char key[FINGERPRINT_LEN + 1];
+  unsigned int hash;
+  SasEntry *e;
+  int j, found = 0;
+  
+  assert(sas_buf_len >= 2*SAS_SIZE + 1);
+  
+  if (strlen(sid) != FINGERPRINT_LEN)
+    return 0;
+  for (j = 0; j < FINGERPRINT_LEN; j++)
+    key[j] = toupper((unsigned char)sid[j]);
+  key[FINGERPRINT_LEN] = '\0';
+  hash = sid_hash(key);
+  
+  pthread_mutex_lock(&sas_lock);
+  if ((e = sas_cache_find(key, hash)) && e->expires > monotonic_now()) {
+    if (e->found) {
+      sas_hits++;
+      strcpy(sas_buf, e->sas);
+    } else {
+      sas_negative_hits++;
+    }
+    found = e->found;
+    pthread_mutex_unlock(&sas_lock);
+    return found;
+  }
+  sas_misses++;
+  pthread_mutex_unlock(&sas_lock);
+  
+  for (j = 0; j < SAS_FETCH_MAX_ATTEMPTS; j++) {
+    found = keyring_send_sas_request_client(sid,strlen(sid),sas_buf,sas_buf_len);
+    if (found)
+      break;
+  }
+  
+  pthread_mutex_lock(&sas_lock);
+  sas_cache_insert(key, hash, found ? sas_buf : NULL);
+  pthread_mutex_unlock(&sas_lock);
+  
+  return found;
+}
+
+static uint64_t fnv1a_64(uint64_t hash, const char *data, size_t len) {
+  size_t j;
+  for (j = 0; j < len; j++) {
+    hash ^= (unsigned char)data[j];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static uint64_t verdict_digest(const unsigned char *sid, const unsigned char *sig, const char *tmpl, size_t tmpl_len) {
+  uint64_t hash = 14695981039346656037ULL;
+  hash = fnv1a_64(hash, (const char*)sid, FINGERPRINT_LEN / 2);
+  hash = fnv1a_64(hash, (const char*)sig, SIG_LENGTH / 2);
+  return fnv1a_64(hash, tmpl, tmpl_len);
+}
+
+void verdict_cache_configure(int size) {
+  pthread_mutex_lock(&verdict_lock);
+  assert(!verdict_entries);
+  verdict_cache_size = size > 0 ? size : 0;
+  pthread_mutex_unlock(&verdict_lock);
+}
+
+void verdict_cache_free(void) {
+  int j;
+  pthread_mutex_lock(&verdict_lock);
+  if (verdict_entries) {
+    for (j = 0; j < verdict_cache_size; j++)
+      avahi_free(verdict_entries[j].tmpl);
+  }
+  avahi_free(verdict_entries);
+  avahi_free(verdict_buckets);
+  verdict_entries = NULL;
+  verdict_buckets = NULL;
+  verdict_n_buckets = 0;
+  verdict_victim = 0;
+  pthread_mutex_unlock(&verdict_lock);
+}
+
+/* must hold verdict_lock */
+static VerdictEntry *verdict_cache_find(uint64_t digest, const unsigned char *sid, const unsigned char *sig, const char *tmpl, size_t tmpl_len) {
+  VerdictEntry *e;
+  if (!verdict_buckets)
+    return NULL;
+  for (e = verdict_buckets[digest & (verdict_n_buckets - 1)]; e; e = e->next) {
+    if (e->digest == digest
+        && e->tmpl_len == tmpl_len
+        && !memcmp(e->sid, sid, sizeof(e->sid))
+        && !memcmp(e->sig, sig, sizeof(e->sig))
+        && !memcmp(e->tmpl, tmpl, tmpl_len))
+      return e;
+  }
+  return NULL;
+}
+
+int verdict_cache_lookup(const char *sid, const char *sig, const char *tmpl, size_t tmpl_len) {
+  VerdictEntry *e;
+  unsigned char sid_bin[FINGERPRINT_LEN / 2], sig_bin[SIG_LENGTH / 2];
+  int verdict = -1;
+  
+  if (!verdict_cache_size
+      || !decodeFingerprint(sid, strlen(sid), sid_bin)
+      || !decodeSignature(sig, strlen(sig), sig_bin))
+    return -1;
+  
+  pthread_mutex_lock(&verdict_lock);
+  if ((e = verdict_cache_find(verdict_digest(sid_bin, sig_bin, tmpl, tmpl_len), sid_bin, sig_bin, tmpl, tmpl_len))) {
+    verdict = e->verdict;
+    verdict_hits++;
+  } else {
+    verdict_misses++;
+  }
+  pthread_mutex_unlock(&verdict_lock);
+  return verdict;
+}
+
+void verdict_cache_insert(const char *sid, const char *sig, const char *tmpl, size_t tmpl_len, int verdict) {
+  VerdictEntry *e, **pp;
+  unsigned char sid_bin[FINGERPRINT_LEN / 2], sig_bin[SIG_LENGTH / 2];
+  uint64_t digest;
+  char *tmpl_copy = NULL;
+  
+  if (!verdict_cache_size
+      || !decodeFingerprint(sid, strlen(sid), sid_bin)
+      || !decodeSignature(sig, strlen(sig), sig_bin))
+    return;
+  
+  digest = verdict_digest(sid_bin, sig_bin, tmpl, tmpl_len);
+  CHECK_MEM((tmpl_copy = avahi_memdup(tmpl, tmpl_len)));
+  
+  pthread_mutex_lock(&verdict_lock);
+  if (!verdict_entries) {
+    for (verdict_n_buckets = 1; verdict_n_buckets < verdict_cache_size; verdict_n_buckets <<= 1);
+    verdict_entries = avahi_new0(VerdictEntry, verdict_cache_size);
+    verdict_buckets = avahi_new0(VerdictEntry*, verdict_n_buckets);
+    if (!verdict_entries || !verdict_buckets) {
+      avahi_free(verdict_entries);
+      avahi_free(verdict_buckets);
+      verdict_entries = NULL;
+      verdict_buckets = NULL;
+      pthread_mutex_unlock(&verdict_lock);
+      SENTINEL("Out of memory.");
+    }
+  }
+  
+  if ((e = verdict_cache_find(digest, sid_bin, sig_bin, tmpl, tmpl_len))) {
+    /* another thread verified the same announcement concurrently */
+    e->verdict = verdict;
+    pthread_mutex_unlock(&verdict_lock);
+    goto error;
+  }
+  
+  e = &verdict_entries[verdict_victim];
+  verdict_victim = (verdict_victim + 1) % verdict_cache_size;
+  if (e->tmpl) {
+    for (pp = &verdict_buckets[e->digest & (verdict_n_buckets - 1)]; *pp != e; pp = &(*pp)->next);
+    *pp = e->next;
+    avahi_free(e->tmpl);
+  }
+  e->digest = digest;
+  memcpy(e->sid, sid_bin, sizeof(e->sid));
+  memcpy(e->sig, sig_bin, sizeof(e->sig));
+  e->tmpl = tmpl_copy;
+  e->tmpl_len = tmpl_len;
+  e->verdict = verdict;
+  e->next = verdict_buckets[digest & (verdict_n_buckets - 1)];
+  verdict_buckets[digest & (verdict_n_buckets - 1)] = e;
+  tmpl_copy = NULL;
+  pthread_mutex_unlock(&verdict_lock);
+  
+error:
+  if (tmpl_copy)
+    avahi_free(tmpl_copy);
+}
+
+void verify_print_stats(FILE *f) {
+  pthread_mutex_lock(&co_pool_lock);
+  fprintf(f, "co_connects=%lu\n", co_connects);
+  fprintf(f, "co_connects_avoided=%lu\n", co_connects_avoided);
+  pthread_mutex_unlock(&co_pool_lock);
+  pthread_mutex_lock(&sas_lock);
+  fprintf(f, "sas_cache_hits=%lu\n", sas_hits);
+  fprintf(f, "sas_cache_negative_hits=%lu\n", sas_negative_hits);
+  fprintf(f, "sas_cache_misses=%lu\n", sas_misses);
+  pthread_mutex_unlock(&sas_lock);
+  pthread_mutex_lock(&verdict_lock);
+  fprintf(f, "verdict_cache_hits=%lu\n", verdict_hits);
+  fprintf(f, "verdict_cache_misses=%lu\n", verdict_misses);
+  pthread_mutex_unlock(&verdict_lock);
+}
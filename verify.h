@@ -0,0 +1,171 @@
+/**
+ *       @file  verify.h
+ *      @brief  asynchronous signature verification for the Commotion Service Manager
+ *
+ * This file is part of Commotion, Copyright (c) 2013, Josh King
+ *
+ * Commotion is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Commotion is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Commotion.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================================
+ */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stdio.h>
+
+#include "commotion.h"
+
+#include "commotion-service-manager.h"
+
+#define DEFAULT_VERIFY_THREADS 2
+#define MAX_VERIFY_THREADS 16
+/** Number of long-lived commotiond connections shared by verifications */
+#define CO_POOL_SIZE 4
+
+/** Size (in bytes) of Serval signing keys; from libcommotion_serval-sas */
+#define SAS_SIZE 32
+/** Max number of SIDs whose signing keys are cached */
+#define DEFAULT_SAS_CACHE_SIZE 256
+/** Seconds a cached signing key is trusted before asking the keyring again */
+#define DEFAULT_SAS_CACHE_TTL 3600
+/** Seconds a failed signing key lookup is remembered (capped at the cache TTL) */
+#define SAS_NEGATIVE_TTL 60
+/** Max number of verified announcements remembered */
+#define DEFAULT_VERDICT_CACHE_SIZE 1024
+
+/**
+ * Called on the main loop once a queued verification has finished
+ * @param i the service that was verified
+ * @param verdict 0 if the signature is valid, 1 if it is invalid
+ */
+typedef void (*VerifyCallback)(ServiceInfo *i, int verdict);
+
+/**
+ * Start the verification worker threads
+ * @param poll_api poll object that completed jobs are delivered on
+ * @param n_threads number of worker threads
+ * @param callback function called on the main loop for each completed job
+ * @return 0=success, -1=fail
+ */
+int verify_pool_start(const AvahiPoll *poll_api, int n_threads, VerifyCallback callback);
+
+/**
+ * Stop the worker threads and drop any outstanding jobs
+ */
+void verify_pool_stop(void);
+
+/**
+ * @return 1 if the worker threads are running, 0 if verification is done inline
+ */
+int verify_pool_running(void);
+
+/**
+ * Queue a service for signature verification. The service is in the
+ * pending verification state until the callback is run for it.
+ * @param i the service to verify
+ * @return 0=success, -1=fail
+ */
+int verify_submit(ServiceInfo *i);
+
+/**
+ * Cancel an outstanding verification, e.g. when the service is removed
+ * before its verification finishes. The callback will not be run for it.
+ * @param i the service being verified
+ */
+void verify_cancel(ServiceInfo *i);
+
+/**
+ * Take a commotiond connection from the pool, connecting lazily if the
+ * slot has no live connection. Blocks while all connections are in use.
+ * @return connection, or NULL if connecting failed
+ */
+co_obj_t *co_pool_get(void);
+
+/**
+ * Return a connection to the pool
+ * @param conn connection from co_pool_get()
+ * @param broken if set, the connection is dropped and re-established on next use
+ */
+void co_pool_put(co_obj_t *conn, int broken);
+
+/**
+ * Disconnect all pooled connections
+ */
+void co_pool_shutdown(void);
+
+/**
+ * Set the size and TTL of the signing key cache. Call before verification starts.
+ * @param size max number of cached SIDs, 0 disables the cache
+ * @param ttl seconds a cached key stays valid
+ */
+void sas_cache_configure(int size, int ttl);
+
+/**
+ * Free the signing key cache
+ */
+void sas_cache_free(void);
+
+/**
+ * Fetch the signing key (SAS) for a Serval ID, from the cache if possible
+ * and otherwise from the keyring. Failed keyring lookups are cached too.
+ * @param sid hex Serval ID
+ * @param[out] sas_buf buffer to hold the hex signing key
+ * @param sas_buf_len size of sas_buf, at least 2*SAS_SIZE+1
+ * @return 1 if the key was found, 0 if not
+ */
+int sas_fetch(const char *sid, char *sas_buf, size_t sas_buf_len);
+
+/**
+ * Set the size of the verdict cache. Call before verification starts.
+ * @param size max number of cached verdicts, 0 disables the cache
+ */
+void verdict_cache_configure(int size);
+
+/**
+ * Free the verdict cache
+ */
+void verdict_cache_free(void);
+
+/**
+ * Look up the result of an earlier verification of the same
+ * announcement. Fingerprint and signature are compared decoded, so
+ * differences in hex case don't matter.
+ * @param sid hex Serval ID (fingerprint txt field)
+ * @param sig hex signature (signature txt field)
+ * @param tmpl signing template built from the announcement
+ * @param tmpl_len length of tmpl
+ * @return -1 if not cached or sid/sig aren't valid hex, otherwise the
+ *         cached verdict (0=valid, 1=invalid)
+ */
+int verdict_cache_lookup(const char *sid, const char *sig, const char *tmpl, size_t tmpl_len);
+
+/**
+ * Remember the result of verifying an announcement. Announcements with
+ * an invalid fingerprint or signature aren't cached.
+ * @param sid hex Serval ID (fingerprint txt field)
+ * @param sig hex signature (signature txt field)
+ * @param tmpl signing template built from the announcement
+ * @param tmpl_len length of tmpl
+ * @param verdict 0=valid, 1=invalid
+ */
+void verdict_cache_insert(const char *sid, const char *sig, const char *tmpl, size_t tmpl_len, int verdict);
+
+/**
+ * Print verification counters
+ * @param f file to print to
+ */
+void verify_print_stats(FILE *f);
+
+#endif